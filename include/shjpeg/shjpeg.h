@@ -161,6 +161,18 @@ int shjpeg_get_frame_buffer(shjpeg_context_t	 *context,
  *
  * Width and height of the JPEG image is returned in the context.
  *
+ * The headers are parsed natively first. libjpeg only reads them if
+ * the JPU can't decode the image, or once the decoding falls back to
+ * libjpeg.
+ *
+ * The bytes read here are kept, so decoding replays them and reads on
+ * from where the stream is, rather than calling the init method of
+ * the stream ops to read it again. The stream is thus read once and
+ * may be a pipe or a socket without init. Only a fallback to libjpeg
+ * after the JPU has read further needs a stream that can be rewound.
+ * Until shjpeg_decode_shutdown(), the sops and priv_data of the
+ * context point to libshjpeg's own stream ops.
+ *
  * \param [in,out] context a pointer to the JPEG image context to be returned.
  *
  * \retval 0 success
@@ -171,6 +183,205 @@ int shjpeg_get_frame_buffer(shjpeg_context_t	 *context,
 
 int shjpeg_decode_init(shjpeg_context_t *context);
 
+/**
+ * \brief Parse the headers of a JPEG stream in memory.
+ *
+ * Walks the markers from SOI up to the first SOS segment and returns
+ * what is needed to decide how to decode the image, without creating
+ * a libjpeg decompressor or allocating memory. The whole header has
+ * to be in the buffer, including any APPn segments before the frame
+ * header. No context is needed.
+ *
+ * \param buf [in] start of the JPEG stream.
+ *
+ * \param len [in] number of bytes in buf.
+ *
+ * \param info [out] header information.
+ *
+ * \retval 0 success
+ * \retval -1 not a JPEG stream, or the header is broken or truncated
+ *
+ * \sa shjpeg_decode_init().
+ */
+int shjpeg_probe(const void	*buf,
+		 size_t		 len,
+		 shjpeg_info_t	*info);
+
+/**
+ * \brief Check if the JPU can decode an image.
+ *
+ * Decides from the headers whether an image can be decoded by the
+ * hardware, so that images it can't decode go to libjpeg without a
+ * failed hardware attempt first.
+ *
+ * \param info [in] header information from shjpeg_probe().
+ *
+ * \retval SHJPEG_HW_OK the JPU can decode the image
+ * \retval others the reason why it can't
+ *
+ * \sa shjpeg_probe(), shjpeg_hw_reason_string().
+ */
+shjpeg_hw_reason shjpeg_classify(const shjpeg_info_t *info);
+
+/**
+ * \brief Describe a shjpeg_hw_reason.
+ *
+ * \param reason [in] value returned by shjpeg_classify().
+ *
+ * \return a static string.
+ */
+const char *shjpeg_hw_reason_string(shjpeg_hw_reason reason);
+
+/**
+ * \brief Find the next JPEG image in a Motion JPEG stream.
+ *
+ * Looks for a complete image in a buffer holding part of a stream of
+ * concatenated JPEG images, or of a multipart/x-mixed-replace stream,
+ * whose boundaries and part headers are skipped. The image is found
+ * by walking its markers from SOI to the EOI after the last scan, so
+ * EXIF thumbnails don't get in the way, and it is left in place.
+ *
+ * \param buf [in] part of the stream.
+ *
+ * \param len [in] number of bytes in buf.
+ *
+ * \param pos [in,out] offset in buf to start looking from. Set to the
+ *	  offset of the image found, or, if none is complete, to the
+ *	  first byte to keep when more of the stream is read; the bytes
+ *	  before it can be discarded.
+ *
+ * \param size [out] bytes of the image found.
+ *
+ * \retval 1 an image was found at *pos, the next one is looked for
+ *	   from *pos + *size
+ * \retval 0 no complete image, more of the stream is needed
+ * \retval -1 invalid arguments
+ */
+int shjpeg_mjpeg_find(const void	*buf,
+		      size_t		 len,
+		      size_t		*pos,
+		      size_t		*size);
+
+/**
+ * \brief Get how the current image is to be decoded.
+ *
+ * This could be called only after shjpeg_decode_init() is called.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \retval SHJPEG_HW_OK the image is decoded by the JPU
+ * \retval others the reason why libjpeg decodes it
+ */
+shjpeg_hw_reason shjpeg_decode_get_reason(shjpeg_context_t *context);
+
+/**
+ * \brief Get the hardware/software decisions taken so far.
+ *
+ * Every shjpeg_decode_init(), and every decompression started through
+ * the libjpeg wrapper, counts one decision. The counters are shared
+ * by the whole process.
+ *
+ * \param counts [out] number of images for each shjpeg_hw_reason.
+ */
+void shjpeg_get_decode_stats(unsigned long counts[SHJPEG_HW_NREASONS]);
+
+/**
+ * \brief Index the segments of a JPEG stream in memory.
+ *
+ * Scans the stream once and records where every marker segment and,
+ * for the first scan, every restart interval starts. The index can
+ * be saved with shjpeg_index_save() and cached next to the file.
+ *
+ * \param buf [in] start of the JPEG stream.
+ *
+ * \param len [in] number of bytes in buf.
+ *
+ * \return the index, or NULL if the header is broken or out of
+ *	   memory. A truncated stream is indexed up to where it ends,
+ *	   with eoi set to 0. Release it with shjpeg_index_free().
+ *
+ * \sa shjpeg_probe(), shjpeg_index_check().
+ */
+shjpeg_index_t *shjpeg_index_build(const void	*buf,
+				   size_t	 len);
+
+/**
+ * \brief Release an index.
+ *
+ * \param index [in] index returned by shjpeg_index_build() or
+ *	  shjpeg_index_load(). NULL is ignored.
+ */
+void shjpeg_index_free(shjpeg_index_t *index);
+
+/**
+ * \brief Check an index for integrity.
+ *
+ * \param index [in] the index.
+ *
+ * \retval 0 the stream ends with EOI and has as many restart
+ *	   intervals as the image needs
+ * \retval -1 the stream is truncated or restart markers are missing
+ */
+int shjpeg_index_check(const shjpeg_index_t *index);
+
+/**
+ * \brief Find the restart interval where an MCU row starts.
+ *
+ * \param index [in] the index.
+ *
+ * \param row [in] MCU row.
+ *
+ * \param skip [out] number of MCUs in the interval before the row.
+ *	  May be NULL.
+ *
+ * \return index into restarts, or -1 if the row is out of the image
+ *	   or the stream has no restart markers.
+ */
+int shjpeg_index_find_row(const shjpeg_index_t	*index,
+			  int			 row,
+			  int			*skip);
+
+/**
+ * \brief Find the MCU row where a restart interval starts.
+ *
+ * \param index [in] the index.
+ *
+ * \param interval [in] index into restarts.
+ *
+ * \return the MCU row, or -1 if there is no such interval.
+ */
+int shjpeg_index_interval_row(const shjpeg_index_t	*index,
+			      int			 interval);
+
+/**
+ * \brief Serialize an index.
+ *
+ * The result is a portable byte string which can be written to a
+ * file and loaded with shjpeg_index_load().
+ *
+ * \param index [in] the index.
+ *
+ * \param size [out] size of the returned buffer.
+ *
+ * \return a buffer to be released with free(), or NULL if out of
+ *	   memory.
+ */
+void *shjpeg_index_save(const shjpeg_index_t	*index,
+			size_t			*size);
+
+/**
+ * \brief Load a serialized index.
+ *
+ * \param buf [in] data returned by shjpeg_index_save().
+ *
+ * \param size [in] size of the data.
+ *
+ * \return the index, or NULL if the data is broken or of another
+ *	   version. Release it with shjpeg_index_free().
+ */
+shjpeg_index_t *shjpeg_index_load(const void	*buf,
+				  size_t	 size);
+
 /**
  * \brief Decode JPEG stream.
  *
@@ -181,6 +392,9 @@ int shjpeg_decode_init(shjpeg_context_t *context);
  *        decoded. Pass the value set by shjpeg_open().
  *
  * \param format [in] desired pixelformat of the decoded image.
+ *        With SHJPEG_PF_GRAYSCALE only the Y plane is written;
+ *        chroma of a colour image is decoded by the JPU but never
+ *        copied out.
  *
  * \param virt [in] virttual memory address for decoded image.
  *
@@ -202,6 +416,83 @@ int shjpeg_decode_run(shjpeg_context_t		*context,
 		      int			 height,
 		      int                    	 pitch);
 
+/**
+ * \brief Start decoding a region of the JPEG file.
+ *
+ * Same as shjpeg_decode_run(), but only the given rectangle of the
+ * image is written to the destination buffer, whose top left pixel
+ * is the top left pixel of the rectangle. The destination buffer only
+ * has to be as large as the rectangle, and need not be physically
+ * contiguous.
+ *
+ * With the JPU, the rows below the rectangle are not decoded at all.
+ * SHJPEG_PF_NV12, SHJPEG_PF_NV16, SHJPEG_PF_YCbCr and
+ * SHJPEG_PF_GRAYSCALE are decoded with the JPU; RGB formats are
+ * decoded with libjpeg, unless the rectangle is the whole image and
+ * the buffer is physically contiguous (VIO). With the JPU, NV12/NV16 chroma is copied from
+ * the chroma sample pairs, so it is off by one pixel if the rectangle
+ * starts at an odd column.
+ *
+ * \param context [in] a pointer to the JPEG image context to be
+ *        decoded. Pass the value set by shjpeg_open().
+ *
+ * \param format [in] desired pixelformat of the decoded image.
+ *
+ * \param virt [in] virtual memory address for decoded image.
+ *
+ * \param rect [in] region of the image to decode. It must be within
+ *        the image.
+ *
+ * \param pitch [in] pitch of the frame buffer.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_decode_init(), and shjpeg_decode_run().
+ */
+int shjpeg_decode_run_rect(shjpeg_context_t	*context,
+			   shjpeg_pixelformat	 format,
+			   void			*virt,
+			   const shjpeg_rect_t	*rect,
+			   int			 pitch);
+
+/**
+ * \brief Start decoding the JPEG file into a surface.
+ *
+ * The image, or the given region of it, is written to the surface
+ * with its top left pixel at (x, y). The rest of the surface is not
+ * touched, so many images can be decoded into one surface.
+ *
+ * NV12/NV16 images are written by the JPU directly when the whole
+ * image is decoded, the planes are physically contiguous and 8 byte
+ * aligned, the sampling matches the format and the image size is a
+ * multiple of the MCU size. Otherwise the image is copied into the
+ * surface by the CPU, which needs no physically contiguous memory.
+ *
+ * \param context [in] a pointer to the JPEG image context to be
+ *        decoded. Pass the value set by shjpeg_open().
+ *
+ * \param surface [in] destination surface.
+ *
+ * \param rect [in] region of the image to decode, or NULL for the
+ *        whole image.
+ *
+ * \param x [in] left edge in the surface. Must be even for
+ *        NV12/NV16.
+ *
+ * \param y [in] top edge in the surface. Must be even for NV12.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_decode_init(), and shjpeg_decode_run_rect().
+ */
+int shjpeg_decode_run_surface(shjpeg_context_t		*context,
+			      const shjpeg_surface_t	*surface,
+			      const shjpeg_rect_t	*rect,
+			      int			 x,
+			      int			 y);
+
 /**
  * \brief Close JPEG stream context.
  *
@@ -218,6 +509,69 @@ int shjpeg_decode_run(shjpeg_context_t		*context,
  */
 void shjpeg_decode_shutdown(shjpeg_context_t *context);
 
+/**
+ * \brief Decode the EXIF thumbnail instead of the image.
+ *
+ * If set, shjpeg_decode_init() looks for a JPEG thumbnail in the
+ * APP1 EXIF segment of the stream. If there is one of at least the
+ * given size, it is decoded instead of the image, and its size is
+ * returned in the width and height of the context. Otherwise the
+ * image is decoded as usual.
+ *
+ * The thumbnail is read through libshjpeg's own stream ops, see
+ * shjpeg_decode_init().
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param min_width [in] minimum width of the thumbnail.
+ *
+ * \param min_height [in] minimum height of the thumbnail. Pass 0 for
+ *	  both to always decode the image.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_decode_init().
+ */
+int shjpeg_decode_set_thumbnail(shjpeg_context_t	*context,
+				int			 min_width,
+				int			 min_height);
+
+/**
+ * \brief Be told as bands of the image are decoded.
+ *
+ * The callback is called as rows of the decoded region are complete
+ * in the destination, so that they can be displayed or processed
+ * while the rest is still decoded. Rows are counted from the top of
+ * the region passed to shjpeg_decode_run_rect() or
+ * shjpeg_decode_run_surface(), or of the image with
+ * shjpeg_decode_run(). Bands come in order, without gaps or overlap,
+ * and cover the whole region when the decode succeeds.
+ *
+ * Copying out of the line buffers reports a band for every 1024 rows
+ * the JPU decodes, and libjpeg every 16 rows. When the JPU writes
+ * directly to the destination, or VIO scales the image, the whole
+ * region is reported when it is done.
+ *
+ * The callback runs in the decoding thread, with the JPU locked, and
+ * should return quickly. It must not call libshjpeg with the same
+ * context.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param callback [in] function to call, or NULL to stop calling it.
+ *
+ * \param priv [in] private data passed to the callback.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_decode_run(), shjpeg_decode_run_surface().
+ */
+int shjpeg_decode_set_band_callback(shjpeg_context_t		*context,
+				    shjpeg_band_callback	 callback,
+				    void			*priv);
+
 /**
  * \brief Encode the image to JPEG file.
  *
@@ -227,11 +581,15 @@ void shjpeg_decode_shutdown(shjpeg_context_t *context);
  *        encoded. Pass the value set by shjpeg_open().
  *
  * \param format pixelformat of the image. Only NV12 and NV16 are
- *	  supported.
+ *	  supported. SHJPEG_PF_GRAYSCALE is encoded with flat
+ *	  (neutral) chroma, as the JPU always codes three components.
  *
  * \param virt virtual memory address for input image.
  *
- * \param width width of the input image. 
+ * \param width width of the input image. Images wider than the line
+ *	  buffers of the JPU (4080 pixels) are encoded in stripes and
+ *	  stitched into one baseline JPEG. The restart interval is then
+ *	  chosen by the library, and RGB can't be encoded.
  *
  * \param height height of the input image.
  *
@@ -239,8 +597,10 @@ void shjpeg_decode_shutdown(shjpeg_context_t *context);
  *
  * \retval 0 success
  * \retval -1 failed
+ * \retval SHJPEG_ERR_OVERSIZE the coded data exceeded the maximum size
+ *	   set by shjpeg_encode_set_max_size(). errno is set to EFBIG.
  *
- * \sa shjpeg_get_frame_buffer().
+ * \sa shjpeg_get_frame_buffer(), shjpeg_encode_set_max_size().
  */
 int shjpeg_encode(shjpeg_context_t	*context,
 		  shjpeg_pixelformat	 format,
@@ -249,6 +609,711 @@ int shjpeg_encode(shjpeg_context_t	*context,
 		  int			 height,
 		  int			 pitch);
 
+/**
+ * \brief Encode a region of a surface to JPEG file.
+ *
+ * Same as shjpeg_encode(), but the image is the given rectangle of a
+ * larger surface, whose chroma plane need not follow the luma plane.
+ * The region is not copied to another buffer first.
+ *
+ * NV12/NV16 regions are read by the JPU directly if the planes are
+ * physically contiguous and 8 byte aligned, and the pitch is at most
+ * 4088 bytes, otherwise they are copied into the line buffers by the
+ * CPU, as are YCbCr and grayscale regions. RGB regions need VIO and a physically contiguous surface.
+ *
+ * \param context [in] a pointer to the JPEG image context to be
+ *        encoded. Pass the value set by shjpeg_open().
+ *
+ * \param surface [in] source surface.
+ *
+ * \param rect [in] region of the surface to encode, or NULL for the
+ *        whole surface. x must be even for NV12/NV16, and y must be
+ *        even for NV12.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ * \retval SHJPEG_ERR_OVERSIZE the coded data exceeded the maximum size
+ *	   set by shjpeg_encode_set_max_size(). errno is set to EFBIG.
+ *
+ * \sa shjpeg_encode().
+ */
+int shjpeg_encode_surface(shjpeg_context_t		*context,
+			  const shjpeg_surface_t	*surface,
+			  const shjpeg_rect_t		*rect);
+
+/**
+ * \brief Encode several images of a surface in one go.
+ *
+ * Each output is a region of the surface, optionally downscaled and
+ * with its own quality, written with its own stream operations, e.g.
+ * a full size recording and a small preview of each camera frame.
+ *
+ * The downscaled images are box filtered by the CPU in one pass over
+ * the source before the JPU is locked, and the JPU then encodes all
+ * images back to back under one lock. Full scale images are read as
+ * by shjpeg_encode_surface(). Downscaling needs NV12, NV16 or
+ * grayscale surfaces; the size of a downscaled image is rounded down
+ * to even. Rate control is not applied; the maximum size set by
+ * shjpeg_encode_set_max_size() applies to each image.
+ *
+ * \param context [in] a pointer to the JPEG image context to be
+ *        encoded. Pass the value set by shjpeg_open().
+ *
+ * \param surface [in] source surface.
+ *
+ * \param outputs [in,out] images to encode. result and coded_size of
+ *        each are set.
+ *
+ * \param num_outputs [in] number of outputs.
+ *
+ * \retval 0 all images were encoded
+ * \retval -1 an output is invalid, or encoding one of them failed
+ *
+ * \sa shjpeg_encode_surface().
+ */
+int shjpeg_encode_simulcast(shjpeg_context_t		*context,
+			    const shjpeg_surface_t	*surface,
+			    shjpeg_encode_output_t	*outputs,
+			    int				 num_outputs);
+
+/**
+ * \brief Set quality of the encoded image.
+ *
+ * The IJG standard quantization tables scaled by the given quality
+ * factor are used for subsequent calls to shjpeg_encode(). The
+ * quality scale is the same as the one of jpeg_set_quality() in
+ * libjpeg. Smaller value gives smaller file at lower image quality.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param quality [in] quality factor from 1 (lowest) to 100 (highest).
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode(), shjpeg_encode_set_qtables().
+ */
+int shjpeg_encode_set_quality(shjpeg_context_t	*context,
+			      int		 quality);
+
+/**
+ * \brief Set custom quantization tables for encoding.
+ *
+ * The given tables are used for subsequent calls to shjpeg_encode().
+ * Values are clamped to 1-255, since the JPU only supports 8 bit
+ * (baseline) quantization tables. The tables are in the same format
+ * as quantval of JQUANT_TBL in libjpeg.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param luma [in] 64 luminance quantizers in natural (row-major) order.
+ *        If NULL, the IJG standard luminance table is used.
+ *
+ * \param chroma [in] 64 chrominance quantizers in natural order.
+ *        If NULL, the IJG standard chrominance table is used.
+ *        If both tables are NULL, the default tables are restored.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode(), shjpeg_encode_set_quality().
+ */
+int shjpeg_encode_set_qtables(shjpeg_context_t	*context,
+			      const uint16_t	*luma,
+			      const uint16_t	*chroma);
+
+/**
+ * \brief Set target size of the encoded image.
+ *
+ * Enable rate control for subsequent calls to shjpeg_encode(). The
+ * quantization scale for each image is chosen from a model updated
+ * with the coded size of the previous images, so that the size of
+ * the encoded images approaches the target. This is intended for a
+ * stream of similar images, such as Motion JPEG.
+ *
+ * If a hard limit is given and an image exceeds it, the image is
+ * encoded again at a coarser scale. As the stream is restarted with
+ * the init() stream operation in this case, init() must rewind the
+ * output. shjpeg_encode() fails if the limit still cannot be met.
+ *
+ * Quantization tables set by shjpeg_encode_set_qtables() are replaced
+ * by the scaled standard tables while rate control is enabled.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param target [in] target size in bytes per image. Pass 0 to
+ *        disable rate control.
+ *
+ * \param cap [in] hard limit in bytes per image, or 0 for no limit.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode(), shjpeg_encode_set_bitrate().
+ */
+int shjpeg_encode_set_target_size(shjpeg_context_t	*context,
+				  size_t		 target,
+				  size_t		 cap);
+
+/**
+ * \brief Set target bitrate of the encoded stream.
+ *
+ * Same as shjpeg_encode_set_target_size() with the target size of
+ * bitrate / 8 / fps bytes per image.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param bitrate [in] target bitrate in bits per second.
+ *
+ * \param fps [in] frame rate of the stream.
+ *
+ * \param cap [in] hard limit in bytes per image, or 0 for no limit.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode_set_target_size().
+ */
+int shjpeg_encode_set_bitrate(shjpeg_context_t	*context,
+			      unsigned long	 bitrate,
+			      int		 fps,
+			      size_t		 cap);
+
+/**
+ * \brief Set restart interval of the encoded image.
+ *
+ * A restart marker is inserted every given number of MCUs in
+ * subsequent calls to shjpeg_encode(). The encoder always uses 4:2:2
+ * sampling, so a MCU covers 16x8 pixels. Shorter intervals cost a
+ * little more output but allow restart based parallel decoding and
+ * limit the damage of transmission errors. Without this call, a
+ * restart interval of 512 MCUs is used.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param mcus [in] restart interval in MCUs from 1 to 65535, or 0 to
+ *        disable restart markers.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode(), shjpeg_encode_set_restart_rows().
+ */
+int shjpeg_encode_set_restart_interval(shjpeg_context_t	*context,
+				       int		 mcus);
+
+/**
+ * \brief Set restart interval of the encoded image in MCU rows.
+ *
+ * Same as shjpeg_encode_set_restart_interval(), but the interval is
+ * given in MCU rows (8 lines each) and converted to MCUs with the
+ * width of each encoded image, like restart_in_rows of libjpeg. The
+ * interval is limited to 65535 MCUs.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param rows [in] restart interval in MCU rows, or 0 to disable
+ *        restart markers.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode_set_restart_interval().
+ */
+int shjpeg_encode_set_restart_rows(shjpeg_context_t	*context,
+				   int			 rows);
+
+/**
+ * \brief Set maximum size of the encoded image.
+ *
+ * If the coded data of an image grows larger than the given size,
+ * shjpeg_encode() stops the hardware right away and returns
+ * SHJPEG_ERR_OVERSIZE, so that a retry at lower quality only costs
+ * the partial encode. The data written to the stream so far is
+ * incomplete and should be discarded.
+ *
+ * The size is checked each time a reload buffer is filled, so up to
+ * 64KB more than the limit may be written before the encode stops.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param max_size [in] maximum size in bytes per image, or 0 for no
+ *        limit.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode().
+ */
+int shjpeg_encode_set_max_size(shjpeg_context_t	*context,
+			       size_t		 max_size);
+
+/**
+ * \brief Start encoding a stream of frames of the same layout.
+ *
+ * The JPU is programmed once for the format, size and tables of the
+ * stream, and each frame passed to shjpeg_encode_stream_frame() only
+ * sets the source address before the engine is started again, which
+ * saves the per image setup of shjpeg_encode() for Motion JPEG.
+ *
+ * The tables, restart interval and maximum size in effect for the
+ * first frame are used for the whole stream, and rate control is not
+ * applied. The width is limited to the line buffers of the JPU (4080
+ * pixels).
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param format [in] pixelformat of the frames, as for shjpeg_encode().
+ *
+ * \param width [in] width of the frames.
+ *
+ * \param height [in] height of the frames.
+ *
+ * \param pitch [in] pitch of the frame buffers.
+ *
+ * \param quality [in] quality factor from 1 to 100, or 0 to keep the
+ *	  tables set on the context.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode_stream_frame(), shjpeg_encode_stream_end(),
+ *     shjpeg_encode_stream_set_hold().
+ */
+int shjpeg_encode_stream_begin(shjpeg_context_t		*context,
+			       shjpeg_pixelformat	 format,
+			       int			 width,
+			       int			 height,
+			       int			 pitch,
+			       int			 quality);
+
+/**
+ * \brief Keep the JPU locked between the frames of a stream.
+ *
+ * The JPU registers survive between frames only while the JPU stays
+ * locked by the stream. Without the lock, which is the default, the
+ * JPU is locked and programmed for each frame. While the lock is held,
+ * other contexts and processes can't use the JPU, and shjpeg_encode()
+ * fails on this context. The lock is given back when hold is cleared
+ * or the stream ends.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param hold [in] non-zero to keep the JPU locked.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode_stream_begin().
+ */
+int shjpeg_encode_stream_set_hold(shjpeg_context_t	*context,
+				  int			 hold);
+
+/**
+ * \brief Encode a frame of the stream.
+ *
+ * The frame is written through the sops of the context like an image
+ * of shjpeg_encode().
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param virt [in] virtual address of the frame in the frame buffer
+ *	  memory, laid out as given to shjpeg_encode_stream_begin().
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ * \retval SHJPEG_ERR_OVERSIZE the coded data exceeded the maximum size
+ *	   set by shjpeg_encode_set_max_size(). errno is set to EFBIG.
+ * \retval SHJPEG_FRAME_REUSED the frame was found unchanged, and the
+ *	   previous image was written again, see
+ *	   shjpeg_encode_stream_set_skip().
+ *
+ * \sa shjpeg_encode_stream_begin().
+ */
+int shjpeg_encode_stream_frame(shjpeg_context_t	*context,
+			       void		*virt);
+
+/**
+ * \brief Reuse the previous image for unchanged frames of a stream.
+ *
+ * Before a frame is encoded, the Y plane is compared with the frame
+ * encoded last by the mean luma of 16x16 blocks, sampled on every
+ * fourth row. If no block changed by more than threshold, the image
+ * encoded last is written to the sops again, and the JPU is not used.
+ * At most max_reuse frames in a row reuse an image, so that slow
+ * changes and lost frames are caught up with.
+ *
+ * Only NV12, NV16 and grayscale streams are compared. The setting
+ * stays in effect for later streams of the context.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param threshold [in] change of the mean luma of a block, 0 to 255,
+ *	  up to which a frame is taken as unchanged. A few levels above
+ *	  0 ride over sensor noise.
+ *
+ * \param max_reuse [in] frames to reuse an image for in a row, or 0
+ *	  to encode every frame (default).
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode_stream_frame().
+ */
+int shjpeg_encode_stream_set_skip(shjpeg_context_t	*context,
+				  int			 threshold,
+				  int			 max_reuse);
+
+/**
+ * \brief End the stream started by shjpeg_encode_stream_begin().
+ *
+ * The JPU is unlocked if held, and the hold setting is cleared. Called
+ * by shjpeg_shutdown() for a stream still running.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode_stream_begin().
+ */
+int shjpeg_encode_stream_end(shjpeg_context_t *context);
+
+/**
+ * \brief Start encoding an image that is pushed in strips of rows.
+ *
+ * For producers that make the image a strip at a time, so that the
+ * whole frame never has to be in one buffer. The rows passed to
+ * shjpeg_encode_push_rows() are copied into the line buffers of the
+ * JPU, which codes each 1024 rows as soon as they are complete, while
+ * the next rows are copied. The image is written through the sops of
+ * the context like an image of shjpeg_encode().
+ *
+ * The JPU stays locked until shjpeg_encode_end(), so other contexts
+ * and processes can't use it, and shjpeg_encode() fails on this
+ * context. The tables, restart interval and maximum size in effect now
+ * are used. With rate control, the scale is picked from the model, but
+ * the image can't be encoded again if it misses the target. The width
+ * is limited to the line buffers of the JPU (4080 pixels).
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param format [in] pixelformat of the rows: SHJPEG_PF_NV12,
+ *	  SHJPEG_PF_NV16, SHJPEG_PF_YCbCr or SHJPEG_PF_GRAYSCALE.
+ *
+ * \param width [in] width of the image.
+ *
+ * \param height [in] height of the image.
+ *
+ * \param pitch [in] pitch of the pushed rows.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode_push_rows(), shjpeg_encode_end().
+ */
+int shjpeg_encode_begin(shjpeg_context_t	*context,
+			shjpeg_pixelformat	 format,
+			int			 width,
+			int			 height,
+			int			 pitch);
+
+/**
+ * \brief Push the next rows of the image begun by shjpeg_encode_begin().
+ *
+ * The rows are copied before this returns, so the strip can be
+ * reused right away. This only waits for the JPU when both line
+ * buffers are full; the push of the last rows returns when the image
+ * is written.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param rows [in] n rows of the pitch given to shjpeg_encode_begin().
+ *	  For NV12 and NV16, the CbCr rows of the strip follow the Y
+ *	  rows, as with shjpeg_encode().
+ *
+ * \param n [in] number of rows. Must be even for NV12, except for
+ *	  the last strip.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ * \retval SHJPEG_ERR_OVERSIZE the coded data exceeded the maximum size
+ *	   set by shjpeg_encode_set_max_size(). errno is set to EFBIG.
+ *
+ * \sa shjpeg_encode_begin().
+ */
+int shjpeg_encode_push_rows(shjpeg_context_t	*context,
+			    void		*rows,
+			    int			 n);
+
+/**
+ * \brief End the image begun by shjpeg_encode_begin().
+ *
+ * The JPU is unlocked. If not all rows were pushed, the image is
+ * abandoned and -1 is returned. Called by shjpeg_shutdown() for an
+ * image not ended.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \retval 0 success, the image is written
+ * \retval -1 failed
+ * \retval SHJPEG_ERR_OVERSIZE the coded data exceeded the maximum size.
+ *
+ * \sa shjpeg_encode_begin().
+ */
+int shjpeg_encode_end(shjpeg_context_t *context);
+
+/**
+ * \brief Create a frame scheduler.
+ *
+ * A frame scheduler decides which of several streams, such as the
+ * cameras of a unit, is encoded next, so that the streams share the
+ * JPU fairly instead of racing for its lock. Producers submit frames
+ * with shjpeg_sched_submit(), and a single encoder thread takes them
+ * with shjpeg_sched_next() and reports back with shjpeg_sched_done().
+ * Frames are opaque to the scheduler.
+ *
+ * With SHJPEG_SCHED_ROUND_ROBIN, streams with a frame waiting take
+ * turns. With SHJPEG_SCHED_WEIGHTED_FAIR, the stream that used the
+ * least JPU time relative to its weight goes first.
+ *
+ * \param policy [in] scheduling policy.
+ *
+ * \return the scheduler, or NULL if out of memory. Release it with
+ *	   shjpeg_sched_free().
+ */
+shjpeg_sched_t *shjpeg_sched_new(shjpeg_sched_policy policy);
+
+/**
+ * \brief Release a frame scheduler.
+ *
+ * Frames still waiting are not released.
+ *
+ * \param sched [in] scheduler returned by shjpeg_sched_new().
+ */
+void shjpeg_sched_free(shjpeg_sched_t *sched);
+
+/**
+ * \brief Add a stream to a frame scheduler.
+ *
+ * \param sched [in] frame scheduler.
+ *
+ * \param weight [in] share of the JPU time for
+ *	  SHJPEG_SCHED_WEIGHTED_FAIR, 1 or more.
+ *
+ * \param fps [in] frame rate to keep the stream to, or 0 for no limit.
+ *	  Frames submitted faster are dropped.
+ *
+ * \param depth [in] number of frames that can wait, 1 or more. If
+ *	  more are submitted, the oldest ones are dropped.
+ *
+ * \return the stream number, or -1 on error.
+ */
+int shjpeg_sched_add_stream(shjpeg_sched_t	*sched,
+			    int			 weight,
+			    int			 fps,
+			    int			 depth);
+
+/**
+ * \brief Submit a frame of a stream.
+ *
+ * \param sched [in] frame scheduler.
+ *
+ * \param stream [in] stream number.
+ *
+ * \param frame [in] the frame, not NULL.
+ *
+ * \return the frame dropped, which is given back to the caller: frame
+ *	   itself if it came too early for the frame rate of the stream
+ *	   or the stream is invalid, an older frame if too many were
+ *	   waiting, or NULL if none was dropped.
+ */
+void *shjpeg_sched_submit(shjpeg_sched_t	*sched,
+			  int			 stream,
+			  void			*frame);
+
+/**
+ * \brief Take the frame to encode next.
+ *
+ * Waits for a frame if none is waiting. Call shjpeg_sched_done() once
+ * the frame is encoded, before the next call.
+ *
+ * \param sched [in] frame scheduler.
+ *
+ * \param stream [out] stream number of the frame.
+ *
+ * \return the frame, or NULL once shjpeg_sched_close() was called and
+ *	   no frames are left.
+ */
+void *shjpeg_sched_next(shjpeg_sched_t	*sched,
+			int		*stream);
+
+/**
+ * \brief Report the frame taken by shjpeg_sched_next() as encoded.
+ *
+ * \param sched [in] frame scheduler.
+ *
+ * \param stream [in] stream number of the frame.
+ */
+void shjpeg_sched_done(shjpeg_sched_t	*sched,
+		       int		 stream);
+
+/**
+ * \brief Stop taking frames.
+ *
+ * shjpeg_sched_next() returns the frames still waiting, then NULL.
+ * Frames submitted afterwards are dropped.
+ *
+ * \param sched [in] frame scheduler.
+ */
+void shjpeg_sched_close(shjpeg_sched_t *sched);
+
+/**
+ * \brief Get the statistics of a stream.
+ *
+ * \param sched [in] frame scheduler.
+ *
+ * \param stream [in] stream number.
+ *
+ * \param stats [out] statistics of the stream.
+ *
+ * \retval 0 success
+ * \retval -1 invalid stream
+ */
+int shjpeg_sched_get_stats(shjpeg_sched_t		*sched,
+			   int				 stream,
+			   shjpeg_sched_stats_t		*stats);
+
+/**
+ * \brief Create a shared memory ring of encoded frames.
+ *
+ * Encoded frames are written into the slots of a POSIX shared memory
+ * object, where any number of local processes read the latest frame
+ * in place with shjpeg_ring_get(). The writer skips slots referenced
+ * by readers, and drops a frame if no slot is free.
+ *
+ * The frames a reader references are leased to its pid. If no slot is
+ * free, the writer takes back the frames of readers that no longer
+ * exist, so a reader that dies holding frames doesn't hold up the
+ * ring. Readers have to be in the pid namespace of the writer for this,
+ * and the leases of a reader that died stay if its pid is reused in
+ * the meantime. All readers together hold at most 64 frames at once.
+ *
+ * \param name [in] name of the shared memory object, as for
+ *	  shm_open(), e.g. "/camera0". An existing object is replaced.
+ *
+ * \param num_slots [in] number of frames in the ring, 2 or more. One
+ *	  slot more than the frames readers hold at once is enough.
+ *
+ * \param slot_size [in] maximum size of a frame in bytes. Frames that
+ *	  don't fit are dropped, see also shjpeg_encode_set_max_size().
+ *
+ * \return the ring, or NULL on error. Close it with
+ *	   shjpeg_ring_close(), which removes the shared memory object.
+ *
+ * \sa shjpeg_ring_attach(), shjpeg_ring_open().
+ */
+shjpeg_ring_t *shjpeg_ring_create(const char	*name,
+				  int		 num_slots,
+				  size_t	 slot_size);
+
+/**
+ * \brief Encode into a shared memory ring.
+ *
+ * Sets the sops and priv_data of the context, so that subsequent
+ * encodes write into a free slot of the ring. Call
+ * shjpeg_ring_commit() after each encode.
+ *
+ * \param ring [in] ring created by shjpeg_ring_create().
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ */
+int shjpeg_ring_attach(shjpeg_ring_t	*ring,
+		       shjpeg_context_t	*context);
+
+/**
+ * \brief Publish the frame encoded into a shared memory ring.
+ *
+ * \param ring [in] ring created by shjpeg_ring_create().
+ *
+ * \param ok [in] non-zero if the encode succeeded. Otherwise the
+ *	  frame is discarded.
+ *
+ * \retval 0 the frame is the latest frame of the ring
+ * \retval -1 the frame was discarded, or dropped because no slot was
+ *	   free (errno EBUSY) or it didn't fit (errno EFBIG).
+ */
+int shjpeg_ring_commit(shjpeg_ring_t	*ring,
+		       int		 ok);
+
+/**
+ * \brief Open a shared memory ring for reading.
+ *
+ * \param name [in] name given to shjpeg_ring_create().
+ *
+ * \return the ring, or NULL on error. Close it with
+ *	   shjpeg_ring_close().
+ */
+shjpeg_ring_t *shjpeg_ring_open(const char *name);
+
+/**
+ * \brief Reference the latest frame of a shared memory ring.
+ *
+ * Waits for a frame newer than last_seq, and references the latest
+ * frame, which the writer then leaves alone until shjpeg_ring_put().
+ * Frames may be skipped if the reader is slower than the writer.
+ *
+ * \param ring [in] ring opened by shjpeg_ring_open().
+ *
+ * \param last_seq [in] sequence number of the frame read last, or 0.
+ *
+ * \param timeout_ms [in] time to wait for a new frame in
+ *	  milliseconds, or -1 to wait forever.
+ *
+ * \param frame [out] the frame.
+ *
+ * \retval 0 success
+ * \retval -1 failed, errno is ETIMEDOUT if no new frame came, or
+ *	   EAGAIN if readers hold too many frames.
+ */
+int shjpeg_ring_get(shjpeg_ring_t		*ring,
+		    unsigned long		 last_seq,
+		    int				 timeout_ms,
+		    shjpeg_ring_frame_t		*frame);
+
+/**
+ * \brief Release a frame referenced by shjpeg_ring_get().
+ *
+ * \param ring [in] ring opened by shjpeg_ring_open().
+ *
+ * \param frame [in] the frame.
+ */
+void shjpeg_ring_put(shjpeg_ring_t		*ring,
+		     shjpeg_ring_frame_t	*frame);
+
+/**
+ * \brief Get the number of frames the writer dropped.
+ *
+ * \param ring [in] shared memory ring.
+ *
+ * \return frames dropped for lack of a free slot or space.
+ */
+unsigned long shjpeg_ring_dropped(shjpeg_ring_t *ring);
+
+/**
+ * \brief Close a shared memory ring.
+ *
+ * Release the frames referenced with shjpeg_ring_put() first. If the
+ * ring was created by shjpeg_ring_create(), the shared memory object
+ * is removed, and readers keep their mapping until they close it.
+ *
+ * \param ring [in] shared memory ring.
+ */
+void shjpeg_ring_close(shjpeg_ring_t *ring);
+
 #ifdef __cplusplus
 }
 #endif
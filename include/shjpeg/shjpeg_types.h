@@ -36,6 +36,12 @@
 //! Use default physically contigous buffer
 #define SHJPEG_USE_DEFAULT_BUFFER	0xffffffffUL
 
+//! Encoding aborted as the coded data exceeded the maximum size
+#define SHJPEG_ERR_OVERSIZE		(-2)
+
+//! The frame was unchanged and the previous image was written again
+#define SHJPEG_FRAME_REUSED		(1)
+
 /**
  * \brief Encodes pixelformat
  *
@@ -98,10 +104,272 @@ typedef enum {
     SHJPEG_PF_RGB32 = SHJPEG_PIXELFORMAT(3, 4, 32, 2),		/*!< RGB32 pixel format. */
     SHJPEG_PF_NV12  = SHJPEG_PIXELFORMAT(4, 1, 12, 3),		/*!< NV12 pixel format. */
     SHJPEG_PF_NV16  = SHJPEG_PIXELFORMAT(5, 1, 16, 4),		/*!< NV16 pixel format. */
-    SHJPEG_PF_GRAYSCALE = SHJPEG_PIXELFORMAT(6, 1, 12, 3),	/*!< Y8 pixel format. */
+    SHJPEG_PF_GRAYSCALE = SHJPEG_PIXELFORMAT(6, 1, 8, 2),	/*!< Y8 pixel format. */
     SHJPEG_PF_YCbCr = SHJPEG_PIXELFORMAT(7, 3, 24, 2),	/*!< YUV 4:4:4 pixel format */
 } shjpeg_pixelformat;
 
+/**
+ * \brief Rectangle
+ *
+ * A region of an image in pixels.
+ */
+
+typedef struct {
+    //! Left edge of the region.
+    int	x;
+
+    //! Top edge of the region.
+    int	y;
+
+    //! Width of the region.
+    int	w;
+
+    //! Height of the region.
+    int	h;
+} shjpeg_rect_t;
+
+/**
+ * \brief Surface
+ *
+ * An image buffer in memory. The chroma plane of NV12/NV16 need not
+ * follow the luma plane.
+ */
+
+typedef struct {
+    //! Pixel format of the surface.
+    shjpeg_pixelformat	format;
+
+    //! Virtual address of the Y plane, or of the packed RGB/YCbCr data.
+    void	*py;
+
+    //! Virtual address of the CbCr plane (NV12/NV16 only).
+    void	*pc;
+
+    //! Pitch of the planes in bytes.
+    int		pitch;
+
+    //! Width of the surface.
+    int		width;
+
+    //! Height of the surface.
+    int		height;
+} shjpeg_surface_t;
+
+/**
+ * \brief JPEG header information
+ *
+ * Header of a JPEG stream as returned by shjpeg_probe().
+ */
+
+typedef struct {
+    //! Width of the image.
+    int		width;
+
+    //! Height of the image, 0 if defined by a DNL marker.
+    int		height;
+
+    //! Sample precision in bits.
+    int		precision;
+
+    //! Coding process, n of the SOFn marker (0 is baseline).
+    int		process;
+
+    //! True if the image is progressive.
+    bool	progressive;
+
+    //! True if arithmetic coding is used.
+    bool	arithmetic;
+
+    //! Number of components.
+    int		num_components;
+
+    //! Components in the order of the SOF segment.
+    struct {
+	//! Component identifier.
+	int	id;
+
+	//! Horizontal sampling factor.
+	int	h_samp;
+
+	//! Vertical sampling factor.
+	int	v_samp;
+
+	//! Quantization table selector.
+	int	qtbl;
+    } comp[4];
+
+    //! Bit mask of the quantization tables defined.
+    int		qtbl_mask;
+
+    //! Bit mask of the DC (bits 0-3) and AC (bits 4-7) Huffman tables defined.
+    int		htbl_mask;
+
+    //! Restart interval in MCUs, 0 if none.
+    int		restart_interval;
+
+    //! Number of components in the first scan.
+    int		scan_components;
+
+    //! Offset of the entropy coded data of the first scan.
+    size_t	header_size;
+
+    //! Offset of the JPEG thumbnail in the EXIF data, 0 if none.
+    size_t	thumbnail_offset;
+
+    //! Size of the JPEG thumbnail in the EXIF data, 0 if none.
+    size_t	thumbnail_size;
+
+    //! Colour transform of the APP14 Adobe segment, -1 if none.
+    int		adobe_transform;
+} shjpeg_info_t;
+
+/**
+ * \brief Why an image can't be decoded by the JPU
+ *
+ * Returned by shjpeg_classify().
+ */
+
+typedef enum {
+    SHJPEG_HW_OK = 0,		//!< the JPU can decode the image
+    SHJPEG_HW_BROKEN,		//!< the headers can't be parsed
+    SHJPEG_HW_DISABLED,		//!< hardware decoding is disabled
+    SHJPEG_HW_PRECISION,	//!< not 8 bit samples
+    SHJPEG_HW_PROGRESSIVE,	//!< progressive
+    SHJPEG_HW_ARITHMETIC,	//!< arithmetic coding
+    SHJPEG_HW_PROCESS,		//!< other non-baseline process
+    SHJPEG_HW_COMPONENTS,	//!< not three components (grayscale, CMYK)
+    SHJPEG_HW_COLORSPACE,	//!< three components, but not YCbCr
+    SHJPEG_HW_SAMPLING,		//!< not 4:2:0 or 4:2:2 (4:4:4, 4:1:1, 4:4:0)
+    SHJPEG_HW_SCAN,		//!< components not interleaved in one scan
+    SHJPEG_HW_TABLES,		//!< more than two quantization or Huffman tables
+    SHJPEG_HW_SIZE,		//!< too wide, or height defined by DNL
+    SHJPEG_HW_NREASONS
+} shjpeg_hw_reason;
+
+/**
+ * \brief Segment of a JPEG stream
+ */
+
+typedef struct {
+    //! Marker code, second byte of the marker (e.g. 0xc0 for SOF0).
+    int		marker;
+
+    //! Offset of the marker.
+    size_t	offset;
+
+    //! Length of the marker and its segment, 2 if it has none.
+    size_t	length;
+} shjpeg_segment_t;
+
+/**
+ * \brief Index of a JPEG stream
+ *
+ * Where the segments and restart intervals of a stream are, as built
+ * by shjpeg_index_build(). Restart intervals are indexed for the
+ * first scan only.
+ */
+
+typedef struct {
+    //! Header information.
+    shjpeg_info_t	 info;
+
+    //! Size of the stream indexed.
+    size_t		 size;
+
+    //! Number of entries in segments.
+    int			 num_segments;
+
+    //! Marker segments (APPn, DQT, DHT, SOF, DRI, SOS, COM, EOI...).
+    shjpeg_segment_t	*segments;
+
+    //! Number of entries in restarts.
+    int			 num_restarts;
+
+    //! Offset of the entropy coded data of each restart interval
+    //! of the first scan. The first entry is info.header_size.
+    size_t		*restarts;
+
+    //! Offset of the EOI marker, 0 if the stream is truncated.
+    size_t		 eoi;
+
+    //! MCUs in a row of the image.
+    int			 mcus_per_row;
+
+    //! MCU rows in the image.
+    int			 mcu_rows;
+} shjpeg_index_t;
+
+/**
+ * \brief Scheduling policy of a frame scheduler
+ */
+
+typedef enum {
+    SHJPEG_SCHED_ROUND_ROBIN = 0,	//!< streams take turns
+    SHJPEG_SCHED_WEIGHTED_FAIR,		//!< JPU time shared by weight
+} shjpeg_sched_policy;
+
+/**
+ * \brief Frame scheduler sharing the JPU among streams
+ *
+ * Created by shjpeg_sched_new().
+ */
+
+typedef struct shjpeg_sched_struct shjpeg_sched_t;
+
+/**
+ * \brief Statistics of a stream of a frame scheduler
+ */
+
+typedef struct {
+    //! Frames passed to shjpeg_sched_submit().
+    unsigned long	submitted;
+
+    //! Frames returned by shjpeg_sched_next().
+    unsigned long	scheduled;
+
+    //! Frames dropped to keep to the frame rate of the stream.
+    unsigned long	dropped_rate;
+
+    //! Frames dropped for newer ones while waiting for the JPU.
+    unsigned long	dropped_late;
+
+    //! Time between shjpeg_sched_next() and shjpeg_sched_done()
+    //! in microseconds.
+    unsigned long long	busy_us;
+} shjpeg_sched_stats_t;
+
+/**
+ * \brief Shared memory ring of encoded frames
+ *
+ * Created by shjpeg_ring_create() or opened by shjpeg_ring_open().
+ */
+
+typedef struct shjpeg_ring_struct shjpeg_ring_t;
+
+/**
+ * \brief Frame referenced in a shared memory ring
+ *
+ * Filled by shjpeg_ring_get(). The data stays valid until the frame
+ * is released with shjpeg_ring_put().
+ */
+
+typedef struct {
+    //! Sequence number of the frame, counting from 1.
+    unsigned long	 seq;
+
+    //! The JPEG data in the shared memory.
+    const void		*data;
+
+    //! Bytes of the JPEG data.
+    size_t		 size;
+
+    //! CLOCK_MONOTONIC time the frame was published in microseconds.
+    unsigned long long	 timestamp;
+
+    //! Slot of the frame, internal use.
+    int			 slot;
+} shjpeg_ring_frame_t;
+
 /**
  * \brief a type definition for shjpeg_context_struct.
  */
@@ -147,12 +415,59 @@ struct shjpeg_stream_ops_struct {
     void (*finalize)(void *priv_user_data);
 };
 
+/**
+ * \brief Output of a simulcast encode
+ *
+ * One of the images shjpeg_encode_simulcast() encodes from a source
+ * frame.
+ */
+
+typedef struct {
+    //! Region of the source to encode, or w = 0 for the whole source.
+    shjpeg_rect_t	 crop;
+
+    //! The region is downscaled by 1/scale: 1, 2, 4 or 8.
+    int			 scale;
+
+    //! Quality from 1 to 100, or 0 for the tables of the context.
+    int			 quality;
+
+    //! Stream operations to write the image with.
+    shjpeg_sops		*sops;
+
+    //! Private data passed to sops.
+    void		*priv_data;
+
+    //! Set to 0 on success, -1 or SHJPEG_ERR_OVERSIZE on failure.
+    int			 result;
+
+    //! Set to the bytes written for the image.
+    size_t		 coded_size;
+} shjpeg_encode_output_t;
+
 /**
  * \brief a type definition for shjpeg_context_struct.
  */
 
 typedef struct shjpeg_context_struct shjpeg_context_t;
 
+/**
+ * \brief Band completion callback of a decode
+ *
+ * Called as rows of the decoded region land in the destination, see
+ * shjpeg_decode_set_band_callback().
+ *
+ * \param context [in] the context being decoded.
+ * \param first_row [in] first complete row, 0 being the top of the
+ *	  decoded region.
+ * \param num_rows [in] number of rows from first_row.
+ * \param priv [in] private data passed with the callback.
+ */
+
+typedef void (*shjpeg_band_callback)(shjpeg_context_t *context,
+				     int first_row, int num_rows,
+				     void *priv);
+
 /**
  * \brief JPEG Compressoin/Decompression Context
  * 
@@ -221,6 +536,10 @@ struct shjpeg_context_struct {
     shjpeg_pixelformat   format;
     //! the working buffer for JPEG encode/decode (deprecated, see shjpeg_buffer)
     struct shjpeg_buffer buffer;
+
+//New for 1.4
+    //! libshjpeg private data - per-context state
+    void	*context_data;
 };
 
 #endif /* !__shjpeg_types_h__ */
@@ -6,6 +6,10 @@ LOCAL_SRC_FILES:= \
 	shjpeg_config.c \
 	shjpeg_decode.c \
 	shjpeg_encode.c \
+	shjpeg_markers.c \
+	shjpeg_index.c \
+	shjpeg_sched.c \
+	shjpeg_ring.c \
 	shjpeg_softhelper.c \
 	shjpeg_jpu.c
 
@@ -106,12 +106,53 @@ static shjpeg_pixelformat get_shjpeg_pixelformat(J_COLOR_SPACE color_space)
 	case JCS_YCbCr:
 		return SHJPEG_PF_YCbCr;
 	case JCS_GRAYSCALE:
+		return SHJPEG_PF_GRAYSCALE;
 	default:
 		return SHJPEG_PF_NONE;
 	}
 }
+/*Describe the headers read by libjpeg for shjpeg_classify() */
+static void get_shjpeg_info(j_decompress_ptr cinfo, shjpeg_info_t *info)
+{
+	int i;
+
+	memset(info, 0, sizeof(*info));
+	info->width = cinfo->image_width;
+	info->height = cinfo->image_height;
+	info->precision = cinfo->data_precision;
+	info->progressive = cinfo->progressive_mode;
+	info->arithmetic = cinfo->arith_code;
+	/*libjpeg doesn't tell SOF0 from SOF1*/
+	info->process = (info->progressive ? 2 : 0) |
+			(info->arithmetic ? 8 : 0);
+	info->num_components = MIN(cinfo->num_components, 4);
+	for (i = 0; i < info->num_components; i++) {
+		info->comp[i].id = cinfo->comp_info[i].component_id;
+		info->comp[i].h_samp = cinfo->comp_info[i].h_samp_factor;
+		info->comp[i].v_samp = cinfo->comp_info[i].v_samp_factor;
+		info->comp[i].qtbl = cinfo->comp_info[i].quant_tbl_no;
+	}
+	for (i = 0; i < NUM_QUANT_TBLS; i++)
+		if (cinfo->quant_tbl_ptrs[i])
+			info->qtbl_mask |= 1 << i;
+	for (i = 0; i < NUM_HUFF_TBLS; i++) {
+		if (cinfo->dc_huff_tbl_ptrs[i])
+			info->htbl_mask |= 1 << i;
+		if (cinfo->ac_huff_tbl_ptrs[i])
+			info->htbl_mask |= 1 << (i + 4);
+	}
+	info->restart_interval = cinfo->restart_interval;
+	/*jpeg_read_header() stops after the first SOS*/
+	info->scan_components = cinfo->comps_in_scan;
+	info->adobe_transform =
+		cinfo->saw_Adobe_marker ? cinfo->Adobe_transform : -1;
+}
+
 static boolean is_jpu_supported_decompress(j_decompress_ptr cinfo)
 {
+	shjpeg_info_t info;
+	shjpeg_hw_reason reason;
+
 	/*If no file input specified revert to libjpeg */
 	if (!cinfo->src) {
 		return FALSE;
@@ -125,20 +166,14 @@ static boolean is_jpu_supported_decompress(j_decompress_ptr cinfo)
 	    SHJPEG_PF_NONE)
 		return FALSE;
 
-	/*Use shjpeg unless 4:4:4 colour mode */
-	if (cinfo->jpeg_color_space != JCS_YCbCr ||
-	    ((cinfo->comp_info[1].h_samp_factor ==
-	     cinfo->comp_info[0].h_samp_factor) &&
-	    (cinfo->comp_info[1].v_samp_factor ==
-	     cinfo->comp_info[0].v_samp_factor) &&
-	    (cinfo->comp_info[2].h_samp_factor ==
-	     cinfo->comp_info[0].h_samp_factor) &&
-	    (cinfo->comp_info[2].v_samp_factor ==
-	     cinfo->comp_info[0].v_samp_factor)))
-		return FALSE;
-
-	return TRUE;
+	/*Same decision as shjpeg_decode_init() */
+	get_shjpeg_info(cinfo, &info);
+	reason = shjpeg_classify(&info);
+	if (reason == SHJPEG_HW_OK && cinfo->jpeg_color_space != JCS_YCbCr)
+		reason = SHJPEG_HW_COLORSPACE;
+	shjpeg_count_decision(reason);
 
+	return (reason == SHJPEG_HW_OK);
 }
 
 void
@@ -338,6 +373,9 @@ static boolean is_jpu_supported_compress(j_compress_ptr cinfo, boolean wat)
 	if (get_shjpeg_pixelformat(cinfo->in_color_space) ==
 	    SHJPEG_PF_NONE)
 		return FALSE;
+	/*The JPU only writes 3 component (YCbCr) JPEGs */
+	if (cinfo->jpeg_color_space != JCS_YCbCr)
+		return FALSE;
 	return TRUE;
 }
 
@@ -382,6 +420,24 @@ void shjpeg_start_compress(j_compress_ptr cinfo, boolean write_all_tables)
 
 	context->libjpeg_disabled = 1;
 
+	/* Honour the tables set by jpeg_set_quality()/jpeg_add_quant_table() */
+	if (cinfo->quant_tbl_ptrs[0]) {
+		JQUANT_TBL *chroma = cinfo->quant_tbl_ptrs[1] ?
+			cinfo->quant_tbl_ptrs[1] : cinfo->quant_tbl_ptrs[0];
+
+		shjpeg_encode_set_qtables(context,
+					  cinfo->quant_tbl_ptrs[0]->quantval,
+					  chroma->quantval);
+	}
+
+	/* Honour restart_interval/restart_in_rows */
+	if (cinfo->restart_in_rows > 0)
+		shjpeg_encode_set_restart_rows(context,
+					       cinfo->restart_in_rows);
+	else
+		shjpeg_encode_set_restart_interval(context,
+						   cinfo->restart_interval);
+
 	memcpy(&ctx->sops, &jpeg_dest_ops, sizeof(jpeg_dest_ops));
 	context->sops = &ctx->sops;
 
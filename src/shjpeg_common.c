@@ -183,6 +183,7 @@ shjpeg_free(shjpeg_context_t * context,
 static shjpeg_internal_t data = {
 	.ref_count = 0,
 	.ref_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.stats_mutex = PTHREAD_MUTEX_INITIALIZER,
 };
 
 /*
@@ -202,6 +203,15 @@ shjpeg_context_t *shjpeg_init(int verbose)
 	}
 	memset((void *) context, 0, sizeof(shjpeg_context_t));
 
+	if ((context->context_data =
+	     calloc(1, sizeof(shjpeg_context_data_t))) == NULL) {
+		if (verbose)
+			perror
+			    ("libshjpeg: Can't allocate libshjpeg context - ");
+		free(context);
+		return NULL;
+	}
+
 	data.context = context;
 	context->internal_data = &data;
 	context->verbose = verbose;
@@ -220,6 +230,7 @@ shjpeg_context_t *shjpeg_init(int verbose)
 	/* init uio */
 	if (uio_init(context, &data)) {
 		D_ERROR("libshjpeg: UIO initialization failed.");
+		free(context->context_data);
 		free(context);
 		pthread_mutex_unlock(&data.ref_mutex);
 		return NULL;
@@ -238,8 +249,13 @@ shjpeg_context_t *shjpeg_init(int verbose)
 void shjpeg_shutdown(shjpeg_context_t * context)
 {
 	/* clean up */
-	if (context)
+	if (context) {
+		if (((shjpeg_context_data_t *) context->context_data)->push)
+			shjpeg_encode_end(context);
+		shjpeg_encode_stream_end(context);
+		free(context->context_data);
 		free(context);
+	}
 
 	pthread_mutex_lock(&data.ref_mutex);
 	if (!data.ref_count)
@@ -278,3 +294,21 @@ shjpeg_get_frame_buffer(shjpeg_context_t * context,
 
 	return 0;
 }
+
+/*
+ * hardware/software decode decisions
+ */
+
+void shjpeg_count_decision(shjpeg_hw_reason reason)
+{
+	pthread_mutex_lock(&data.stats_mutex);
+	data.decode_stats[reason]++;
+	pthread_mutex_unlock(&data.stats_mutex);
+}
+
+void shjpeg_get_decode_stats(unsigned long counts[SHJPEG_HW_NREASONS])
+{
+	pthread_mutex_lock(&data.stats_mutex);
+	memcpy(counts, data.decode_stats, sizeof(data.decode_stats));
+	pthread_mutex_unlock(&data.stats_mutex);
+}
@@ -36,6 +36,7 @@
 #include <shjpeg/shjpeg.h>
 #include "shjpeg_internal.h"
 #include "shjpeg_jpu.h"
+#include "shjpeg_markers.h"
 #if defined(HAVE_SHVIO)
 #include "shjpeg_vio.h"
 #endif
@@ -49,7 +50,9 @@ static int
 decode_hw(shjpeg_internal_t * data,
 	  shjpeg_context_t * context,
 	  shjpeg_pixelformat format,
-	  unsigned long phys, int width, int height, int pitch)
+	  unsigned long phys, unsigned long phys_c,
+	  int width, int height, int pitch,
+	  const shjpeg_jpu_crop_t * crop, int *rows)
 {
 	int ret;
 	unsigned int len;
@@ -62,6 +65,7 @@ decode_hw(shjpeg_internal_t * data,
 	D_ASSERT(data != NULL);
 
 	memset(&mdata, 0, sizeof(mdata));
+	*rows = 0;
 #if defined(HAVE_SHVIO)
 	memset((void*)&vio, 0, sizeof(shjpeg_vio_t));
 
@@ -71,14 +75,16 @@ decode_hw(shjpeg_internal_t * data,
 
 	vio.dst.format = shjpeg_vio_color(format);
 	if ((vio.dst.format == REN_UNKNOWN) &&
-	    (format != SHJPEG_PF_YCbCr)) {
+	    (format != SHJPEG_PF_YCbCr) &&
+	    (format != SHJPEG_PF_GRAYSCALE) && !crop) {
 		D_BUG("unexpected format %08x", format);
 		return -1;
 	}
 	vio.dst.pitch = pitch / size_y(vio.dst.format, 1, 0);
 #else
-	if ((context->mode420 && format != SHJPEG_PF_NV12) ||
-	    (!context->mode420 && format != SHJPEG_PF_NV16)) {
+	if (((context->mode420 && format != SHJPEG_PF_NV12) ||
+	     (!context->mode420 && format != SHJPEG_PF_NV16)) &&
+	    (format != SHJPEG_PF_GRAYSCALE) && !crop) {
 		D_PERROR("libshjpeg: unexpected format %08x", format);
 		return -1;
 	}
@@ -119,6 +125,7 @@ decode_hw(shjpeg_internal_t * data,
 	jpeg.state = SHJPEG_JPU_START;
 	jpeg.flags = 0;
 	jpeg.buffers = 1;
+	jpeg.height = height;
 
 	/*
 	 * Enable reload if buffer was filled completely (coded data
@@ -142,8 +149,8 @@ decode_hw(shjpeg_internal_t * data,
 	shjpeg_jpu_setreg32(data, JPU_JIFDDRSZ,
 			    ((u32)len + 255) & 0x00ffff00);
 
-	if ((context->mode420 && format == SHJPEG_PF_NV12) ||
-	    (!context->mode420 && format == SHJPEG_PF_NV16)) {
+	if (!crop && ((context->mode420 && format == SHJPEG_PF_NV12) ||
+		      (!context->mode420 && format == SHJPEG_PF_NV16))) {
 	/* Setup JPU for decoding in frame mode (directly to surface). */
 		shjpeg_jpu_setreg32(data, JPU_JINTE,
 				    JPU_JINTS_INS5_ERROR |
@@ -154,8 +161,7 @@ decode_hw(shjpeg_internal_t * data,
 				    JPU_JIFDCNT_SWAP_4321 |
 				    (reload ?  JPU_JIFDCNT_RELOAD_ENABLE : 0));
 		shjpeg_jpu_setreg32(data, JPU_JIFDDYA1, phys);
-		shjpeg_jpu_setreg32(data, JPU_JIFDDCA1,
-				    phys + pitch * height);
+		shjpeg_jpu_setreg32(data, JPU_JIFDDCA1, phys_c);
 		shjpeg_jpu_setreg32(data, JPU_JIFDDMW,
 				    ((u32)pitch + 7) & ~0x07);
 	} else {
@@ -185,9 +191,19 @@ decode_hw(shjpeg_internal_t * data,
 		shjpeg_jpu_setreg32(data, JPU_JIFDDMW,
 				    SHJPEG_JPU_LINEBUFFER_PITCH);
 
-		if (format == SHJPEG_PF_YCbCr) {
+		if (crop) {
+			/* Copy the region straight out of the line buffers */
+			jpeg.flags |= SHJPEG_JPU_FLAG_SOFTCONVERT |
+			    SHJPEG_JPU_FLAG_CROP;
+			jpeg.soft_offset = jpeg.soft_line = 0;
+			jpeg.crop = *crop;
+		} else if (format == SHJPEG_PF_YCbCr ||
+			   format == SHJPEG_PF_GRAYSCALE) {
 			jpeg.flags |= SHJPEG_JPU_FLAG_SOFTCONVERT;
 			jpeg.soft_offset = jpeg.soft_line = 0;
+			/* Only Y is copied out of the line buffers */
+			if (format == SHJPEG_PF_GRAYSCALE)
+				jpeg.flags |= SHJPEG_JPU_FLAG_GRAYSCALE;
 			context->pitch = pitch;
 			if (get_frame_buffer_virtual(data, context,
 					&mdata, format, phys) < 0) {
@@ -224,7 +240,7 @@ decode_hw(shjpeg_internal_t * data,
 
 			/* Set the correct physical addresses */
 			shvio_set_src_phys(data->vio, 0, 0);
-			shvio_set_dst_phys(data->vio, phys, phys + pitch * height);
+			shvio_set_dst_phys(data->vio, phys, phys_c);
 		}
 #endif /* defined(HAVE_SHVIO) */
 	}
@@ -251,6 +267,11 @@ decode_hw(shjpeg_internal_t * data,
 				D_ERROR("libshjpeg: ERROR 0x%x!\n",
 					jpeg.error);
 				ret = -1;
+			} else if (jpeg.crop_done) {
+				/* The rest of the image is not needed. */
+				shjpeg_jpu_setreg32(data, JPU_JCCMD,
+						    JPU_JCCMD_END);
+				shjpeg_jpu_reset(data);
 			}
 
 			break;
@@ -285,6 +306,24 @@ decode_hw(shjpeg_internal_t * data,
 		}
 	}
 
+	/* rows already in the destination, for a fallback to resume */
+	if (jpeg.flags & SHJPEG_JPU_FLAG_SOFTCONVERT)
+		*rows = jpeg.soft_line;
+#if defined(HAVE_SHVIO)
+	else if (jpeg.flags & SHJPEG_JPU_FLAG_CONVERT)
+		*rows = (height == context->height) ?
+		    MIN(context->height, data->vio_line_bufs_done *
+			SHJPEG_JPU_LINEBUFFER_HEIGHT) : 0;
+#endif /* defined(HAVE_SHVIO) */
+	else
+		*rows = ret ? 0 : context->height;
+
+	/* bands of frame mode and VIO scaling are not known */
+	if (!ret)
+		shjpeg_decode_band(context, crop ? crop->h :
+				   (jpeg.flags & SHJPEG_JPU_FLAG_CONVERT) ?
+				   height : context->height);
+
 	free_frame_buffer_virtual(&mdata);
 
 end:
@@ -377,30 +416,51 @@ copy_line_y(uint16_t * yy, const uint8_t * src_ycbcr, int width)
 	}
 }
 
+static void shjpeg_init_src(shjpeg_context_t * context,
+			    j_decompress_ptr cinfo);
+
+/* rows libjpeg decodes between band callbacks */
+#define SW_BAND_HEIGHT	16
+
+/*
+ * rect is the part of the region still to decode, and top the first
+ * row of the region, for the band callback
+ */
 static int
 decode_sw(shjpeg_context_t * context,
 	  shjpeg_pixelformat format,
-	  void *addr, int width, int height, int pitch)
+	  void *addr, void *addr_uv, const shjpeg_rect_t * rect, int pitch,
+	  int top)
 {
+	shjpeg_context_data_t *cdata = context->context_data;
 	JSAMPARRAY buffer;	/* Output row buffer */
 	int row_stride;		/* physical row width in output buffer */
-	void *addr_uv = addr + height * pitch;
 	j_decompress_ptr cinfo = &context->jpeg_decomp;
+	int width = rect->w;
+	int bottom = rect->y + rect->h;
+	bool gray = false;
 
 	D_ASSERT(context != NULL);
 
-	D_DEBUG_AT(SH7722_JPEG, "%s( %p, %p|%d [%dx%d] %08x )",
-		   __FUNCTION__, context, addr, pitch, context->width,
-		   context->height, format);
+	/* the JPU may have decoded all of it before failing */
+	if (rect->h <= 0)
+		return 0;
+
+	D_DEBUG_AT(SH7722_JPEG, "%s( %p, %p|%d [%d,%d %dx%d] %08x )",
+		   __FUNCTION__, context, addr, pitch, rect->x, rect->y,
+		   rect->w, rect->h, format);
+
+	/* headers were probed without libjpeg, read them again from the
+	   start of the stream; errors go to the caller's jerr */
+	if (!cdata->sw_header) {
+		jpeg_create_decompress(cinfo);
+		shjpeg_init_src(context, cinfo);
+		jpeg_read_header(cinfo, TRUE);
+		cdata->sw_header = true;
+	}
 
 	cinfo->output_components = 3;
 
-	/*
-	 * XXX: Calculate destination base address. rect->{x,y} are x/y offsets
-	 * from top left corner, i.e. base address.
-	 */
-	//addr += DFB_BYTES_PER_LINE( format, rect->x ) + rect->y * pitch;
-
 	/* Not all formats yet :( */
 	switch (format) {
 	case SHJPEG_PF_RGB16:
@@ -410,21 +470,30 @@ decode_sw(shjpeg_context_t * context,
 		break;
 
 	case SHJPEG_PF_NV12:
-		//addr_uv += rect->x + rect->y / 2 * pitch;
+	case SHJPEG_PF_NV16:
 		cinfo->out_color_space = JCS_YCbCr;
 		width = (width + 1) & ~1;
 		break;
 
-	case SHJPEG_PF_NV16:
-		//addr_uv += rect->x + rect->y * pitch;
-		cinfo->out_color_space = JCS_YCbCr;
-		width = (width + 1) & ~1;
+	case SHJPEG_PF_GRAYSCALE:
+		/* libjpeg skips IDCT of the chroma components */
+		cinfo->out_color_space = JCS_GRAYSCALE;
+		gray = true;
 		break;
 
 	default:
 		return -1;
 	}
 
+	/* libjpeg can't convert grayscale to YCbCr - add flat chroma */
+	if (cinfo->jpeg_color_space == JCS_GRAYSCALE &&
+	    cinfo->out_color_space == JCS_YCbCr) {
+		cinfo->out_color_space = JCS_GRAYSCALE;
+		gray = true;
+		memset(addr_uv, 0x80, (format == SHJPEG_PF_NV12) ?
+		       pitch * ((rect->h + 1) / 2) : pitch * rect->h);
+	}
+
 	D_DEBUG_AT(SH7722_JPEG, "		 -> decoding...");
 
 	jpeg_start_decompress(cinfo);
@@ -432,37 +501,61 @@ decode_sw(shjpeg_context_t * context,
 	buffer = (*cinfo->mem->alloc_sarray) ((j_common_ptr) cinfo,
 					      JPOOL_IMAGE, row_stride, 1);
 
-	while (cinfo->output_scanline < cinfo->output_height) {
+	/* Rows above the region still have to be entropy decoded */
+#ifdef LIBJPEG_TURBO_VERSION_NUMBER
+	if (rect->y > 0)
+		jpeg_skip_scanlines(cinfo, rect->y);
+#endif
+	while (cinfo->output_scanline < rect->y)
+		jpeg_read_scanlines(cinfo, buffer, 1);
+
+	while (cinfo->output_scanline < bottom) {
+		JSAMPLE *src;
+
+		if (!(cinfo->output_scanline % SW_BAND_HEIGHT))
+			shjpeg_decode_band(context,
+					   cinfo->output_scanline - top);
+
 		jpeg_read_scanlines(cinfo, buffer, 1);
 
+		if (gray) {
+			memcpy(addr, *buffer + rect->x, width);
+			addr += pitch;
+			continue;
+		}
+
+		src = *buffer + rect->x * 3;
+
 		switch (format) {
 		case SHJPEG_PF_NV12:
-			if (cinfo->output_scanline & 1) {
-				// copy_line_nv16(addr, addr_uv, *buffer,
-				//                  (rect->w + 1) & ~1 );
-				copy_line_nv16(addr, addr_uv, *buffer,
-					       width);
+			if ((cinfo->output_scanline - rect->y) & 1) {
+				copy_line_nv16(addr, addr_uv, src, width);
 				addr_uv += pitch;
 			} else
-				// copy_line_y( addr, *buffer, (rect->w + 1)
-				//              & ~1 );
-				copy_line_y(addr, *buffer, width);
+				copy_line_y(addr, src, width);
 			break;
 
 		case SHJPEG_PF_NV16:
-			copy_line_nv16(addr, addr_uv, *buffer, width);
+			copy_line_nv16(addr, addr_uv, src, width);
 			addr_uv += pitch;
 			break;
 
 		default:
-			write_rgb_span(*buffer, addr, width, format);
+			write_rgb_span(src, addr, width, format);
 			break;
 		}
 
 		addr += pitch;
 	}
 
-	jpeg_finish_decompress(cinfo);
+	shjpeg_decode_band(context, bottom - top);
+
+	/* No need to decode the rows below the region */
+	if (cinfo->output_scanline < cinfo->output_height) {
+		(*cinfo->src->term_source) (cinfo);
+		jpeg_abort_decompress(cinfo);
+	} else
+		jpeg_finish_decompress(cinfo);
 
 	return 0;
 }
@@ -597,31 +690,341 @@ static void jpeglib_panic(j_common_ptr cinfo)
 
 /*******************************************************************/
 
+/* set the chroma mode of the context from probed headers */
+static void
+shjpeg_probe_modes(shjpeg_context_t * context, const shjpeg_info_t * info)
+{
+	int h = info->comp[0].h_samp;
+	int v = info->comp[0].v_samp;
+
+	context->width = info->width;
+	context->height = info->height;
+
+	/* True if 4:2:0 */
+	context->mode420 =
+	    (info->comp[1].h_samp == h / 2) &&
+	    (info->comp[1].v_samp == v / 2) &&
+	    (info->comp[2].h_samp == h / 2) &&
+	    (info->comp[2].v_samp == v / 2);
+
+	/* True if 4:4:4 */
+	context->mode444 =
+	    (info->comp[1].h_samp == h) &&
+	    (info->comp[1].v_samp == v) &&
+	    (info->comp[2].h_samp == h) && (info->comp[2].v_samp == v);
+}
+
 /*
- * decode JPEG header
+ * Input replay
+ *
+ * The bytes read while parsing the headers are kept, and the stream
+ * is "rewound" by replaying them and then reading on from where the
+ * user's stream is. So the source is read once, which lets pipes and
+ * sockets be decoded without the application keeping a copy. Only a
+ * rewind beyond what was kept goes back to the user's init.
  */
 
-int shjpeg_decode_init(shjpeg_context_t * context)
+static int replay_init(void *priv)
 {
-	shjpeg_internal_t *data;
-	struct my_error_mgr jerr;
-	j_decompress_ptr cinfo;
+	shjpeg_context_t *context = priv;
+	shjpeg_context_data_t *cdata = context->context_data;
 
-	if (!context) {
-		D_ERROR("libshjpeg: invalid context passed.");
+	/* nothing read past the replay buffer */
+	if (cdata->src_started && cdata->src_pos == cdata->replay_len) {
+		cdata->replay_pos = 0;
+		return 0;
+	}
+
+	if (cdata->src_started && !cdata->src->init) {
+		D_ERROR("libshjpeg: can't rewind the stream.");
 		return -1;
 	}
 
-	data = (shjpeg_internal_t *) context->internal_data;
+	cdata->src_started = true;
+	cdata->replay_len = 0;
+	cdata->replay_pos = 0;
+	cdata->src_pos = 0;
 
-	/* check ref counter */
-	if (!data->ref_count) {
-		D_ERROR("libshjpeg: not initialized yet.");
+	return cdata->src->init ? cdata->src->init(cdata->src_priv) : 0;
+}
+
+/* keep bytes read from the source */
+static void replay_keep(shjpeg_context_data_t * cdata, void *buf, size_t len)
+{
+	if (cdata->replay_len + len > cdata->replay_size) {
+		size_t size = MAX(cdata->replay_size * 2,
+				  cdata->replay_len + len);
+		u8 *p = realloc(cdata->replay_buf, size);
+
+		if (!p) {
+			/* later rewinds go back to the source */
+			cdata->replay_record = false;
+			return;
+		}
+		cdata->replay_buf = p;
+		cdata->replay_size = size;
+	}
+
+	memcpy(cdata->replay_buf + cdata->replay_len, buf, len);
+	cdata->replay_len += len;
+	cdata->replay_pos = cdata->replay_len;
+}
+
+static int replay_read(void *priv, size_t * nbytes, void *dataptr)
+{
+	shjpeg_context_t *context = priv;
+	shjpeg_context_data_t *cdata = context->context_data;
+	size_t copied = 0, len;
+	int ret;
+
+	/* the readers take a short read as the end of the stream, so
+	   go on reading from the source after the replay */
+	if (cdata->replay_pos < cdata->replay_len) {
+		copied = MIN(*nbytes, cdata->replay_len - cdata->replay_pos);
+		memcpy(dataptr, cdata->replay_buf + cdata->replay_pos,
+		       copied);
+		cdata->replay_pos += copied;
+
+		if (copied == *nbytes)
+			return 0;
+	}
+
+	len = *nbytes - copied;
+	ret = cdata->src->read(cdata->src_priv, &len,
+			       (u8 *) dataptr + copied);
+	if (ret) {
+		*nbytes = copied;
+		return copied ? 0 : ret;
+	}
+
+	if (cdata->replay_record && cdata->src_pos == cdata->replay_len)
+		replay_keep(cdata, (u8 *) dataptr + copied, len);
+	cdata->src_pos += len;
+	*nbytes = copied + len;
+
+	return 0;
+}
+
+static void replay_finalize(void *priv)
+{
+	shjpeg_context_t *context = priv;
+	shjpeg_context_data_t *cdata = context->context_data;
+
+	if (cdata->src->finalize)
+		cdata->src->finalize(cdata->src_priv);
+}
+
+/* put the replay in front of the user's stream, and start keeping */
+static void replay_start(shjpeg_context_t * context)
+{
+	shjpeg_context_data_t *cdata = context->context_data;
+
+	/* the application may have set new stream ops meanwhile */
+	if (!cdata->replay || context->sops != &cdata->replay_sops) {
+		cdata->src = context->sops;
+		cdata->src_priv = context->priv_data;
+
+		cdata->replay_sops.init = replay_init;
+		cdata->replay_sops.read = cdata->src->read ? replay_read : NULL;
+		cdata->replay_sops.write = NULL;
+		cdata->replay_sops.finalize = replay_finalize;
+
+		context->sops = &cdata->replay_sops;
+		context->priv_data = context;
+		cdata->replay = true;
+	}
+
+	cdata->src_started = false;
+	cdata->replay_record = true;
+	cdata->replay_len = 0;
+	cdata->replay_pos = 0;
+	cdata->src_pos = 0;
+}
+
+/* back to the user's stream */
+static void replay_end(shjpeg_context_t * context)
+{
+	shjpeg_context_data_t *cdata = context->context_data;
+
+	if (!cdata->replay)
+		return;
+
+	if (context->sops == &cdata->replay_sops) {
+		context->sops = cdata->src;
+		context->priv_data = cdata->src_priv;
+	}
+	cdata->replay = false;
+
+	free(cdata->replay_buf);
+	cdata->replay_buf = NULL;
+	cdata->replay_size = 0;
+}
+
+/*
+ * EXIF thumbnail
+ *
+ * The thumbnail is decoded through stream ops that read it out of the
+ * user's stream, so the hardware and software paths need not know.
+ */
+
+static int thumb_init(void *priv)
+{
+	shjpeg_context_t *context = priv;
+	shjpeg_context_data_t *cdata = context->context_data;
+	size_t skip = cdata->thumb_offset;
+	u8 buf[SHJPEG_PROBE_CHUNK];
+
+	if (cdata->thumb_src->init &&
+	    cdata->thumb_src->init(cdata->thumb_src_priv))
 		return -1;
+
+	while (skip) {
+		size_t nbytes = MIN(skip, sizeof(buf));
+
+		if (cdata->thumb_src->read(cdata->thumb_src_priv, &nbytes, buf) ||
+		    !nbytes)
+			return -1;
+		skip -= nbytes;
 	}
 
-	/* initialize libjpeg */
+	cdata->thumb_left = cdata->thumb_size;
+
+	return 0;
+}
+
+static int thumb_read(void *priv, size_t * nbytes, void *dataptr)
+{
+	shjpeg_context_t *context = priv;
+	shjpeg_context_data_t *cdata = context->context_data;
+	int ret;
+
+	*nbytes = MIN(*nbytes, cdata->thumb_left);
+	if (!*nbytes)
+		return 0;
+
+	ret = cdata->thumb_src->read(cdata->thumb_src_priv, nbytes, dataptr);
+	if (!ret)
+		cdata->thumb_left -= *nbytes;
+
+	return ret;
+}
+
+static void thumb_finalize(void *priv)
+{
+	shjpeg_context_t *context = priv;
+	shjpeg_context_data_t *cdata = context->context_data;
+
+	if (cdata->thumb_src->finalize)
+		cdata->thumb_src->finalize(cdata->thumb_src_priv);
+}
+
+/* back to the stream of the image */
+static void thumb_restore(shjpeg_context_t * context)
+{
+	shjpeg_context_data_t *cdata = context->context_data;
+
+	if (!cdata->thumb)
+		return;
+
+	if (context->sops == &cdata->thumb_sops) {
+		context->sops = cdata->thumb_src;
+		context->priv_data = cdata->thumb_src_priv;
+	}
+	cdata->thumb = false;
+}
+
+/* switch to the thumbnail if it is large enough, info is updated */
+static void thumb_select(shjpeg_context_t * context, shjpeg_info_t * info)
+{
+	shjpeg_context_data_t *cdata = context->context_data;
+	shjpeg_info_t thumb;
+
+	if (!context->sops->read)
+		return;
+
+	cdata->thumb_src = context->sops;
+	cdata->thumb_src_priv = context->priv_data;
+	cdata->thumb_offset = info->thumbnail_offset;
+	cdata->thumb_size = info->thumbnail_size;
+
+	cdata->thumb_sops.init = thumb_init;
+	cdata->thumb_sops.read = thumb_read;
+	cdata->thumb_sops.write = NULL;
+	cdata->thumb_sops.finalize = thumb_finalize;
+
+	context->sops = &cdata->thumb_sops;
+	context->priv_data = context;
+	cdata->thumb = true;
+
+	if (!thumb_init(context) &&
+	    !shjpeg_markers_probe(context->sops, context, &thumb) &&
+	    thumb.height > 0 &&
+	    thumb.width >= cdata->thumb_min_width &&
+	    thumb.height >= cdata->thumb_min_height) {
+		D_INFO("libshjpeg: using %dx%d EXIF thumbnail",
+		       thumb.width, thumb.height);
+		*info = thumb;
+		return;
+	}
+
+	thumb_restore(context);
+}
+
+/*
+ * decode JPEG header
+ */
+
+static int decode_headers(shjpeg_context_t * context)
+{
+	shjpeg_context_data_t *cdata = context->context_data;
+	struct my_error_mgr jerr;
+	j_decompress_ptr cinfo;
+	shjpeg_info_t info;
+	bool probed = false;
+
+	/* drop the decompressor of the previous image */
 	cinfo = &context->jpeg_decomp;
+	jpeg_destroy_decompress(cinfo);
+	cdata->sw_header = false;
+
+	/*
+	 * Probe the headers natively first. If the JPU can decode the
+	 * image, libjpeg is only set up later should it have to fall back.
+	 */
+	if (context->libjpeg_disabled >= 0 || cdata->thumb_enabled) {
+		if (context->sops->init)
+			context->sops->init(context->priv_data);
+
+		probed = !shjpeg_markers_probe(context->sops,
+					       context->priv_data, &info);
+
+		/* decode the EXIF thumbnail instead, if large enough */
+		if (probed && cdata->thumb_enabled && info.thumbnail_size)
+			thumb_select(context, &info);
+	}
+
+	/* decide between the JPU and libjpeg up front */
+	if (context->libjpeg_disabled < 0)
+		cdata->hw_reason = SHJPEG_HW_DISABLED;
+	else if (!probed)
+		cdata->hw_reason = SHJPEG_HW_BROKEN;
+	else
+		cdata->hw_reason = shjpeg_classify(&info);
+	shjpeg_count_decision(cdata->hw_reason);
+
+	if (cdata->hw_reason == SHJPEG_HW_OK) {
+		shjpeg_probe_modes(context, &info);
+		D_INFO("libshjpeg: probed %dx%d%s",
+		       context->width, context->height,
+		       context->mode420 ? " 4:2:0" : "");
+		cdata->decode_gray = false;
+		return 0;
+	}
+
+	D_INFO("libshjpeg: decoding with libjpeg - %s",
+	       shjpeg_hw_reason_string(cdata->hw_reason));
+
+	/* initialize libjpeg */
 	cinfo->err = jpeg_std_error(&jerr.pub);
 	jerr.pub.error_exit = jpeglib_panic;
 
@@ -635,10 +1038,19 @@ int shjpeg_decode_init(shjpeg_context_t * context)
 	shjpeg_init_src(context, cinfo);
 	jpeg_read_header(cinfo, TRUE);
 	jpeg_calc_output_dimensions(cinfo);
+	cdata->sw_header = true;
 
 	context->width = cinfo->output_width;
 	context->height = cinfo->output_height;
 
+	/* The JPU only decodes YCbCr images */
+	cdata->decode_gray = (cinfo->num_components == 1);
+	if (cinfo->num_components != 3) {
+		context->mode420 = false;
+		context->mode444 = false;
+		return 0;
+	}
+
 	/* True if 4:2:0 */
 	context->mode420 =
 	    (cinfo->comp_info[1].h_samp_factor ==
@@ -664,6 +1076,37 @@ int shjpeg_decode_init(shjpeg_context_t * context)
 	return 0;
 }
 
+int shjpeg_decode_init(shjpeg_context_t * context)
+{
+	shjpeg_internal_t *data;
+	shjpeg_context_data_t *cdata;
+	int ret;
+
+	if (!context) {
+		D_ERROR("libshjpeg: invalid context passed.");
+		return -1;
+	}
+
+	data = (shjpeg_internal_t *) context->internal_data;
+	cdata = context->context_data;
+
+	/* check ref counter */
+	if (!data->ref_count) {
+		D_ERROR("libshjpeg: not initialized yet.");
+		return -1;
+	}
+
+	/* keep what is read of the headers, to read the stream once */
+	thumb_restore(context);
+	replay_start(context);
+
+	ret = decode_headers(context);
+
+	cdata->replay_record = false;
+
+	return ret;
+}
+
 /*
  * deocde main
  */
@@ -674,11 +1117,14 @@ shjpeg_decode_run(shjpeg_context_t * context,
 		  void *virt, int width, int height, int pitch)
 {
 	shjpeg_internal_t *data;
+	shjpeg_context_data_t *cdata;
 	unsigned long phys;
 	struct my_error_mgr jerr;
+	int rows = 0;
 	int ret = -1;
 
 	data = (shjpeg_internal_t *) context->internal_data;
+	cdata = context->context_data;
 
 	/* sanity check */
 	if (!data->ref_count) {
@@ -725,6 +1171,7 @@ shjpeg_decode_run(shjpeg_context_t * context,
 	case SHJPEG_PF_RGB32:
 	case SHJPEG_PF_RGB24:
 	case SHJPEG_PF_YCbCr:
+	case SHJPEG_PF_GRAYSCALE:
 		break;
 
 	default:
@@ -734,18 +1181,32 @@ shjpeg_decode_run(shjpeg_context_t * context,
 
 	// Reset libjpeg used flag to zero
 	context->libjpeg_used = 0;
+	cdata->band_rows = 0;
 
-	if ((!context->mode444) && (context->libjpeg_disabled >= 0)) {
+	if (cdata->hw_reason == SHJPEG_HW_OK) {
 		if (context->sops->init)
 			context->sops->init(context->priv_data);
 
-		ret = decode_hw(data, context, format, phys, width,
-				height, pitch);
+		ret = decode_hw(data, context, format, phys,
+				phys + pitch * height, width, height,
+				pitch, NULL, &rows);
 	}
 
 	if ((context->libjpeg_disabled <= 0) && (ret)) {
-		ret = decode_sw(context, format, virt, width,
-				height, pitch);
+		shjpeg_rect_t rect = { 0, rows, context->width,
+			context->height - rows
+		};
+
+		/* keep the rows the JPU has decoded */
+		if (rows) {
+			D_INFO("libshjpeg: resuming with libjpeg at row %d",
+			       rows);
+		}
+
+		ret = decode_sw(context, format, virt + rows * pitch,
+				virt + height * pitch +
+				((format == SHJPEG_PF_NV12) ?
+				 rows / 2 : rows) * pitch, &rect, pitch, 0);
 
 		// set the flag to notify the use of libjpeg
 		if (!ret)
@@ -755,6 +1216,294 @@ shjpeg_decode_run(shjpeg_context_t * context,
 	return ret;
 }
 
+/*
+ * decode into a surface
+ */
+
+/* true if the JPU can write the image to the surface in frame mode */
+static bool
+can_decode_direct(shjpeg_context_t * context, shjpeg_pixelformat format,
+		  unsigned long phys_y, unsigned long phys_c, int pitch)
+{
+	if ((context->mode420 && format != SHJPEG_PF_NV12) ||
+	    (!context->mode420 && format != SHJPEG_PF_NV16))
+		return false;
+
+	/* the JPU writes whole MCUs, which must not hit the neighbours */
+	if ((context->width % 16) ||
+	    (context->height % (context->mode420 ? 16 : 8)))
+		return false;
+
+	return phys_y && phys_c && !(phys_y & 7) && !(phys_c & 7) &&
+	    !(pitch & 7);
+}
+
+static int
+decode_surface(shjpeg_context_t * context,
+	       const shjpeg_surface_t * dst,
+	       const shjpeg_rect_t * rect, int x, int y)
+{
+	shjpeg_internal_t *data;
+	shjpeg_context_data_t *cdata;
+	shjpeg_pixelformat format = dst->format;
+	shjpeg_jpu_crop_t crop;
+	struct my_error_mgr jerr;
+	bool nv = (format == SHJPEG_PF_NV12 || format == SHJPEG_PF_NV16);
+	bool whole, hw;
+	int span;
+	int rows = 0;
+	int ret = -1;
+
+	data = (shjpeg_internal_t *) context->internal_data;
+	cdata = context->context_data;
+
+	/* sanity check */
+	if (!data->ref_count) {
+		D_ERROR("libshjpeg: not initialized yet.");
+		return -1;
+	}
+
+	/* check if the region is within the image */
+	if ((rect->x < 0) || (rect->y < 0) ||
+	    (rect->w <= 0) || (rect->h <= 0) ||
+	    (rect->x + rect->w > context->width) ||
+	    (rect->y + rect->h > context->height)) {
+		D_ERROR("libshjpeg: region %d,%d %dx%d is out of the image.",
+			rect->x, rect->y, rect->w, rect->h);
+		return -1;
+	}
+
+	/* check if it fits in the surface, NV12/NV16 chroma may be one
+	   pixel wider */
+	span = nv ? ((x + rect->w + 1) & ~1) : (x + rect->w);
+	if ((x < 0) || (y < 0) ||
+	    (x + rect->w > dst->width) || (y + rect->h > dst->height) ||
+	    (span * SHJPEG_PF_PITCH_MULTIPLY(format) > dst->pitch)) {
+		D_ERROR("libshjpeg: width, height or pitch doesn't fit.");
+		return -1;
+	}
+
+	/* error if virtual address is not given */
+	if (!dst->py || (nv && !dst->pc)) {
+		D_ERROR("libshjpeg: buffer address is not given.");
+		return -1;
+	}
+
+	/* chroma samples can't be split */
+	if ((nv && (x & 1)) || ((format == SHJPEG_PF_NV12) && (y & 1))) {
+		D_ERROR("libshjpeg: %d,%d is not aligned to chroma.", x, y);
+		return -1;
+	}
+
+	crop.format = format;
+	crop.pitch = dst->pitch;
+	crop.py = dst->py + y * dst->pitch +
+	    x * SHJPEG_PF_PITCH_MULTIPLY(format);
+	crop.pc = nv ? dst->pc + ((format == SHJPEG_PF_NV12) ?
+				  y / 2 : y) * dst->pitch + x : NULL;
+	crop.x = rect->x;
+	crop.y = rect->y;
+	crop.w = rect->w;
+	crop.h = rect->h;
+
+	whole = (rect->x == 0) && (rect->y == 0) &&
+	    (rect->w == context->width) && (rect->h == context->height);
+	hw = (cdata->hw_reason == SHJPEG_HW_OK);
+
+	context->jpeg_decomp.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpeglib_panic;
+
+	if (setjmp(jerr.setjmp_buffer)) {
+		D_ERROR
+		    ("libshjpeg: Error while decoding image with libjpeg!");
+		return -1;
+	}
+
+	// Reset libjpeg used flag to zero
+	context->libjpeg_used = 0;
+	cdata->band_rows = 0;
+
+	switch (format) {
+	case SHJPEG_PF_NV12:
+	case SHJPEG_PF_NV16:
+	case SHJPEG_PF_YCbCr:
+	case SHJPEG_PF_GRAYSCALE:
+		if (!hw)
+			break;
+
+		if (context->sops->init)
+			context->sops->init(context->priv_data);
+
+		if (whole) {
+			unsigned long phys_y, phys_c;
+
+			phys_y = uiomux_all_virt_to_phys(crop.py);
+			phys_c = crop.pc ? uiomux_all_virt_to_phys(crop.pc) : 0;
+
+			/* let the JPU write to the surface */
+			if (can_decode_direct(context, format, phys_y,
+					      phys_c, dst->pitch)) {
+				ret = decode_hw(data, context, format,
+						phys_y, phys_c,
+						context->width,
+						context->height,
+						dst->pitch, NULL, &rows);
+				break;
+			}
+		}
+
+		/* copied out of the line buffers by the CPU */
+		ret = decode_hw(data, context, format, 0, 0,
+				context->width, context->height,
+				dst->pitch, &crop, &rows);
+		break;
+
+	case SHJPEG_PF_RGB16:
+	case SHJPEG_PF_RGB32:
+	case SHJPEG_PF_RGB24:
+#if defined(HAVE_SHVIO)
+		/* VIO converts into the surface */
+		if (hw && whole) {
+			unsigned long phys_y =
+			    uiomux_all_virt_to_phys(crop.py);
+
+			if (!phys_y)
+				break;
+
+			if (context->sops->init)
+				context->sops->init(context->priv_data);
+
+			ret = decode_hw(data, context, format, phys_y, 0,
+					context->width, context->height,
+					dst->pitch, NULL, &rows);
+		}
+#endif /* defined(HAVE_SHVIO) */
+		break;
+
+	default:
+		D_ERROR("libshjpeg: Unsupported destination format.");
+		return -1;
+	}
+
+	if ((context->libjpeg_disabled <= 0) && (ret)) {
+		shjpeg_rect_t rest = *rect;
+		int done = MIN(MAX(rows - rect->y, 0), rect->h);
+
+		/* keep the rows of the region the JPU has decoded */
+		if (format == SHJPEG_PF_NV12)
+			done &= ~1;
+		if (done) {
+			D_INFO("libshjpeg: resuming with libjpeg at row %d",
+			       rect->y + done);
+			rest.y += done;
+			rest.h -= done;
+			crop.py += done * dst->pitch;
+			if (crop.pc)
+				crop.pc += ((format == SHJPEG_PF_NV12) ?
+					    done / 2 : done) * dst->pitch;
+		}
+
+		ret = decode_sw(context, format, crop.py, crop.pc, &rest,
+				dst->pitch, rect->y);
+
+		// set the flag to notify the use of libjpeg
+		if (!ret)
+			context->libjpeg_used = 1;
+	}
+
+	return ret;
+}
+
+int
+shjpeg_decode_run_rect(shjpeg_context_t * context,
+		       shjpeg_pixelformat format,
+		       void *virt, const shjpeg_rect_t * rect, int pitch)
+{
+	shjpeg_surface_t dst;
+
+	if (!context || !rect) {
+		D_ERROR("libshjpeg: invalid context or rectangle passed.");
+		return -1;
+	}
+
+	dst.format = format;
+	dst.py = virt;
+	dst.pc = virt ? virt + rect->h * pitch : NULL;
+	dst.pitch = pitch;
+	dst.width = rect->w;
+	dst.height = rect->h;
+
+	return decode_surface(context, &dst, rect, 0, 0);
+}
+
+int
+shjpeg_decode_run_surface(shjpeg_context_t * context,
+			  const shjpeg_surface_t * surface,
+			  const shjpeg_rect_t * rect, int x, int y)
+{
+	shjpeg_rect_t whole;
+
+	if (!context || !surface) {
+		D_ERROR("libshjpeg: invalid context or surface passed.");
+		return -1;
+	}
+
+	if (!rect) {
+		whole.x = whole.y = 0;
+		whole.w = context->width;
+		whole.h = context->height;
+		rect = &whole;
+	}
+
+	return decode_surface(context, surface, rect, x, y);
+}
+
+/*
+ * band completion
+ */
+
+void shjpeg_decode_band(shjpeg_context_t * context, int rows)
+{
+	shjpeg_context_data_t *cdata = context->context_data;
+
+	/* rows a fallback decodes again were reported already */
+	if (!cdata->band_cb || (rows <= cdata->band_rows))
+		return;
+
+	cdata->band_cb(context, cdata->band_rows, rows - cdata->band_rows,
+		       cdata->band_priv);
+	cdata->band_rows = rows;
+}
+
+int
+shjpeg_decode_set_band_callback(shjpeg_context_t * context,
+				shjpeg_band_callback callback, void *priv)
+{
+	shjpeg_context_data_t *cdata;
+
+	if (!context) {
+		D_ERROR("libshjpeg: invalid context passed.");
+		return -1;
+	}
+
+	cdata = context->context_data;
+	cdata->band_cb = callback;
+	cdata->band_priv = priv;
+
+	return 0;
+}
+
+/*
+ * how the current image is decoded
+ */
+
+shjpeg_hw_reason shjpeg_decode_get_reason(shjpeg_context_t * context)
+{
+	shjpeg_context_data_t *cdata = context->context_data;
+
+	return cdata->hw_reason;
+}
+
 /*
  * clean decode context
  */
@@ -762,4 +1511,29 @@ shjpeg_decode_run(shjpeg_context_t * context,
 void shjpeg_decode_shutdown(shjpeg_context_t * context)
 {
 	jpeg_destroy_decompress(&context->jpeg_decomp);
+	thumb_restore(context);
+	replay_end(context);
+}
+
+/*
+ * decode the EXIF thumbnail if it is large enough
+ */
+
+int
+shjpeg_decode_set_thumbnail(shjpeg_context_t * context,
+			    int min_width, int min_height)
+{
+	shjpeg_context_data_t *cdata;
+
+	if (!context) {
+		D_ERROR("libshjpeg: invalid context passed.");
+		return -1;
+	}
+
+	cdata = context->context_data;
+	cdata->thumb_enabled = (min_width > 0 || min_height > 0);
+	cdata->thumb_min_width = min_width;
+	cdata->thumb_min_height = min_height;
+
+	return 0;
 }
@@ -33,59 +33,63 @@
 #include <shjpeg/shjpeg.h>
 #include "shjpeg_internal.h"
 #include "shjpeg_jpu.h"
+#include "shjpeg_markers.h"
 #if defined(HAVE_SHVIO)
 #include "shjpeg_vio.h"
 #endif
 #include "shjpeg_softhelper.h"
 
-static inline int coded_data_amount(shjpeg_internal_t * data)
-{
-	return (shjpeg_jpu_getreg32(data, JPU_JCDTCU) << 16) |
-	    (shjpeg_jpu_getreg32(data, JPU_JCDTCM) << 8) |
-	    (shjpeg_jpu_getreg32(data, JPU_JCDTCD));
-}
+/* image to encode */
+typedef struct {
+	shjpeg_pixelformat format;
+	unsigned long phys_y;		/* Y (or packed) plane for the JPU/VIO */
+	unsigned long phys_c;		/* CbCr plane for the JPU/VIO */
+	int width, height, pitch;
+	shjpeg_jpu_crop_t virt;		/* virtual addresses of the planes */
+	bool cpu;			/* fed by the CPU from virt */
+	u32 dri;			/* if non-zero, overrides restart interval */
+} encode_src_t;
 
-static int
-encode_hw(shjpeg_internal_t * data,
-	  shjpeg_context_t * context,
-	  shjpeg_pixelformat format,
-	  unsigned long phys, int width, int height, int pitch)
+/* restart interval to program for an image of the given width */
+static u32
+restart_interval(shjpeg_context_data_t * cdata, int width)
 {
-	int ret = 0;
-	int i;
-	int written = 0;
-	bool mode420 = false;
-	shjpeg_jpu_t jpeg;
-	vmap_data_t mdata;
+	u32 mcus_per_row, dri;
 
-	D_DEBUG_AT(SH7722_JPEG, "( %p, 0x%08lx|%d [%dx%d])",
-		   data, phys, pitch, width, height);
+	if (!cdata->dri_valid)
+		return SHJPEG_JPU_DEFAULT_DRI;
 
-	memset(&mdata, 0, sizeof(mdata));
+	if (!cdata->dri_rows)
+		return cdata->dri;
 
-	D_DEBUG_AT(SH7722_JPEG, "	 -> locking JPU...");
+	/* MCU is 16 pixels wide for both 4:2:0 and 4:2:2 */
+	mcus_per_row = ((u32) width + 15) / 16;
+	dri = mcus_per_row * cdata->dri_rows;
 
-	/* Locking JPU using uiomux_lock */
-	if (uiomux_lock (data->uiomux, UIOMUX_JPU) < 0) {
-		D_PERROR("libshjpeg: Could not lock JPEG engine!");
-		return -1;
-	}
+	return (dri > SHJPEG_JPU_MAX_DRI) ? SHJPEG_JPU_MAX_DRI : dri;
+}
 
-	D_DEBUG_AT(SH7722_JPEG, "	 -> opening file for writing...");
+/* true if the JPU reads src directly (frame mode) */
+static bool
+encode_frame_mode(const encode_src_t * src)
+{
+	return !src->cpu &&
+	    (src->format == SHJPEG_PF_NV12 || src->format == SHJPEG_PF_NV16);
+}
 
-	if (context->sops->init)
-		context->sops->init(context->priv_data);
+/* program the JPU from reset to encode images laid out like src */
+static void
+encode_setup(shjpeg_internal_t * data,
+	     shjpeg_context_t * context, const encode_src_t * src)
+{
+	bool mode420 = false;
+	shjpeg_context_data_t *cdata = context->context_data;
+	int width = src->width;
+	int height = src->height;
+	u32 dri;
 
 	D_DEBUG_AT(SH7722_JPEG, "	 -> setting...");
 
-	/* Initialize JPEG state. */
-	jpeg.state = SHJPEG_JPU_START;
-	jpeg.flags = SHJPEG_JPU_FLAG_ENCODE;
-	jpeg.buffers = 3;
-
-	/* Always enable reload mode. */
-	jpeg.flags |= SHJPEG_JPU_FLAG_RELOAD;
-
 	/* Program JPU from RESET. */
 	shjpeg_jpu_reset(data);
 	shjpeg_jpu_setreg32(data, JPU_JCMOD,
@@ -94,8 +98,9 @@ encode_hw(shjpeg_internal_t * data,
 
 	shjpeg_jpu_setreg32(data, JPU_JCQTN, 0x14);
 	shjpeg_jpu_setreg32(data, JPU_JCHTN, 0x3c);
-	shjpeg_jpu_setreg32(data, JPU_JCDRIU, 0x02);
-	shjpeg_jpu_setreg32(data, JPU_JCDRID, 0x00);
+	dri = src->dri ? src->dri : restart_interval(cdata, width);
+	shjpeg_jpu_setreg32(data, JPU_JCDRIU, dri >> 8);
+	shjpeg_jpu_setreg32(data, JPU_JCDRID, dri & 0xff);
 	shjpeg_jpu_setreg32(data, JPU_JCHSZU, width >> 8);
 	shjpeg_jpu_setreg32(data, JPU_JCHSZD, width & 0xff);
 	shjpeg_jpu_setreg32(data, JPU_JCVSZU, height >> 8);
@@ -111,7 +116,7 @@ encode_hw(shjpeg_internal_t * data,
 	shjpeg_jpu_setreg32(data, JPU_JIFESVSZ,
 			    ((u32)height + 3) & 0x00000ffc);
 
-	if (format == SHJPEG_PF_NV12 || format == SHJPEG_PF_NV16) {
+	if (encode_frame_mode(src)) {
 		/* Setup JPU for encoding in frame mode (directly from surface). */
 		shjpeg_jpu_setreg32(data, JPU_JINTE,
 				    JPU_JINTS_INS10_XFER_DONE |
@@ -121,14 +126,9 @@ encode_hw(shjpeg_internal_t * data,
 				    JPU_JIFECNT_RELOAD_ENABLE | (mode420 ?
 								 1 : 0));
 
-		shjpeg_jpu_setreg32(data, JPU_JIFESYA1, phys);
-		shjpeg_jpu_setreg32(data, JPU_JIFESCA1,
-				    phys + pitch * height);
 		shjpeg_jpu_setreg32(data, JPU_JIFESMW,
-				    ((u32)pitch + 7) & 0x0ff8);
+				    ((u32)src->pitch + 7) & 0x0ff8);
 	} else {
-		jpeg.height = height;
-
 		/* Setup JPU for encoding in line buffer mode. */
 		shjpeg_jpu_setreg32(data, JPU_JINTE,
 				    JPU_JINTS_INS11_LINEBUF0 |
@@ -152,55 +152,117 @@ encode_hw(shjpeg_internal_t * data,
 				    SHJPEG_JPU_LINEBUFFER_SIZE_Y);
 		shjpeg_jpu_setreg32(data, JPU_JIFESMW,
 				    SHJPEG_JPU_LINEBUFFER_PITCH);
-		/* configs */
-		jpeg.sa_y = phys;
-		jpeg.sa_c = phys + pitch * height;
-		jpeg.sa_inc = pitch * SHJPEG_JPU_LINEBUFFER_HEIGHT;
-
-		if (format == SHJPEG_PF_YCbCr) {
-			jpeg.flags |= SHJPEG_JPU_FLAG_SOFTCONVERT;
-			jpeg.soft_offset = jpeg.soft_line = 0;
-
-			context->pitch = pitch;
-			if (get_frame_buffer_virtual(data, context,
-					&mdata, format, phys) < 0) {
-				return -1;
-			}
 
-		}
-#if defined(HAVE_SHVIO)
-		else {
-			jpeg.flags |= SHJPEG_JPU_FLAG_CONVERT;
-			/* save some attibutes of input image
-			   to set up the vio hardware later */
-			context->pitch = pitch;
-			context->format = format;
-		}
-#endif /* defined(HAVE_SHVIO) */
+		/* The JPU always codes three components, so
+		   grayscale is coded with flat chroma. */
+		if (src->format == SHJPEG_PF_GRAYSCALE)
+			soft_fill_chroma(data, (width + 15) & ~15, height);
 	}
 
 	/* init QT/HT */
-	shjpeg_jpu_init_quantization_table(data);
+	shjpeg_jpu_set_quantization_table(data, cdata->qtbl_valid ?
+					  cdata->qtbl : NULL);
 	shjpeg_jpu_init_huffman_table(data);
+}
 
-	D_DEBUG_AT(SH7722_JPEG, "	 -> starting...");
+/* point the JPU, VIO or CPU copy at the image of src */
+static int
+encode_source(shjpeg_internal_t * data,
+	      shjpeg_context_t * context, const encode_src_t * src,
+	      shjpeg_jpu_t * jpeg, vmap_data_t * mdata)
+{
+	shjpeg_pixelformat format = src->format;
+	unsigned long phys = src->phys_y;
+	int pitch = src->pitch;
+
+	if (encode_frame_mode(src)) {
+		shjpeg_jpu_setreg32(data, JPU_JIFESYA1, phys);
+		shjpeg_jpu_setreg32(data, JPU_JIFESCA1, src->phys_c);
+		return 0;
+	}
+
+	jpeg->height = src->height;
+
+	/* the conversions take the size of the source from the context */
+	context->width = src->width;
+	context->height = src->height;
+	context->pitch = pitch;
+
+	/* configs */
+	jpeg->sa_y = phys;
+	jpeg->sa_c = src->phys_c;
+	jpeg->sa_inc = pitch * SHJPEG_JPU_LINEBUFFER_HEIGHT;
+
+	if (format == SHJPEG_PF_GRAYSCALE)
+		jpeg->flags |= SHJPEG_JPU_FLAG_GRAYSCALE;
+
+	if (src->cpu) {
+		/* Copy the source into the line buffers */
+		jpeg->flags |= SHJPEG_JPU_FLAG_SOFTCONVERT |
+		    SHJPEG_JPU_FLAG_CROP;
+		jpeg->soft_offset = jpeg->soft_line = 0;
+		jpeg->crop = src->virt;
+	} else if (format == SHJPEG_PF_YCbCr ||
+		   format == SHJPEG_PF_GRAYSCALE) {
+		jpeg->flags |= SHJPEG_JPU_FLAG_SOFTCONVERT;
+		jpeg->soft_offset = jpeg->soft_line = 0;
+
+		if (get_frame_buffer_virtual(data, context,
+				mdata, format, phys) < 0) {
+			return -1;
+		}
+
+	}
+#if defined(HAVE_SHVIO)
+	else {
+		jpeg->flags |= SHJPEG_JPU_FLAG_CONVERT;
+		/* save some attibutes of input image
+		   to set up the vio hardware later */
+		context->format = format;
+	}
+#endif /* defined(HAVE_SHVIO) */
+
+	return 0;
+}
+
+/*
+ * run the JPU and write out what it codes, until the image is done or,
+ * in push mode, the caller can fill the next line buffer
+ */
+static int
+encode_loop(shjpeg_internal_t * data,
+	    shjpeg_context_t * context, shjpeg_jpu_t * jpeg, int *written)
+{
+	int ret = 0;
+	int i;
 
-	/* State machine. */
 	for (;;) {
 		/* Run the state machine. */
-		if (shjpeg_jpu_run(context, data, &jpeg) < 0) {
+		if (shjpeg_jpu_run(context, data, jpeg) < 0) {
 			D_PERROR("libshjpeg: shjpeg_jpu_run() failed!");
 			ret = -1;
 			break;
 		}
 
-		D_ASSERT(jpeg.state != SHJPEG_JPU_START);
+		D_ASSERT(jpeg->state != SHJPEG_JPU_START);
+
+		/* Stop right away if the output got too large. */
+		if (jpeg->state == SHJPEG_JPU_END && jpeg->oversize) {
+			D_ERROR("libshjpeg: coded data exceeds %d bytes, "
+				"aborted.", (int) jpeg->max_size);
+			*written = shjpeg_jpu_coded_data_amount(data);
+			shjpeg_jpu_setreg32(data, JPU_JCCMD, JPU_JCCMD_END);
+			shjpeg_jpu_reset(data);
+			errno = EFBIG;
+			ret = SHJPEG_ERR_OVERSIZE;
+			break;
+		}
 
 		/* Check for loaded buffers. */
 		for (i = 1; i <= 2; i++) {
-			if (jpeg.buffers & i) {
+			if (jpeg->buffers & i) {
 				int amount =
-				    coded_data_amount(data) - written;
+				    shjpeg_jpu_coded_data_amount(data) - *written;
 				size_t len;
 				void *ptr;
 
@@ -216,86 +278,1964 @@ encode_hw(shjpeg_internal_t * data,
 				len = amount;
 				context->sops->write(context->priv_data,
 						     &len, ptr);
-				written += len;
+				*written += len;
 			}
 		}
 
 		/* Handle end (or error). */
-		if (jpeg.state == SHJPEG_JPU_END) {
-			if (jpeg.error) {
+		if (jpeg->state == SHJPEG_JPU_END) {
+			if (jpeg->error) {
 				D_ERROR("libshjpeg: ERROR 0x%x!",
-					jpeg.error);
+					jpeg->error);
 				ret = -1;
 			}
 
 			break;
 		}
+
+		/* Back to the caller for more rows. */
+		if (jpeg->starved)
+			break;
 	}
 
 	D_INFO
 	    ("libshjpeg: Coded data amount: = %5d (written: %d, buffers: %d)",
-	     coded_data_amount(data), written, jpeg.buffers);
+	     shjpeg_jpu_coded_data_amount(data), *written, jpeg->buffers);
+
+	return ret;
+}
+
+/* encode src with the JPU programmed by encode_setup() */
+static int
+encode_run(shjpeg_internal_t * data,
+	   shjpeg_context_t * context,
+	   const encode_src_t * src, size_t max_size)
+{
+	int ret;
+	int written = 0;
+	shjpeg_jpu_t jpeg;
+	vmap_data_t mdata;
+	shjpeg_context_data_t *cdata = context->context_data;
+
+	memset(&mdata, 0, sizeof(mdata));
+
+	D_DEBUG_AT(SH7722_JPEG, "	 -> opening file for writing...");
+
+	if (context->sops->init)
+		context->sops->init(context->priv_data);
+
+	/* Initialize JPEG state. */
+	jpeg.state = SHJPEG_JPU_START;
+	jpeg.flags = SHJPEG_JPU_FLAG_ENCODE;
+	jpeg.buffers = 3;
+	jpeg.max_size = max_size;
+
+	/* Always enable reload mode. */
+	jpeg.flags |= SHJPEG_JPU_FLAG_RELOAD;
+
+	if (encode_source(data, context, src, &jpeg, &mdata) < 0) {
+		cdata->coded_size = 0;
+		return -1;
+	}
+
+	D_DEBUG_AT(SH7722_JPEG, "	 -> starting...");
+
+	ret = encode_loop(data, context, &jpeg, &written);
+
+	/* coded size so far if aborted */
+	cdata->coded_size = written;
 
 	free_frame_buffer_virtual(&mdata);
 
+	return ret;
+}
+
+static int
+encode_lock(shjpeg_internal_t * data, shjpeg_context_t * context)
+{
+	D_DEBUG_AT(SH7722_JPEG, "	 -> locking JPU...");
+
+	/* Locking JPU using uiomux_lock */
+	if (uiomux_lock (data->uiomux, UIOMUX_JPU) < 0) {
+		D_PERROR("libshjpeg: Could not lock JPEG engine!");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+encode_unlock(shjpeg_internal_t * data, shjpeg_context_t * context)
+{
 	/* Unlocking JPU using uiomux_unlock */
 	if (uiomux_unlock(data->uiomux, UIOMUX_JPU)) {
-		ret = -1;
 		D_PERROR("libshjpeg: Could not unlock JPEG engine!");
+		return -1;
 	}
 
+	return 0;
+}
+
+static int
+encode_hw(shjpeg_internal_t * data,
+	  shjpeg_context_t * context,
+	  const encode_src_t * src, size_t max_size)
+{
+	int ret;
+
+	D_DEBUG_AT(SH7722_JPEG, "( %p, 0x%08lx|%d [%dx%d])",
+		   data, src->phys_y, src->pitch, src->width, src->height);
+
+	if (encode_lock(data, context) < 0)
+		return -1;
+
+	encode_setup(data, context, src);
+	ret = encode_run(data, context, src, max_size);
+
+	if (encode_unlock(data, context) < 0)
+		ret = -1;
+
 	return ret;
 }
 
 /*
- * shpjpeg_encode()
+ * Tiled encode of images wider than the line buffers
+ *
+ * The image is split into column stripes, which are encoded one by one
+ * with the same tables and a restart interval that divides the width
+ * of every stripe. Each MCU row of a stripe is then a whole number of
+ * restart intervals, so the entropy coded segments can be interleaved
+ * row by row into one baseline JPEG with renumbered RST markers.
  */
 
-int
-shjpeg_encode(shjpeg_context_t * context,
-	      shjpeg_pixelformat format,
-	      void *virt, int width, int height, int pitch)
+/* encoded stripe kept in memory */
+typedef struct {
+	u8 *buf;
+	size_t len;
+	size_t size;
+} membuf_t;
+
+static int membuf_init(void *priv)
 {
-	shjpeg_internal_t *data;
-	unsigned long phys;
+	((membuf_t *) priv)->len = 0;
+	return 0;
+}
 
-	if (!context) {
-		D_ERROR("libjpeg: invalid context passed.");
+static int membuf_write(void *priv, size_t * nbytes, void *dataptr)
+{
+	membuf_t *mb = priv;
+
+	if (mb->len + *nbytes > mb->size) {
+		size_t size = MAX(mb->size * 2, mb->len + *nbytes);
+		u8 *buf = realloc(mb->buf, size);
+
+		if (!buf) {
+			*nbytes = 0;
+			return -1;
+		}
+		mb->buf = buf;
+		mb->size = size;
+	}
+
+	memcpy(mb->buf + mb->len, dataptr, *nbytes);
+	mb->len += *nbytes;
+
+	return 0;
+}
+
+static shjpeg_sops membuf_sops = {
+	.init = membuf_init,
+	.read = NULL,
+	.write = membuf_write,
+	.finalize = NULL,
+};
+
+static int gcd(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * Choose n stripes of k MCUs (the last one may be narrower) and a
+ * restart interval of d MCUs, preferring few stripes and a long
+ * restart interval.
+ */
+static void
+tile_layout(int mcus, int max_mcus, int *n, int *k, int *d)
+{
+	int nmin = (mcus + max_mcus - 1) / max_mcus;
+	int tn, tk;
+
+	*n = nmin;
+	*k = max_mcus;
+	*d = 0;
+
+	for (tn = nmin; tn <= nmin + 2; tn++) {
+		for (tk = (mcus + tn - 1) / tn; tk <= max_mcus; tk++) {
+			int last = mcus - (tn - 1) * tk;
+			int g;
+
+			if (last <= 0)
+				break;
+
+			g = gcd(tk, last);
+			if (g > *d) {
+				*n = tn;
+				*k = tk;
+				*d = g;
+			}
+		}
+	}
+}
+
+/* copy one restart interval of a stripe, and step over its marker */
+static int
+splice_interval(shjpeg_context_t * context, membuf_t * out, membuf_t * stripe, size_t * pos, bool last)
+{
+	size_t start = *pos;
+	size_t len;
+	int marker;
+
+	marker = shjpeg_markers_next(stripe->buf, stripe->len, pos);
+	if (marker < 0 || (!SHJPEG_M_IS_RST(marker) &&
+			   !(last && marker == SHJPEG_M_EOI))) {
+		D_ERROR("libshjpeg: unexpected marker 0x%02x in stripe.",
+			marker);
 		return -1;
 	}
 
-	data = (shjpeg_internal_t *) context->internal_data;
+	len = *pos - start;
+	if (membuf_write(out, &len, stripe->buf + start))
+		return -1;
 
-	/* check ref counter */
-	if (!data->ref_count) {
-		D_ERROR("libshjpeg: not initialized yet.");
+	*pos += 2;
+
+	return 0;
+}
+
+/* interleave the stripes into one JPEG */
+static int
+splice_stripes(shjpeg_context_t * context, membuf_t * out, membuf_t * stripes, int n, int k,
+	       int last_mcus, int d, int width, int height)
+{
+	shjpeg_markers_t m;
+	size_t *pos;
+	u8 hdr[6];
+	size_t len;
+	int rows = (height + 7) / 8;	/* 4:2:2, MCU is 16x8 */
+	int rst = 0;
+	int r, s, i;
+	int ret = -1;
+
+	pos = calloc(n, sizeof(size_t));
+	if (!pos)
 		return -1;
+
+	for (s = 0; s < n; s++) {
+		if (shjpeg_markers_parse(stripes[s].buf, stripes[s].len, &m) ||
+		    m.restart_interval != d) {
+			D_ERROR("libshjpeg: can't parse stripe %d.", s);
+			goto out;
+		}
+		pos[s] = m.data;
 	}
 
-	/* error if physical address is not given */
-	if (!virt) {
-		D_ERROR("libshjpeg: buffer address is not given.");
+	/* headers of the first stripe, with the width of the image */
+	shjpeg_markers_parse(stripes[0].buf, stripes[0].len, &m);
+	if (!m.sof) {
+		D_ERROR("libshjpeg: no SOF0 in stripe.");
+		goto out;
+	}
+
+	len = m.sos;
+	if (membuf_write(out, &len, stripes[0].buf))
+		goto out;
+	SHJPEG_PUT16(out->buf + m.sof + 5, height);
+	SHJPEG_PUT16(out->buf + m.sof + 7, width);
+
+	if (!m.dri) {
+		hdr[0] = 0xff;
+		hdr[1] = SHJPEG_M_DRI;
+		SHJPEG_PUT16(hdr + 2, 4);
+		SHJPEG_PUT16(hdr + 4, d);
+		len = 6;
+		if (membuf_write(out, &len, hdr))
+			goto out;
+	}
+
+	len = m.data - m.sos;
+	if (membuf_write(out, &len, stripes[0].buf + m.sos))
+		goto out;
+
+	/* entropy coded data, row by row */
+	for (r = 0; r < rows; r++) {
+		for (s = 0; s < n; s++) {
+			int intervals = ((s == n - 1) ? last_mcus : k) / d;
+
+			for (i = 0; i < intervals; i++) {
+				bool last = (r == rows - 1) &&
+				    (i == intervals - 1);
+
+				if (splice_interval(context, out, &stripes[s],
+						    &pos[s], last))
+					goto out;
+
+				if (last && s == n - 1)
+					continue;
+
+				hdr[0] = 0xff;
+				hdr[1] = SHJPEG_M_RST0 + rst;
+				rst = (rst + 1) & 7;
+				len = 2;
+				if (membuf_write(out, &len, hdr))
+					goto out;
+			}
+		}
+	}
+
+	hdr[0] = 0xff;
+	hdr[1] = SHJPEG_M_EOI;
+	len = 2;
+	ret = membuf_write(out, &len, hdr);
+
+      out:
+	free(pos);
+	return ret;
+}
+
+static int
+encode_tiled(shjpeg_internal_t * data,
+	     shjpeg_context_t * context,
+	     const encode_src_t * src, size_t max_size)
+{
+	shjpeg_context_data_t *cdata = context->context_data;
+	shjpeg_sops *sops = context->sops;
+	void *priv_data = context->priv_data;
+	int mcus = (src->width + 15) / 16;
+	int n, k, d, s;
+	size_t written = 0;
+	membuf_t *stripes;
+	membuf_t out;
+	int ret = 0;
+
+	if (src->format != SHJPEG_PF_NV12 &&
+	    src->format != SHJPEG_PF_NV16 &&
+	    src->format != SHJPEG_PF_YCbCr &&
+	    src->format != SHJPEG_PF_GRAYSCALE) {
+		D_ERROR("libshjpeg: can't encode %d pixels wide RGB.",
+			src->width);
 		return -1;
 	}
 
-	phys = uiomux_virt_to_phys(data->uiomux, UIOMUX_JPU, virt);
+	tile_layout(mcus, SHJPEG_JPU_MAX_WIDTH / 16, &n, &k, &d);
 
-	switch (format) {
-	case SHJPEG_PF_NV12:
-	case SHJPEG_PF_NV16:
-	case SHJPEG_PF_RGB16:
-	case SHJPEG_PF_RGB32:
-	case SHJPEG_PF_RGB24:
-	case SHJPEG_PF_YCbCr:
-		break;
+	D_INFO("libshjpeg: tiled: %d stripes of %d MCUs, restart %d",
+	       n, k, d);
 
-	default:
+	stripes = calloc(n, sizeof(membuf_t));
+	if (!stripes)
 		return -1;
+
+	context->sops = &membuf_sops;
+
+	for (s = 0; s < n; s++) {
+		encode_src_t stripe = *src;
+		int x = s * k * 16;
+		int offset = x * SHJPEG_PF_PITCH_MULTIPLY(src->format);
+
+		stripe.width = (s == n - 1) ? src->width - x : k * 16;
+		stripe.virt.py += offset;
+		if (stripe.virt.pc)
+			stripe.virt.pc += x;
+		stripe.virt.w = stripe.width;
+		stripe.phys_y = stripe.phys_c = 0;
+		stripe.cpu = true;
+		stripe.dri = d;
+
+		context->priv_data = &stripes[s];
+		ret = encode_hw(data, context, &stripe,
+				max_size ? max_size - MIN(written,
+							  max_size - 1) : 0);
+		written += stripes[s].len;
+		if (ret)
+			break;
 	}
 
-	/* TODO: Support for clipping and resize */
+	context->sops = sops;
+	context->priv_data = priv_data;
+	context->width = src->width;
+	context->height = src->height;
 
-	/* start hardware encoding */
-	return encode_hw(data, context, format, phys, width, height,
-			 pitch);
+	memset(&out, 0, sizeof(out));
+
+	if (!ret) {
+		ret = splice_stripes(context, &out, stripes, n, k,
+				     mcus - (n - 1) * k, d,
+				     src->width, src->height);
+		if (ret)
+			D_ERROR("libshjpeg: splicing stripes failed.");
+	}
+
+	if (!ret && max_size && out.len > max_size) {
+		errno = EFBIG;
+		ret = SHJPEG_ERR_OVERSIZE;
+	}
+
+	if (!ret) {
+		size_t len = out.len;
+
+		if (sops->init)
+			sops->init(priv_data);
+		sops->write(priv_data, &len, out.buf);
+		written = len;
+	}
+
+	cdata->coded_size = written;
+
+	for (s = 0; s < n; s++)
+		free(stripes[s].buf);
+	free(stripes);
+	free(out.buf);
+
+	return ret;
+}
+
+/* encode in one go, or in stripes if too wide for the JPU */
+static int
+encode_image(shjpeg_internal_t * data,
+	     shjpeg_context_t * context,
+	     const encode_src_t * src, size_t max_size)
+{
+	if (src->width > SHJPEG_JPU_MAX_WIDTH)
+		return encode_tiled(data, context, src, max_size);
+
+	return encode_hw(data, context, src, max_size);
+}
+
+/*
+ * set encode quality
+ */
+
+int shjpeg_encode_set_quality(shjpeg_context_t * context, int quality)
+{
+	shjpeg_context_data_t *cdata;
+
+	if (!context) {
+		D_ERROR("libjpeg: invalid context passed.");
+		return -1;
+	}
+
+	if (quality < 1 || quality > 100) {
+		D_ERROR("libshjpeg: quality %d is out of range.", quality);
+		return -1;
+	}
+
+	cdata = context->context_data;
+
+	/* register image is rebuilt only when the quality changes */
+	if (cdata->qtbl_valid && cdata->quality == quality)
+		return 0;
+
+	shjpeg_jpu_build_quantization_table(cdata->qtbl, NULL, NULL,
+				shjpeg_jpu_quality_scaling(quality));
+	cdata->quality = quality;
+	cdata->qtbl_valid = true;
+
+	/* rate control restarts from this quality */
+	cdata->rc_scale = shjpeg_jpu_quality_scaling(quality);
+	cdata->rc_complexity = 0;
+
+	return 0;
+}
+
+/*
+ * set custom quantization tables
+ */
+
+int
+shjpeg_encode_set_qtables(shjpeg_context_t * context,
+			  const uint16_t * luma, const uint16_t * chroma)
+{
+	shjpeg_context_data_t *cdata;
+
+	if (!context) {
+		D_ERROR("libjpeg: invalid context passed.");
+		return -1;
+	}
+
+	cdata = context->context_data;
+
+	if (!luma && !chroma) {
+		/* back to the default tables */
+		cdata->quality = 0;
+		cdata->qtbl_valid = false;
+		return 0;
+	}
+
+	shjpeg_jpu_build_quantization_table(cdata->qtbl, luma, chroma, 100);
+	cdata->quality = 0;
+	cdata->qtbl_valid = true;
+
+	return 0;
+}
+
+/*
+ * Rate control
+ *
+ * The coded size is modelled as inversely proportional to the
+ * quantization scale, i.e. size x scale = complexity. The complexity
+ * is tracked over frames with a moving average, and the scale for
+ * the next frame is chosen to hit the target size.
+ */
+
+#define RC_SCALE_MIN		1
+#define RC_SCALE_MAX		5000
+#define RC_MAX_RETRY		2
+
+static int rc_clamp_scale(u64 scale)
+{
+	if (scale < RC_SCALE_MIN)
+		return RC_SCALE_MIN;
+	if (scale > RC_SCALE_MAX)
+		return RC_SCALE_MAX;
+	return (int) scale;
+}
+
+static void rc_set_scale(shjpeg_context_data_t * cdata, int scale)
+{
+	cdata->rc_scale = scale;
+	shjpeg_jpu_build_quantization_table(cdata->qtbl, NULL, NULL, scale);
+	cdata->qtbl_valid = true;
+
+	/* tables no longer correspond to a quality setting */
+	cdata->quality = 0;
+}
+
+static void rc_update(shjpeg_context_data_t * cdata, size_t coded)
+{
+	u64 complexity = (u64) coded * cdata->rc_scale;
+
+	if (!cdata->rc_complexity)
+		cdata->rc_complexity = complexity;
+	else
+		cdata->rc_complexity =
+		    (cdata->rc_complexity * 3 + complexity) / 4;
+}
+
+/* pick the scale of the next frame, and return its size limit */
+static size_t rc_prepare(shjpeg_context_data_t * cdata)
+{
+	size_t limit = cdata->max_size;
+
+	/* abort encodes that can't meet the cap as early as possible */
+	if (cdata->rc_cap && (!limit || cdata->rc_cap < limit))
+		limit = cdata->rc_cap;
+
+	/* pick the scale for this frame from the model */
+	if (cdata->rc_complexity)
+		rc_set_scale(cdata, rc_clamp_scale(cdata->rc_complexity /
+						   cdata->rc_target));
+	else if (!cdata->qtbl_valid)
+		rc_set_scale(cdata, cdata->rc_scale);
+
+	return limit;
+}
+
+static int
+encode_rate_controlled(shjpeg_internal_t * data,
+		       shjpeg_context_t * context, const encode_src_t * src)
+{
+	shjpeg_context_data_t *cdata = context->context_data;
+	size_t limit = rc_prepare(cdata);
+	int retry;
+	int ret;
+
+	for (retry = 0; ; retry++) {
+		ret = encode_image(data, context, src, limit);
+		if (ret == SHJPEG_ERR_OVERSIZE) {
+			/* only a lower bound is known, so back off hard */
+			D_INFO("libshjpeg: rc: scale=%d aborted at %d bytes",
+			       cdata->rc_scale, (int) cdata->coded_size);
+			if (retry == RC_MAX_RETRY ||
+			    cdata->rc_scale == RC_SCALE_MAX)
+				return ret;
+			rc_set_scale(cdata,
+				     rc_clamp_scale(cdata->rc_scale * 2));
+			continue;
+		}
+		if (ret)
+			return ret;
+
+		D_INFO("libshjpeg: rc: scale=%d coded=%d target=%d",
+		       cdata->rc_scale, (int) cdata->coded_size,
+		       (int) cdata->rc_target);
+
+		rc_update(cdata, cdata->coded_size);
+
+		if (!cdata->rc_cap || cdata->coded_size <= cdata->rc_cap)
+			break;
+
+		if (retry == RC_MAX_RETRY ||
+		    cdata->rc_scale == RC_SCALE_MAX) {
+			D_ERROR("libshjpeg: coded size %d exceeds the limit "
+				"of %d bytes.", (int) cdata->coded_size,
+				(int) cdata->rc_cap);
+			errno = EFBIG;
+			return SHJPEG_ERR_OVERSIZE;
+		}
+
+		/* re-encode coarser, aiming a bit below the cap */
+		rc_set_scale(cdata, rc_clamp_scale((u64) cdata->rc_scale *
+						   cdata->coded_size * 9 /
+						   (cdata->rc_cap * 8)));
+	}
+
+	return 0;
+}
+
+/*
+ * set target size of encoded image
+ */
+
+int
+shjpeg_encode_set_target_size(shjpeg_context_t * context,
+			      size_t target, size_t cap)
+{
+	shjpeg_context_data_t *cdata;
+
+	if (!context) {
+		D_ERROR("libjpeg: invalid context passed.");
+		return -1;
+	}
+
+	if (cap && target > cap) {
+		D_ERROR("libshjpeg: target size is larger than the limit.");
+		return -1;
+	}
+
+	cdata = context->context_data;
+
+	if (!target) {
+		/* rate control disabled - back to the fixed tables */
+		if (cdata->rc_target && !cdata->quality)
+			cdata->qtbl_valid = false;
+		cdata->rc_target = cdata->rc_cap = 0;
+		return 0;
+	}
+
+	if (!cdata->rc_target) {
+		/* start from the current quality */
+		cdata->rc_scale = cdata->quality ?
+		    shjpeg_jpu_quality_scaling(cdata->quality) : 100;
+		cdata->rc_complexity = 0;
+	}
+
+	cdata->rc_target = target;
+	cdata->rc_cap = cap;
+
+	return 0;
+}
+
+/*
+ * set target bitrate of encoded stream
+ */
+
+int
+shjpeg_encode_set_bitrate(shjpeg_context_t * context,
+			  unsigned long bitrate, int fps, size_t cap)
+{
+	if (!context) {
+		D_ERROR("libjpeg: invalid context passed.");
+		return -1;
+	}
+
+	if (fps <= 0) {
+		D_ERROR("libshjpeg: invalid frame rate %d.", fps);
+		return -1;
+	}
+
+	return shjpeg_encode_set_target_size(context, bitrate / 8 / fps, cap);
+}
+
+/*
+ * Restart interval
+ */
+
+int
+shjpeg_encode_set_restart_interval(shjpeg_context_t * context, int mcus)
+{
+	shjpeg_context_data_t *cdata;
+
+	if (!context) {
+		D_ERROR("libjpeg: invalid context passed.");
+		return -1;
+	}
+
+	if (mcus < 0 || mcus > SHJPEG_JPU_MAX_DRI) {
+		D_ERROR("libshjpeg: invalid restart interval %d.", mcus);
+		return -1;
+	}
+
+	cdata = context->context_data;
+	cdata->dri_valid = true;
+	cdata->dri = mcus;
+	cdata->dri_rows = 0;
+
+	return 0;
+}
+
+int
+shjpeg_encode_set_restart_rows(shjpeg_context_t * context, int rows)
+{
+	shjpeg_context_data_t *cdata;
+
+	if (!context) {
+		D_ERROR("libjpeg: invalid context passed.");
+		return -1;
+	}
+
+	if (rows < 0 || rows > SHJPEG_JPU_MAX_DRI) {
+		D_ERROR("libshjpeg: invalid restart interval %d rows.",
+			rows);
+		return -1;
+	}
+
+	cdata = context->context_data;
+	cdata->dri_valid = true;
+	cdata->dri = 0;
+	cdata->dri_rows = rows;
+
+	return 0;
+}
+
+/*
+ * Encode size limit
+ */
+
+int
+shjpeg_encode_set_max_size(shjpeg_context_t * context, size_t max_size)
+{
+	if (!context) {
+		D_ERROR("libjpeg: invalid context passed.");
+		return -1;
+	}
+
+	((shjpeg_context_data_t *) context->context_data)->max_size =
+	    max_size;
+
+	return 0;
+}
+
+/* encode with or without rate control */
+static int
+encode_start(shjpeg_internal_t * data,
+	     shjpeg_context_t * context, const encode_src_t * src)
+{
+	shjpeg_context_data_t *cdata = context->context_data;
+
+	/* the JPU is leased to the stream session */
+	if (cdata->stream_locked) {
+		D_ERROR("libshjpeg: the JPU is held by the encode stream.");
+		return -1;
+	}
+
+	if (cdata->push) {
+		D_ERROR("libshjpeg: the JPU is held by a pushed encode.");
+		return -1;
+	}
+
+	if (cdata->rc_target)
+		return encode_rate_controlled(data, context, src);
+
+	return encode_image(data, context, src, cdata->max_size);
+}
+
+/* formats accepted by shjpeg_encode() */
+static bool encode_format_supported(shjpeg_pixelformat format)
+{
+	switch (format) {
+	case SHJPEG_PF_NV12:
+	case SHJPEG_PF_NV16:
+	case SHJPEG_PF_RGB16:
+	case SHJPEG_PF_RGB32:
+	case SHJPEG_PF_RGB24:
+	case SHJPEG_PF_YCbCr:
+	case SHJPEG_PF_GRAYSCALE:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/* image in a buffer of the frame buffer memory, see shjpeg_encode() */
+static void
+encode_buffer_source(shjpeg_internal_t * data, shjpeg_pixelformat format,
+		     void *virt, int width, int height, int pitch,
+		     encode_src_t * src)
+{
+	unsigned long phys;
+
+	phys = uiomux_virt_to_phys(data->uiomux, UIOMUX_JPU, virt);
+
+	/* use shjpeg_encode_surface() for clipping */
+	src->format = format;
+	src->phys_y = phys;
+	src->phys_c = phys + pitch * height;
+	src->width = width;
+	src->height = height;
+	src->pitch = pitch;
+	src->virt.format = format;
+	src->virt.py = virt;
+	src->virt.pc = virt + pitch * height;
+	src->virt.pitch = pitch;
+	src->virt.x = src->virt.y = 0;
+	src->virt.w = width;
+	src->virt.h = height;
+	src->cpu = false;
+	src->dri = 0;
+}
+
+/*
+ * shpjpeg_encode()
+ */
+
+int
+shjpeg_encode(shjpeg_context_t * context,
+	      shjpeg_pixelformat format,
+	      void *virt, int width, int height, int pitch)
+{
+	shjpeg_internal_t *data;
+	encode_src_t src;
+
+	if (!context) {
+		D_ERROR("libjpeg: invalid context passed.");
+		return -1;
+	}
+
+	data = (shjpeg_internal_t *) context->internal_data;
+
+	/* check ref counter */
+	if (!data->ref_count) {
+		D_ERROR("libshjpeg: not initialized yet.");
+		return -1;
+	}
+
+	/* error if physical address is not given */
+	if (!virt) {
+		D_ERROR("libshjpeg: buffer address is not given.");
+		return -1;
+	}
+
+	if (!encode_format_supported(format))
+		return -1;
+
+	encode_buffer_source(data, format, virt, width, height, pitch, &src);
+
+	/* start hardware encoding */
+	return encode_start(data, context, &src);
+}
+
+/* region of a surface, see shjpeg_encode_surface() */
+static int
+encode_surface_source(shjpeg_context_t * context,
+		      const shjpeg_surface_t * surface,
+		      const shjpeg_rect_t * rect, encode_src_t * src)
+{
+	shjpeg_pixelformat format = surface->format;
+	shjpeg_rect_t whole;
+	bool nv = (format == SHJPEG_PF_NV12 || format == SHJPEG_PF_NV16);
+
+	if (!rect) {
+		whole.x = whole.y = 0;
+		whole.w = surface->width;
+		whole.h = surface->height;
+		rect = &whole;
+	}
+
+	/* check if the region is within the surface */
+	if ((rect->x < 0) || (rect->y < 0) ||
+	    (rect->w <= 0) || (rect->h <= 0) ||
+	    (rect->x + rect->w > surface->width) ||
+	    (rect->y + rect->h > surface->height) ||
+	    (surface->width * SHJPEG_PF_PITCH_MULTIPLY(format) >
+	     surface->pitch)) {
+		D_ERROR("libshjpeg: region %d,%d %dx%d is out of the surface.",
+			rect->x, rect->y, rect->w, rect->h);
+		return -1;
+	}
+
+	/* error if virtual address is not given */
+	if (!surface->py || (nv && !surface->pc)) {
+		D_ERROR("libshjpeg: buffer address is not given.");
+		return -1;
+	}
+
+	/* chroma samples can't be split */
+	if ((nv && (rect->x & 1)) ||
+	    ((format == SHJPEG_PF_NV12) && (rect->y & 1))) {
+		D_ERROR("libshjpeg: %d,%d is not aligned to chroma.",
+			rect->x, rect->y);
+		return -1;
+	}
+
+	src->virt.format = format;
+	src->virt.pitch = surface->pitch;
+	src->virt.py = surface->py + rect->y * surface->pitch +
+	    rect->x * SHJPEG_PF_PITCH_MULTIPLY(format);
+	src->virt.pc = nv ? surface->pc + ((format == SHJPEG_PF_NV12) ?
+					  rect->y / 2 : rect->y) *
+	    surface->pitch + rect->x : NULL;
+	src->virt.x = src->virt.y = 0;
+	src->virt.w = rect->w;
+	src->virt.h = rect->h;
+
+	src->format = format;
+	src->phys_y = uiomux_all_virt_to_phys(src->virt.py);
+	src->phys_c = nv ? uiomux_all_virt_to_phys(src->virt.pc) : 0;
+	src->width = rect->w;
+	src->height = rect->h;
+	src->pitch = surface->pitch;
+	src->cpu = false;
+	src->dri = 0;
+
+	switch (format) {
+	case SHJPEG_PF_NV12:
+	case SHJPEG_PF_NV16:
+		/* let the JPU read the region if it can; JIFESMW holds
+		   pitches up to 0xff8 only */
+		if (!src->phys_y || !src->phys_c || (src->phys_y & 7) ||
+		    (src->phys_c & 7) || (src->pitch & 7) ||
+		    (src->pitch > 0xff8))
+			src->cpu = true;
+		break;
+
+	case SHJPEG_PF_YCbCr:
+	case SHJPEG_PF_GRAYSCALE:
+		src->cpu = true;
+		break;
+
+	case SHJPEG_PF_RGB16:
+	case SHJPEG_PF_RGB32:
+	case SHJPEG_PF_RGB24:
+#if defined(HAVE_SHVIO)
+		/* VIO reads the region */
+		if (src->phys_y)
+			break;
+#endif /* defined(HAVE_SHVIO) */
+		D_ERROR("libshjpeg: RGB needs VIO and a physically "
+			"contiguous surface.");
+		return -1;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * encode a region of a surface
+ */
+
+int
+shjpeg_encode_surface(shjpeg_context_t * context,
+		      const shjpeg_surface_t * surface,
+		      const shjpeg_rect_t * rect)
+{
+	shjpeg_internal_t *data;
+	encode_src_t src;
+
+	if (!context || !surface) {
+		D_ERROR("libshjpeg: invalid context or surface passed.");
+		return -1;
+	}
+
+	data = (shjpeg_internal_t *) context->internal_data;
+
+	/* check ref counter */
+	if (!data->ref_count) {
+		D_ERROR("libshjpeg: not initialized yet.");
+		return -1;
+	}
+
+	if (encode_surface_source(context, surface, rect, &src) < 0)
+		return -1;
+
+	return encode_start(data, context, &src);
+}
+
+/*
+ * Simulcast encode
+ *
+ * Several images are encoded from one source frame, and the JPU runs
+ * the jobs back to back under one lock. Full scale images are read
+ * by the JPU as in shjpeg_encode_surface(). Downscaled images are box
+ * filtered by the CPU beforehand in a single pass over the source:
+ * the source is walked in bands of rows, and every downscaled image
+ * takes the rows it needs from a band while the band is in the cache.
+ */
+
+#define SIMULCAST_BAND		16	/* source rows per band */
+
+typedef struct {
+	shjpeg_encode_output_t *out;
+	shjpeg_rect_t crop;		/* region of the source */
+	shjpeg_surface_t scaled;	/* downscaled region, if scale > 1 */
+	int row;			/* next row of scaled to fill */
+} simulcast_t;
+
+/* average blocks of rows x s samples of comps interleaved components */
+static void
+box_filter(const u8 * src, int pitch, int rows, int s, int comps,
+	   u8 * dst, int n)
+{
+	int area = rows * s;
+	int j, k, r, i;
+
+	for (j = 0; j < n; j++) {
+		for (k = 0; k < comps; k++) {
+			const u8 *p = src + j * s * comps + k;
+			u32 sum = area / 2;
+
+			for (r = 0; r < rows; r++, p += pitch)
+				for (i = 0; i < s; i++)
+					sum += p[i * comps];
+
+			*(dst++) = sum / area;
+		}
+	}
+}
+
+/* fill a row of the downscaled image of sc */
+static void
+simulcast_scale_row(const shjpeg_surface_t * surface, simulcast_t * sc)
+{
+	shjpeg_surface_t *scaled = &sc->scaled;
+	int s = sc->out->scale;
+	int row = sc->row;
+	int y = sc->crop.y + row * s;
+	int pitch = surface->pitch;
+	const u8 *src_c;
+
+	box_filter((const u8 *) surface->py + y * pitch + sc->crop.x,
+		   pitch, s, s, 1,
+		   (u8 *) scaled->py + row * scaled->pitch, scaled->width);
+
+	switch (surface->format) {
+	case SHJPEG_PF_NV16:
+		src_c = (const u8 *) surface->pc + y * pitch + sc->crop.x;
+		box_filter(src_c, pitch, s, s, 2,
+			   (u8 *) scaled->pc + row * scaled->pitch,
+			   scaled->width / 2);
+		break;
+
+	case SHJPEG_PF_NV12:
+		/* a chroma row for every two rows, once both are in */
+		if (!(row & 1))
+			break;
+		src_c = (const u8 *) surface->pc +
+		    (sc->crop.y / 2 + row / 2 * s) * pitch + sc->crop.x;
+		box_filter(src_c, pitch, s, s, 2,
+			   (u8 *) scaled->pc + row / 2 * scaled->pitch,
+			   scaled->width / 2);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* check out and size its downscaled image, if any */
+static int
+simulcast_prepare(shjpeg_context_t * context,
+		  const shjpeg_surface_t * surface,
+		  shjpeg_encode_output_t * out, simulcast_t * sc)
+{
+	shjpeg_pixelformat format = surface->format;
+	shjpeg_surface_t *scaled = &sc->scaled;
+	int s = out->scale;
+
+	memset(sc, 0, sizeof(*sc));
+	sc->out = out;
+
+	if (out->crop.w) {
+		sc->crop = out->crop;
+	} else {
+		sc->crop.w = surface->width;
+		sc->crop.h = surface->height;
+	}
+
+	if (out->quality < 0 || out->quality > 100 || !out->sops) {
+		D_ERROR("libshjpeg: invalid simulcast output.");
+		return -1;
+	}
+
+	if (s == 1) {
+		/* encoded in one go under the lock, not in stripes */
+		if (sc->crop.w > SHJPEG_JPU_MAX_WIDTH) {
+			D_ERROR("libshjpeg: simulcast output %d pixels wide "
+				"is too wide.", sc->crop.w);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (s != 2 && s != 4 && s != 8) {
+		D_ERROR("libshjpeg: scale 1/%d is not supported.", s);
+		return -1;
+	}
+
+	if (format != SHJPEG_PF_NV12 && format != SHJPEG_PF_NV16 &&
+	    format != SHJPEG_PF_GRAYSCALE) {
+		D_ERROR("libshjpeg: can't downscale pixel format %d.",
+			format);
+		return -1;
+	}
+
+	/* same checks as for the full scale region */
+	if ((sc->crop.x < 0) || (sc->crop.y < 0) ||
+	    (sc->crop.w <= 0) || (sc->crop.h <= 0) ||
+	    (sc->crop.x + sc->crop.w > surface->width) ||
+	    (sc->crop.y + sc->crop.h > surface->height) ||
+	    ((format != SHJPEG_PF_GRAYSCALE) && (sc->crop.x & 1)) ||
+	    ((format == SHJPEG_PF_NV12) && (sc->crop.y & 1))) {
+		D_ERROR("libshjpeg: region %d,%d %dx%d is out of the surface "
+			"or not aligned to chroma.", sc->crop.x, sc->crop.y,
+			sc->crop.w, sc->crop.h);
+		return -1;
+	}
+
+	/* whole chroma samples */
+	scaled->format = format;
+	scaled->width = (sc->crop.w / s) & ~1;
+	scaled->height = (sc->crop.h / s) & ~1;
+	scaled->pitch = (scaled->width + 7) & ~7;
+
+	if (!scaled->width || !scaled->height) {
+		D_ERROR("libshjpeg: region %dx%d is too small for 1/%d.",
+			sc->crop.w, sc->crop.h, s);
+		return -1;
+	}
+
+	scaled->py = malloc(scaled->pitch * scaled->height * 2);
+	if (!scaled->py)
+		return -1;
+	scaled->pc = (u8 *) scaled->py + scaled->pitch * scaled->height;
+
+	return 0;
+}
+
+/* downscale for all outputs in one pass over the source */
+static void
+simulcast_scale(const shjpeg_surface_t * surface, simulcast_t * scs, int n)
+{
+	int band, i;
+
+	for (band = SIMULCAST_BAND;
+	     band < surface->height + SIMULCAST_BAND;
+	     band += SIMULCAST_BAND) {
+		for (i = 0; i < n; i++) {
+			simulcast_t *sc = &scs[i];
+			int s = sc->out->scale;
+
+			if (s == 1)
+				continue;
+
+			/* rows whose source rows are all read */
+			while ((sc->row < sc->scaled.height) &&
+			       (sc->crop.y + (sc->row + 1) * s <= band)) {
+				simulcast_scale_row(surface, sc);
+				sc->row++;
+			}
+		}
+	}
+}
+
+int
+shjpeg_encode_simulcast(shjpeg_context_t * context,
+			const shjpeg_surface_t * surface,
+			shjpeg_encode_output_t * outputs, int num_outputs)
+{
+	shjpeg_internal_t *data;
+	shjpeg_context_data_t *cdata;
+	shjpeg_sops *sops;
+	void *priv_data;
+	simulcast_t *scs;
+	encode_src_t src;
+	u32 qtbl[32];
+	bool qtbl_valid;
+	int i, ret = 0;
+
+	if (!context || !surface || !outputs || num_outputs < 1) {
+		D_ERROR("libshjpeg: invalid context, surface or outputs "
+			"passed.");
+		return -1;
+	}
+
+	data = (shjpeg_internal_t *) context->internal_data;
+	cdata = context->context_data;
+
+	/* check ref counter */
+	if (!data->ref_count) {
+		D_ERROR("libshjpeg: not initialized yet.");
+		return -1;
+	}
+
+	if (cdata->stream_locked) {
+		D_ERROR("libshjpeg: the JPU is held by the encode stream.");
+		return -1;
+	}
+
+	if (cdata->push) {
+		D_ERROR("libshjpeg: the JPU is held by a pushed encode.");
+		return -1;
+	}
+
+	if (!surface->py) {
+		D_ERROR("libshjpeg: buffer address is not given.");
+		return -1;
+	}
+
+	scs = calloc(num_outputs, sizeof(*scs));
+	if (!scs)
+		return -1;
+
+	for (i = 0; i < num_outputs; i++) {
+		outputs[i].result = -1;
+		outputs[i].coded_size = 0;
+		if (simulcast_prepare(context, surface, &outputs[i],
+				      &scs[i]) < 0) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	simulcast_scale(surface, scs, num_outputs);
+
+	if (encode_lock(data, context) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	/* the outputs have their own tables and stream ops */
+	sops = context->sops;
+	priv_data = context->priv_data;
+	memcpy(qtbl, cdata->qtbl, sizeof(qtbl));
+	qtbl_valid = cdata->qtbl_valid;
+
+	for (i = 0; i < num_outputs; i++) {
+		shjpeg_encode_output_t *out = &outputs[i];
+		simulcast_t *sc = &scs[i];
+
+		if (out->scale == 1) {
+			if (encode_surface_source(context, surface,
+						  &sc->crop, &src) < 0) {
+				ret = -1;
+				continue;
+			}
+		} else {
+			encode_surface_source(context, &sc->scaled, NULL,
+					      &src);
+			/* not in the frame buffer memory */
+			src.phys_y = src.phys_c = 0;
+			src.cpu = true;
+		}
+
+		if (out->quality) {
+			shjpeg_jpu_build_quantization_table(cdata->qtbl,
+				NULL, NULL,
+				shjpeg_jpu_quality_scaling(out->quality));
+			cdata->qtbl_valid = true;
+		} else {
+			memcpy(cdata->qtbl, qtbl, sizeof(qtbl));
+			cdata->qtbl_valid = qtbl_valid;
+		}
+
+		context->sops = out->sops;
+		context->priv_data = out->priv_data;
+
+		encode_setup(data, context, &src);
+		out->result = encode_run(data, context, &src,
+					 cdata->max_size);
+		out->coded_size = cdata->coded_size;
+		if (out->result)
+			ret = -1;
+	}
+
+	context->sops = sops;
+	context->priv_data = priv_data;
+	memcpy(cdata->qtbl, qtbl, sizeof(qtbl));
+	cdata->qtbl_valid = qtbl_valid;
+
+	if (encode_unlock(data, context) < 0)
+		ret = -1;
+
+      out:
+	for (i = 0; i < num_outputs; i++)
+		free(scs[i].scaled.py);
+	free(scs);
+
+	return ret;
+}
+
+/*
+ * encode stream session
+ *
+ * The JPU is programmed once for the layout of the frames, and for
+ * each frame only the source addresses are set before the engine is
+ * started again. The registers can only be trusted while the JPU
+ * stays locked, so without a lease the JPU is programmed per frame.
+ *
+ * Unchanged frames can reuse the image encoded last. The Y plane is
+ * summed over 16x16 blocks on every fourth row, and the frame is
+ * compared with the one encoded last, so that slow drift adds up to
+ * a change. The image is kept by stream ops in front of the user's.
+ */
+
+#define SKIP_BLOCK		16	/* block size in pixels */
+#define SKIP_ROW_STEP		4	/* rows summed: 0, 4, 8, 12 */
+#define SKIP_LOST		((size_t) -1)	/* image could not be kept */
+
+/* sum of 16 bytes, two at a time in each word if aligned */
+static u32 skip_sum16(const u8 * p)
+{
+	const u32 *w = (const u32 *) p;
+	u32 acc = 0;
+	int i;
+
+	if ((unsigned long) p & 3) {
+		for (i = 0; i < 16; i++)
+			acc += p[i];
+		return acc;
+	}
+
+	/* at most 8 bytes add up in each half word */
+	for (i = 0; i < 4; i++)
+		acc += (w[i] & 0x00ff00ff) + ((w[i] >> 8) & 0x00ff00ff);
+
+	return (acc & 0xffff) + (acc >> 16);
+}
+
+/* block sums of the Y plane at y */
+static void
+skip_signature(shjpeg_context_data_t * cdata, const u8 * y, u16 * sig)
+{
+	int width = cdata->stream_width;
+	int height = cdata->stream_height;
+	int pitch = cdata->stream_pitch;
+	int bx, by, r, i;
+
+	for (by = 0; by < height; by += SKIP_BLOCK) {
+		int bottom = MIN(by + SKIP_BLOCK, height);
+
+		for (bx = 0; bx < width; bx += SKIP_BLOCK) {
+			int w = MIN(SKIP_BLOCK, width - bx);
+			u32 sum = 0;
+
+			for (r = by; r < bottom; r += SKIP_ROW_STEP) {
+				const u8 *p = y + r * pitch + bx;
+
+				if (w == SKIP_BLOCK)
+					sum += skip_sum16(p);
+				else
+					for (i = 0; i < w; i++)
+						sum += p[i];
+			}
+
+			*(sig++) = sum;
+		}
+	}
+}
+
+/* true if the frame at virt can reuse the image written last */
+static bool skip_unchanged(shjpeg_context_data_t * cdata, const u8 * virt)
+{
+	int width = cdata->stream_width;
+	int height = cdata->stream_height;
+	int bx, by, rows, limit, i = 0;
+
+	switch (cdata->stream_format) {
+	case SHJPEG_PF_NV12:
+	case SHJPEG_PF_NV16:
+	case SHJPEG_PF_GRAYSCALE:
+		break;
+
+	default:
+		return false;
+	}
+
+	if (!cdata->skip_cur) {
+		cdata->skip_blocks =
+		    ((cdata->stream_width + SKIP_BLOCK - 1) / SKIP_BLOCK) *
+		    ((cdata->stream_height + SKIP_BLOCK - 1) / SKIP_BLOCK);
+		cdata->skip_ref = calloc(cdata->skip_blocks, sizeof(u16));
+		cdata->skip_cur = calloc(cdata->skip_blocks, sizeof(u16));
+		if (!cdata->skip_ref || !cdata->skip_cur) {
+			free(cdata->skip_ref);
+			free(cdata->skip_cur);
+			cdata->skip_ref = cdata->skip_cur = NULL;
+			return false;
+		}
+	}
+
+	skip_signature(cdata, virt, cdata->skip_cur);
+
+	if (!cdata->skip_valid || cdata->skip_reused >= cdata->skip_max)
+		return false;
+
+	/* the limit of the sums scales with the samples of each block,
+	   which are fewer at the right and bottom edges */
+	for (by = 0; by < height; by += SKIP_BLOCK) {
+		rows = (MIN(SKIP_BLOCK, height - by) + SKIP_ROW_STEP - 1) /
+		    SKIP_ROW_STEP;
+
+		for (bx = 0; bx < width; bx += SKIP_BLOCK, i++) {
+			limit = cdata->skip_threshold *
+			    MIN(SKIP_BLOCK, width - bx) * rows;
+			if (abs((int) cdata->skip_cur[i] -
+				(int) cdata->skip_ref[i]) > limit)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* write the image written last again */
+static int skip_reuse(shjpeg_context_t * context)
+{
+	shjpeg_context_data_t *cdata = context->context_data;
+	size_t len = cdata->skip_len;
+
+	if (context->sops->init && context->sops->init(context->priv_data))
+		return -1;
+
+	if (context->sops->write(context->priv_data, &len, cdata->skip_buf))
+		return -1;
+
+	cdata->coded_size = len;
+	cdata->skip_reused++;
+
+	return SHJPEG_FRAME_REUSED;
+}
+
+static int skip_init(void *priv)
+{
+	shjpeg_context_t *context = priv;
+	shjpeg_context_data_t *cdata = context->context_data;
+
+	cdata->skip_len = 0;
+
+	return cdata->skip_dst->init ?
+	    cdata->skip_dst->init(cdata->skip_dst_priv) : 0;
+}
+
+static int skip_write(void *priv, size_t * nbytes, void *dataptr)
+{
+	shjpeg_context_t *context = priv;
+	shjpeg_context_data_t *cdata = context->context_data;
+	size_t len;
+	int ret;
+
+	ret = cdata->skip_dst->write(cdata->skip_dst_priv, nbytes, dataptr);
+	len = *nbytes;
+
+	if (cdata->skip_len == SKIP_LOST)
+		return ret;
+
+	if (cdata->skip_len + len > cdata->skip_size) {
+		size_t size = MAX(cdata->skip_size * 2,
+				  cdata->skip_len + len);
+		u8 *p = realloc(cdata->skip_buf, size);
+
+		if (!p) {
+			/* not reused then */
+			cdata->skip_len = SKIP_LOST;
+			return ret;
+		}
+		cdata->skip_buf = p;
+		cdata->skip_size = size;
+	}
+
+	memcpy(cdata->skip_buf + cdata->skip_len, dataptr, len);
+	cdata->skip_len += len;
+
+	return ret;
+}
+
+static void skip_free(shjpeg_context_data_t * cdata)
+{
+	free(cdata->skip_ref);
+	free(cdata->skip_cur);
+	free(cdata->skip_buf);
+	cdata->skip_ref = cdata->skip_cur = NULL;
+	cdata->skip_buf = NULL;
+	cdata->skip_size = cdata->skip_len = 0;
+	cdata->skip_valid = false;
+}
+
+int
+shjpeg_encode_stream_begin(shjpeg_context_t * context,
+			   shjpeg_pixelformat format,
+			   int width, int height, int pitch, int quality)
+{
+	shjpeg_internal_t *data;
+	shjpeg_context_data_t *cdata;
+
+	if (!context) {
+		D_ERROR("libshjpeg: invalid context passed.");
+		return -1;
+	}
+
+	data = (shjpeg_internal_t *) context->internal_data;
+	cdata = context->context_data;
+
+	/* check ref counter */
+	if (!data->ref_count) {
+		D_ERROR("libshjpeg: not initialized yet.");
+		return -1;
+	}
+
+	if (cdata->stream || cdata->push) {
+		D_ERROR("libshjpeg: encode stream already started.");
+		return -1;
+	}
+
+	if (!encode_format_supported(format) ||
+	    (width <= 0) || (height <= 0) ||
+	    (width * SHJPEG_PF_PITCH_MULTIPLY(format) > pitch)) {
+		D_ERROR("libshjpeg: invalid stream format %dx%d (pitch %d).",
+			width, height, pitch);
+		return -1;
+	}
+
+	/* frames are not split into stripes */
+	if (width > SHJPEG_JPU_MAX_WIDTH) {
+		D_ERROR("libshjpeg: stream width %d exceeds %d.",
+			width, SHJPEG_JPU_MAX_WIDTH);
+		return -1;
+	}
+
+	if (quality && shjpeg_encode_set_quality(context, quality) < 0)
+		return -1;
+
+	cdata->stream = true;
+	cdata->stream_format = format;
+	cdata->stream_width = width;
+	cdata->stream_height = height;
+	cdata->stream_pitch = pitch;
+	cdata->stream_locked = false;
+	cdata->stream_programmed = false;
+
+	return 0;
+}
+
+int shjpeg_encode_stream_set_hold(shjpeg_context_t * context, int hold)
+{
+	shjpeg_internal_t *data;
+	shjpeg_context_data_t *cdata;
+
+	if (!context) {
+		D_ERROR("libshjpeg: invalid context passed.");
+		return -1;
+	}
+
+	data = (shjpeg_internal_t *) context->internal_data;
+	cdata = context->context_data;
+
+	cdata->stream_hold = hold ? true : false;
+
+	/* give the JPU back right away */
+	if (!hold && cdata->stream_locked) {
+		cdata->stream_locked = false;
+		cdata->stream_programmed = false;
+		if (uiomux_unlock(data->uiomux, UIOMUX_JPU)) {
+			D_PERROR("libshjpeg: Could not unlock JPEG engine!");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int
+shjpeg_encode_stream_set_skip(shjpeg_context_t * context,
+			      int threshold, int max_reuse)
+{
+	shjpeg_context_data_t *cdata;
+
+	if (!context) {
+		D_ERROR("libshjpeg: invalid context passed.");
+		return -1;
+	}
+
+	if (threshold < 0 || threshold > 255 || max_reuse < 0) {
+		D_ERROR("libshjpeg: invalid skip threshold %d or reuse %d.",
+			threshold, max_reuse);
+		return -1;
+	}
+
+	cdata = context->context_data;
+	cdata->skip_threshold = threshold;
+	cdata->skip_max = max_reuse;
+
+	/* compare from the next image encoded */
+	cdata->skip_valid = false;
+
+	return 0;
+}
+
+int shjpeg_encode_stream_frame(shjpeg_context_t * context, void *virt)
+{
+	shjpeg_internal_t *data;
+	shjpeg_context_data_t *cdata;
+	shjpeg_sops *sops;
+	void *priv_data;
+	encode_src_t src;
+	bool keep;
+	int ret;
+
+	if (!context) {
+		D_ERROR("libshjpeg: invalid context passed.");
+		return -1;
+	}
+
+	data = (shjpeg_internal_t *) context->internal_data;
+	cdata = context->context_data;
+
+	if (!cdata->stream) {
+		D_ERROR("libshjpeg: encode stream not started.");
+		return -1;
+	}
+
+	/* error if physical address is not given */
+	if (!virt) {
+		D_ERROR("libshjpeg: buffer address is not given.");
+		return -1;
+	}
+
+	if (cdata->skip_max && skip_unchanged(cdata, virt))
+		return skip_reuse(context);
+
+	encode_buffer_source(data, cdata->stream_format, virt,
+			     cdata->stream_width, cdata->stream_height,
+			     cdata->stream_pitch, &src);
+
+	if (!cdata->stream_locked) {
+		if (uiomux_lock(data->uiomux, UIOMUX_JPU) < 0) {
+			D_PERROR("libshjpeg: Could not lock JPEG engine!");
+			return -1;
+		}
+		cdata->stream_locked = true;
+		cdata->stream_programmed = false;
+	}
+
+	if (!cdata->stream_programmed)
+		encode_setup(data, context, &src);
+
+	/* keep the image if the next frames may reuse it */
+	sops = context->sops;
+	priv_data = context->priv_data;
+	keep = cdata->skip_max && cdata->skip_cur;
+	if (keep) {
+		cdata->skip_dst = sops;
+		cdata->skip_dst_priv = priv_data;
+		cdata->skip_sops.init = skip_init;
+		cdata->skip_sops.read = NULL;
+		cdata->skip_sops.write = skip_write;
+		cdata->skip_sops.finalize = NULL;
+		context->sops = &cdata->skip_sops;
+		context->priv_data = context;
+		cdata->skip_valid = false;
+	}
+
+	ret = encode_run(data, context, &src, cdata->max_size);
+
+	context->sops = sops;
+	context->priv_data = priv_data;
+
+	if (keep && !ret && (cdata->skip_len == cdata->coded_size)) {
+		memcpy(cdata->skip_ref, cdata->skip_cur,
+		       cdata->skip_blocks * sizeof(u16));
+		cdata->skip_valid = true;
+		cdata->skip_reused = 0;
+	}
+
+	/* the JPU is reset after an oversized or failed frame */
+	cdata->stream_programmed = (ret == 0);
+
+	if (!cdata->stream_hold) {
+		cdata->stream_locked = false;
+		cdata->stream_programmed = false;
+		if (uiomux_unlock(data->uiomux, UIOMUX_JPU)) {
+			ret = -1;
+			D_PERROR("libshjpeg: Could not unlock JPEG engine!");
+		}
+	}
+
+	return ret;
+}
+
+int shjpeg_encode_stream_end(shjpeg_context_t * context)
+{
+	shjpeg_context_data_t *cdata;
+	int ret;
+
+	if (!context) {
+		D_ERROR("libshjpeg: invalid context passed.");
+		return -1;
+	}
+
+	cdata = context->context_data;
+
+	if (!cdata->stream)
+		return 0;
+
+	ret = shjpeg_encode_stream_set_hold(context, 0);
+	cdata->stream = false;
+	skip_free(cdata);
+
+	return ret;
+}
+
+/*
+ * encode of rows pushed by the caller
+ *
+ * The caller copies the rows straight into the line buffers, and each
+ * line buffer is handed to the JPU once it is full. While the JPU codes
+ * one, the caller fills the other; it only waits when both are full.
+ */
+
+struct encode_push {
+	shjpeg_jpu_t jpeg;
+	shjpeg_pixelformat format;
+	int pitch;		// pitch of the pushed rows
+	int rows;		// rows pushed so far
+	int written;		// bytes written out
+	int ret;		// result once the encode stopped
+};
+
+int
+shjpeg_encode_begin(shjpeg_context_t * context,
+		    shjpeg_pixelformat format, int width, int height, int pitch)
+{
+	shjpeg_internal_t *data;
+	shjpeg_context_data_t *cdata;
+	struct encode_push *push;
+	encode_src_t src;
+
+	if (!context) {
+		D_ERROR("libshjpeg: invalid context passed.");
+		return -1;
+	}
+
+	data = (shjpeg_internal_t *) context->internal_data;
+	cdata = context->context_data;
+
+	/* check ref counter */
+	if (!data->ref_count) {
+		D_ERROR("libshjpeg: not initialized yet.");
+		return -1;
+	}
+
+	if (cdata->push || cdata->stream) {
+		D_ERROR("libshjpeg: an encode has begun already.");
+		return -1;
+	}
+
+	/* the CPU copies the rows, so VIO formats can't be pushed */
+	if (((format != SHJPEG_PF_NV12) && (format != SHJPEG_PF_NV16) &&
+	     (format != SHJPEG_PF_YCbCr) && (format != SHJPEG_PF_GRAYSCALE)) ||
+	    (width <= 0) || (height <= 0) ||
+	    (width * SHJPEG_PF_PITCH_MULTIPLY(format) > pitch)) {
+		D_ERROR("libshjpeg: can't push %dx%d (format %08x, "
+			"pitch %d).", width, height, format, pitch);
+		return -1;
+	}
+
+	/* the image is not split into stripes */
+	if (width > SHJPEG_JPU_MAX_WIDTH) {
+		D_ERROR("libshjpeg: width %d exceeds %d.",
+			width, SHJPEG_JPU_MAX_WIDTH);
+		return -1;
+	}
+
+	push = calloc(1, sizeof(*push));
+	if (!push) {
+		D_ERROR("libshjpeg: can't allocate the encode.");
+		return -1;
+	}
+
+	push->format = format;
+	push->pitch = pitch;
+
+	/* rows can't be coded again, so rate control has one go */
+	push->jpeg.state = SHJPEG_JPU_START;
+	push->jpeg.flags = SHJPEG_JPU_FLAG_ENCODE | SHJPEG_JPU_FLAG_RELOAD |
+	    SHJPEG_JPU_FLAG_PUSH;
+	push->jpeg.buffers = 3;
+	push->jpeg.max_size = cdata->rc_target ? rc_prepare(cdata) :
+	    cdata->max_size;
+	push->jpeg.height = height;
+	push->jpeg.push_ready = 0;
+
+	memset(&src, 0, sizeof(src));
+	src.format = format;
+	src.width = width;
+	src.height = height;
+	src.pitch = pitch;
+	src.cpu = true;
+
+	if (encode_lock(data, context) < 0) {
+		free(push);
+		return -1;
+	}
+
+	encode_setup(data, context, &src);
+
+	context->width = width;
+	context->height = height;
+	context->pitch = pitch;
+
+	if (context->sops->init)
+		context->sops->init(context->priv_data);
+
+	cdata->push = push;
+	cdata->coded_size = 0;
+
+	return 0;
+}
+
+int shjpeg_encode_push_rows(shjpeg_context_t * context, void *rows, int n)
+{
+	shjpeg_internal_t *data;
+	shjpeg_context_data_t *cdata;
+	struct encode_push *push;
+	shjpeg_jpu_crop_t strip;
+	int done;
+
+	if (!context) {
+		D_ERROR("libshjpeg: invalid context passed.");
+		return -1;
+	}
+
+	data = (shjpeg_internal_t *) context->internal_data;
+	cdata = context->context_data;
+	push = cdata->push;
+
+	if (!push) {
+		D_ERROR("libshjpeg: no encode has begun.");
+		return -1;
+	}
+
+	if (push->ret)
+		return push->ret;
+
+	if (!rows || (n <= 0) || (push->rows + n > context->height)) {
+		D_ERROR("libshjpeg: can't push %d rows at row %d of %d.",
+			n, push->rows, context->height);
+		return -1;
+	}
+
+	/* NV12 chroma rows are shared by two rows */
+	if ((push->format == SHJPEG_PF_NV12) && (n & 1) &&
+	    (push->rows + n < context->height)) {
+		D_ERROR("libshjpeg: only the last NV12 strip can have "
+			"odd rows.");
+		return -1;
+	}
+
+	/* chroma follows the rows, as with shjpeg_encode() */
+	strip.format = push->format;
+	strip.py = rows;
+	strip.pc = rows + push->pitch * n;
+	strip.pitch = push->pitch;
+	strip.x = strip.y = 0;
+	strip.w = context->width;
+	strip.h = n;
+
+	for (done = 0; done < n;) {
+		int line = push->rows % SHJPEG_JPU_LINEBUFFER_HEIGHT;
+		int lines = MIN(n - done, SHJPEG_JPU_LINEBUFFER_HEIGHT - line);
+		u8 *lb = ((push->rows / SHJPEG_JPU_LINEBUFFER_HEIGHT) & 1) ?
+		    data->jpeg_lb2_virt : data->jpeg_lb1_virt;
+
+		/* the JPU is done with this line buffer, see below */
+		soft_crop_fill(data, context, &strip,
+			       lb + line * SHJPEG_JPU_LINEBUFFER_PITCH,
+			       lb + SHJPEG_JPU_LINEBUFFER_SIZE_Y +
+			       line * SHJPEG_JPU_LINEBUFFER_PITCH,
+			       done, lines);
+
+		push->rows += lines;
+		done += lines;
+
+		if ((push->rows % SHJPEG_JPU_LINEBUFFER_HEIGHT) &&
+		    (push->rows < context->height))
+			continue;
+
+		/* hand it over, and wait until the other one is free,
+		   or the image is done after the last rows */
+		push->jpeg.push_ready++;
+		push->ret = encode_loop(data, context, &push->jpeg,
+					&push->written);
+		cdata->coded_size = push->written;
+		if (push->ret)
+			return push->ret;
+	}
+
+	return 0;
+}
+
+int shjpeg_encode_end(shjpeg_context_t * context)
+{
+	shjpeg_internal_t *data;
+	shjpeg_context_data_t *cdata;
+	struct encode_push *push;
+	int ret;
+
+	if (!context) {
+		D_ERROR("libshjpeg: invalid context passed.");
+		return -1;
+	}
+
+	data = (shjpeg_internal_t *) context->internal_data;
+	cdata = context->context_data;
+	push = cdata->push;
+
+	if (!push) {
+		D_ERROR("libshjpeg: no encode has begun.");
+		return -1;
+	}
+
+	ret = push->ret;
+
+	if (!ret && (push->rows < context->height)) {
+		D_ERROR("libshjpeg: encode ended at row %d of %d.",
+			push->rows, context->height);
+		ret = -1;
+	}
+
+	/* stop the JPU if the image is not done */
+	if (ret && (push->jpeg.state == SHJPEG_JPU_RUN)) {
+		shjpeg_jpu_setreg32(data, JPU_JCCMD, JPU_JCCMD_END);
+		shjpeg_jpu_reset(data);
+	}
+
+	if (!ret && cdata->rc_target)
+		rc_update(cdata, cdata->coded_size);
+
+	if (encode_unlock(data, context) < 0)
+		ret = -1;
+
+	cdata->push = NULL;
+	free(push);
+
+	return ret;
 }
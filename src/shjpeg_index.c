@@ -0,0 +1,439 @@
+/*
+ * libshjpeg: A library for controlling SH-Mobile JPEG hardware codec
+ *
+ * Copyright (C) 2009 IGEL Co.,Ltd.
+ * Copyright (C) 2008,2009 Renesas Technology Corp.
+ *
+ * This library is dual licensed.
+ * You are free to use this library under either the MIT or
+ * the GNU LGPL version 2 license.
+ *
+ * For more information please refer to the licensing files
+ * in the root directory of this library package.
+ *
+ * GNU LGPL license: COPYING_LGPL
+ * MIT license: COPYING_MIT
+ */
+
+/*
+ * JPEG stream index
+ *
+ * One pass over a stream in memory records where its segments and
+ * restart intervals are, so random access, parallel decoding and
+ * integrity checks need not parse the stream again.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shjpeg_markers.h"
+
+#define SHJPEG_INDEX_MAGIC	0x584a4853	/* "SHJX" */
+#define SHJPEG_INDEX_VERSION	2
+
+/* words of the serialized index before the segments */
+#define SHJPEG_INDEX_HEADER	39
+
+typedef struct {
+	shjpeg_index_t *index;
+	int max_segments;
+	int max_restarts;
+} index_builder_t;
+
+static int
+add_segment(index_builder_t * b, int marker, size_t offset, size_t length)
+{
+	shjpeg_index_t *index = b->index;
+
+	if (index->num_segments == b->max_segments) {
+		int max = b->max_segments ? b->max_segments * 2 : 16;
+		shjpeg_segment_t *s = realloc(index->segments,
+					      max * sizeof(*s));
+
+		if (!s)
+			return -1;
+		index->segments = s;
+		b->max_segments = max;
+	}
+
+	index->segments[index->num_segments].marker = marker;
+	index->segments[index->num_segments].offset = offset;
+	index->segments[index->num_segments].length = length;
+	index->num_segments++;
+
+	return 0;
+}
+
+static int add_restart(index_builder_t * b, size_t offset)
+{
+	shjpeg_index_t *index = b->index;
+
+	if (index->num_restarts == b->max_restarts) {
+		int max = b->max_restarts ? b->max_restarts * 2 : 64;
+		size_t *r = realloc(index->restarts, max * sizeof(*r));
+
+		if (!r)
+			return -1;
+		index->restarts = r;
+		b->max_restarts = max;
+	}
+
+	index->restarts[index->num_restarts++] = offset;
+
+	return 0;
+}
+
+/* MCU layout of the first scan */
+static void index_mcus(shjpeg_index_t * index)
+{
+	const shjpeg_info_t *info = &index->info;
+	int hmax = 1, vmax = 1;
+	int i;
+
+	/* a single component scan is not interleaved */
+	if (info->scan_components > 1) {
+		for (i = 0; i < info->num_components; i++) {
+			hmax = MAX(hmax, info->comp[i].h_samp);
+			vmax = MAX(vmax, info->comp[i].v_samp);
+		}
+	}
+
+	index->mcus_per_row = (info->width + hmax * 8 - 1) / (hmax * 8);
+	index->mcu_rows = (info->height + vmax * 8 - 1) / (vmax * 8);
+}
+
+/* index the entropy coded data of a scan, *pos is at its start */
+static int
+index_scan(index_builder_t * b, const u8 * buf, size_t len, size_t * pos,
+	   bool first)
+{
+	if (first && add_restart(b, *pos))
+		return -1;
+
+	while (1) {
+		int marker = shjpeg_markers_next(buf, len, pos);
+
+		if (marker < 0) {
+			/* truncated */
+			*pos = len;
+			return 0;
+		}
+
+		if (!SHJPEG_M_IS_RST(marker))
+			return 0;
+
+		*pos += 2;
+		if (first && add_restart(b, *pos))
+			return -1;
+	}
+}
+
+/*
+ * Index a JPEG stream in memory.
+ */
+shjpeg_index_t *shjpeg_index_build(const void *buf, size_t len)
+{
+	const u8 *p = buf;
+	index_builder_t b;
+	shjpeg_index_t *index;
+	size_t pos = 2;
+	int scans = 0;
+
+	index = calloc(1, sizeof(*index));
+	if (!index)
+		return NULL;
+
+	memset(&b, 0, sizeof(b));
+	b.index = index;
+
+	if (shjpeg_probe(buf, len, &index->info) ||
+	    add_segment(&b, SHJPEG_M_SOI, 0, 2))
+		goto err;
+
+	index->size = len;
+	index_mcus(index);
+
+	while (pos + 1 < len) {
+		int marker;
+		size_t seglen;
+
+		if (p[pos] != 0xff)
+			break;	/* garbage, treated as truncated */
+
+		marker = p[pos + 1];
+
+		/* fill bytes */
+		if (marker == 0xff) {
+			pos++;
+			continue;
+		}
+
+		if (marker == SHJPEG_M_EOI) {
+			if (add_segment(&b, marker, pos, 2))
+				goto err;
+			index->eoi = pos;
+			break;
+		}
+
+		/* markers without a segment */
+		if (marker == SHJPEG_M_TEM || SHJPEG_M_IS_RST(marker)) {
+			if (add_segment(&b, marker, pos, 2))
+				goto err;
+			pos += 2;
+			continue;
+		}
+
+		if (pos + 4 > len)
+			break;
+
+		seglen = SHJPEG_GET16(p + pos + 2);
+		if (seglen < 2 || pos + 2 + seglen > len)
+			break;
+
+		if (add_segment(&b, marker, pos, 2 + seglen))
+			goto err;
+
+		pos += 2 + seglen;
+
+		if (marker == SHJPEG_M_SOS &&
+		    index_scan(&b, p, len, &pos, scans++ == 0))
+			goto err;
+	}
+
+	return index;
+
+      err:
+	shjpeg_index_free(index);
+	return NULL;
+}
+
+void shjpeg_index_free(shjpeg_index_t * index)
+{
+	if (!index)
+		return;
+
+	free(index->segments);
+	free(index->restarts);
+	free(index);
+}
+
+/*
+ * Integrity check
+ */
+int shjpeg_index_check(const shjpeg_index_t * index)
+{
+	int ri = index->info.restart_interval;
+	int mcus = index->mcus_per_row * index->mcu_rows;
+
+	if (!index->eoi)
+		return -1;
+
+	if (index->num_restarts != (ri ? (mcus + ri - 1) / ri : 1))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * MCU row <-> restart interval mapping
+ */
+int shjpeg_index_find_row(const shjpeg_index_t * index, int row, int *skip)
+{
+	int ri = index->info.restart_interval;
+	int mcu, interval;
+
+	if (!ri || row < 0 || row >= index->mcu_rows)
+		return -1;
+
+	mcu = row * index->mcus_per_row;
+	interval = mcu / ri;
+	if (interval >= index->num_restarts)
+		return -1;
+
+	if (skip)
+		*skip = mcu % ri;
+
+	return interval;
+}
+
+int shjpeg_index_interval_row(const shjpeg_index_t * index, int interval)
+{
+	int ri = index->info.restart_interval;
+
+	if (!ri || !index->mcus_per_row ||
+	    interval < 0 || interval >= index->num_restarts)
+		return -1;
+
+	return interval * ri / index->mcus_per_row;
+}
+
+/*
+ * Serialization
+ *
+ * 32 bit little endian words: a header of SHJPEG_INDEX_HEADER words,
+ * then marker, offset and length of each segment, then the offset of
+ * each restart interval.
+ */
+
+static u8 *put32(u8 * p, size_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+
+	return p + 4;
+}
+
+static u32 get32(const u8 ** p)
+{
+	const u8 *q = *p;
+
+	*p += 4;
+
+	return q[0] | (q[1] << 8) | (q[2] << 16) | ((u32) q[3] << 24);
+}
+
+void *shjpeg_index_save(const shjpeg_index_t * index, size_t * size)
+{
+	const shjpeg_info_t *info = &index->info;
+	size_t words = SHJPEG_INDEX_HEADER + index->num_segments * 3 +
+	    index->num_restarts;
+	u8 *buf, *p;
+	int i;
+
+	/* offsets are stored in 32 bits */
+	if (index->size > 0xffffffffUL)
+		return NULL;
+
+	buf = p = malloc(words * 4);
+	if (!buf)
+		return NULL;
+
+	p = put32(p, SHJPEG_INDEX_MAGIC);
+	p = put32(p, SHJPEG_INDEX_VERSION);
+	p = put32(p, index->size);
+	p = put32(p, index->eoi);
+	p = put32(p, index->mcus_per_row);
+	p = put32(p, index->mcu_rows);
+
+	p = put32(p, info->width);
+	p = put32(p, info->height);
+	p = put32(p, info->precision);
+	p = put32(p, info->process);
+	p = put32(p, info->progressive);
+	p = put32(p, info->arithmetic);
+	p = put32(p, info->num_components);
+	for (i = 0; i < 4; i++) {
+		p = put32(p, info->comp[i].id);
+		p = put32(p, info->comp[i].h_samp);
+		p = put32(p, info->comp[i].v_samp);
+		p = put32(p, info->comp[i].qtbl);
+	}
+	p = put32(p, info->qtbl_mask);
+	p = put32(p, info->htbl_mask);
+	p = put32(p, info->restart_interval);
+	p = put32(p, info->scan_components);
+	p = put32(p, info->header_size);
+	p = put32(p, info->thumbnail_offset);
+	p = put32(p, info->thumbnail_size);
+	p = put32(p, info->adobe_transform);
+
+	p = put32(p, index->num_segments);
+	p = put32(p, index->num_restarts);
+
+	for (i = 0; i < index->num_segments; i++) {
+		p = put32(p, index->segments[i].marker);
+		p = put32(p, index->segments[i].offset);
+		p = put32(p, index->segments[i].length);
+	}
+
+	for (i = 0; i < index->num_restarts; i++)
+		p = put32(p, index->restarts[i]);
+
+	*size = words * 4;
+
+	return buf;
+}
+
+shjpeg_index_t *shjpeg_index_load(const void *buf, size_t size)
+{
+	const u8 *p = buf;
+	shjpeg_info_t *info;
+	shjpeg_index_t *index;
+	u32 num_segments, num_restarts;
+	int i;
+
+	if (size < SHJPEG_INDEX_HEADER * 4 ||
+	    get32(&p) != SHJPEG_INDEX_MAGIC ||
+	    get32(&p) != SHJPEG_INDEX_VERSION)
+		return NULL;
+
+	index = calloc(1, sizeof(*index));
+	if (!index)
+		return NULL;
+	info = &index->info;
+
+	index->size = get32(&p);
+	index->eoi = get32(&p);
+	index->mcus_per_row = get32(&p);
+	index->mcu_rows = get32(&p);
+
+	info->width = get32(&p);
+	info->height = get32(&p);
+	info->precision = get32(&p);
+	info->process = get32(&p);
+	info->progressive = get32(&p);
+	info->arithmetic = get32(&p);
+	info->num_components = get32(&p);
+	for (i = 0; i < 4; i++) {
+		info->comp[i].id = get32(&p);
+		info->comp[i].h_samp = get32(&p);
+		info->comp[i].v_samp = get32(&p);
+		info->comp[i].qtbl = get32(&p);
+	}
+	info->qtbl_mask = get32(&p);
+	info->htbl_mask = get32(&p);
+	info->restart_interval = get32(&p);
+	info->scan_components = get32(&p);
+	info->header_size = get32(&p);
+	info->thumbnail_offset = get32(&p);
+	info->thumbnail_size = get32(&p);
+	info->adobe_transform = (s32) get32(&p);
+
+	num_segments = get32(&p);
+	num_restarts = get32(&p);
+
+	if (num_segments > size / 4 || num_restarts > size / 4 ||
+	    size != (SHJPEG_INDEX_HEADER + num_segments * 3 +
+		     num_restarts) * 4)
+		goto err;
+
+	index->segments = malloc(num_segments * sizeof(shjpeg_segment_t));
+	index->restarts = malloc(num_restarts * sizeof(size_t));
+	if ((num_segments && !index->segments) ||
+	    (num_restarts && !index->restarts))
+		goto err;
+
+	for (i = 0; i < (int) num_segments; i++) {
+		index->segments[i].marker = get32(&p);
+		index->segments[i].offset = get32(&p);
+		index->segments[i].length = get32(&p);
+	}
+
+	for (i = 0; i < (int) num_restarts; i++)
+		index->restarts[i] = get32(&p);
+
+	index->num_segments = num_segments;
+	index->num_restarts = num_restarts;
+
+	return index;
+
+      err:
+	shjpeg_index_free(index);
+	return NULL;
+}
@@ -86,8 +86,111 @@ typedef struct {
 	void               *user_jpeg_virt;	// vir addr of user_jpeg_data;
 	void               *jpeg_lb1_virt;	// virt addr of line buffer 1
 	void               *jpeg_lb2_virt;	// virt addr of line buffer 2
+
+	/* hardware/software decode decisions */
+	pthread_mutex_t stats_mutex;
+	unsigned long decode_stats[SHJPEG_HW_NREASONS];
 } shjpeg_internal_t;
 
+/*
+ * per-context private data of libshjpeg.
+ * Allocated by shjpeg_init() for each context, and accessed
+ * through context->context_data.
+ */
+
+typedef struct {
+	/* encode quality */
+	int quality;		// 1-100, 0 if not set
+	bool qtbl_valid;	// true if qtbl is to be used for encoding
+	u32 qtbl[32];		// JCQTBL0/1 register image
+
+	/* encode rate control */
+	size_t rc_target;	// target bytes per frame, 0 if disabled
+	size_t rc_cap;		// hard limit of bytes per frame, 0 if none
+	int rc_scale;		// current quantization scale in percent
+	u64 rc_complexity;	// model: coded bytes x scale, 0 if unknown
+
+	/* encode restart interval */
+	bool dri_valid;		// true if dri/dri_rows are to be used
+	u16 dri;		// restart interval in MCUs, 0 disables
+	int dri_rows;		// restart interval in MCU rows, 0 if not set
+
+	/* encode size limit */
+	size_t max_size;	// abort encoding beyond this, 0 if no limit
+
+	/* decode */
+	bool decode_gray;	// image to decode has a single component
+	bool sw_header;		// headers read into context->jpeg_decomp
+	shjpeg_hw_reason hw_reason;	// SHJPEG_HW_OK if the JPU decodes
+
+	/* decode of the EXIF thumbnail */
+	bool thumb_enabled;	// use the thumbnail if large enough
+	int thumb_min_width;	// minimum size of the thumbnail
+	int thumb_min_height;
+	bool thumb;		// context->sops is thumb_sops
+	shjpeg_sops thumb_sops;	// reads the thumbnail out of thumb_src
+	shjpeg_sops *thumb_src;
+	void *thumb_src_priv;
+	size_t thumb_offset;	// thumbnail in the user's stream
+	size_t thumb_size;
+	size_t thumb_left;	// bytes of the thumbnail not read yet
+
+	/* decode band completion */
+	shjpeg_band_callback band_cb;	// NULL if not set
+	void *band_priv;
+	int band_rows;		// rows of the region reported so far
+
+	/* result of the last encode */
+	size_t coded_size;	// bytes written for the last image
+
+	/* encode stream session */
+	bool stream;		// between stream_begin and stream_end
+	shjpeg_pixelformat stream_format;	// layout of every frame
+	int stream_width;
+	int stream_height;
+	int stream_pitch;
+	bool stream_hold;	// keep the JPU locked between frames
+	bool stream_locked;	// the JPU is locked by the session
+	bool stream_programmed;	// JPU registers are set up for the frames
+
+	/* reuse of the last image for unchanged stream frames */
+	int skip_threshold;	// block mean luma change to encode again
+	int skip_max;		// frames to reuse in a row, 0 disables
+	int skip_reused;	// frames reused since the last encode
+	bool skip_valid;	// skip_buf holds the image of skip_ref
+	u16 *skip_ref;		// block signature of the image encoded
+	u16 *skip_cur;		// block signature of the current frame
+	int skip_blocks;	// entries of skip_ref/skip_cur
+	shjpeg_sops skip_sops;	// keeps what is written to skip_dst
+	shjpeg_sops *skip_dst;	// the user's stream
+	void *skip_dst_priv;
+	u8 *skip_buf;		// the image written last
+	size_t skip_size;	// allocated size of skip_buf
+	size_t skip_len;	// bytes in skip_buf
+
+	/* encode of rows pushed by the caller */
+	struct encode_push *push;	// NULL if no encode has begun
+
+	/* replay of the input read by shjpeg_decode_init() */
+	bool replay;		// context->sops is replay_sops
+	shjpeg_sops replay_sops;	// replays, then reads from src
+	shjpeg_sops *src;	// the user's stream
+	void *src_priv;
+	bool src_started;	// src->init has been called
+	bool replay_record;	// keep what is read from src
+	u8 *replay_buf;		// bytes read from src from its start
+	size_t replay_size;	// allocated size of replay_buf
+	size_t replay_len;	// bytes in replay_buf
+	size_t replay_pos;	// read position in the stream
+	size_t src_pos;		// read position of src
+} shjpeg_context_data_t;
+
+/* count a hardware/software decode decision */
+void shjpeg_count_decision(shjpeg_hw_reason reason);
+
+/* report the rows of the decoded region that are complete */
+void shjpeg_decode_band(shjpeg_context_t *context, int rows);
+
 /* page alignment */
 #define _PAGE_SIZE (getpagesize())
 #define _PAGE_ALIGN(len) (((len) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1))
@@ -265,7 +265,23 @@ shjpeg_sw_convert(shjpeg_context_t * context,
 		return;
 
 	D_INFO("libshjpeg: soft: process LB%d", data->vio_linebuf);
-	if (data->jpeg_encode) {
+	if (jpeg->flags & SHJPEG_JPU_FLAG_CROP) {
+		if (data->jpeg_encode)
+			soft_crop_fill(data, context, &jpeg->crop, ydata,
+				cdata, jpeg->soft_line, lines);
+		else
+			soft_crop_band(context, &jpeg->crop, ydata, cdata,
+				jpeg->soft_line, lines);
+	} else if (jpeg->flags & SHJPEG_JPU_FLAG_GRAYSCALE) {
+		if (data->jpeg_encode)
+			soft_fromY(data, context, ydata,
+				data->user_jpeg_virt + jpeg->soft_offset,
+				lines);
+		else
+			soft_toY(data, context, ydata,
+				data->user_jpeg_virt + jpeg->soft_offset,
+				lines);
+	} else if (data->jpeg_encode) {
 		soft_fromYCbCr(data, context, ydata, cdata,
 			data->user_jpeg_virt + jpeg->soft_offset, lines);
 	} else {
@@ -287,7 +303,18 @@ shjpeg_convert(shjpeg_context_t * context,
 	int sw_convert = (jpeg->flags & SHJPEG_JPU_FLAG_SOFTCONVERT);
 #if defined(HAVE_SHVIO)
 	int hw_convert = (jpeg->flags & SHJPEG_JPU_FLAG_CONVERT);
+#endif /* defined(HAVE_SHVIO) */
 
+	if (jpeg->flags & SHJPEG_JPU_FLAG_PUSH) {
+		/* The caller has filled the line buffer already */
+		if (data->vio_line_bufs_done < jpeg->push_ready) {
+			data->vio_linebuf = (data->vio_linebuf + 1) % 2;
+			data->vio_line_bufs_done++;
+		}
+		return 0;
+	}
+
+#if defined(HAVE_SHVIO)
 	if (hw_convert) {
 		start_vio(context, data, jpeg);
 		ret = wait_and_process_vio(context, data);
@@ -302,14 +329,39 @@ shjpeg_convert(shjpeg_context_t * context,
 	return ret;
 }
 
+/*
+ * Push mode: true if the caller can fill the next line buffer, i.e. it
+ * has more to fill, and the JPU is busy with the other one or idle.
+ */
+static bool
+jpu_push_starved(shjpeg_internal_t * data, shjpeg_jpu_t * jpeg)
+{
+	u32 total = (jpeg->height + SHJPEG_JPU_LINEBUFFER_HEIGHT - 1) /
+	    SHJPEG_JPU_LINEBUFFER_HEIGHT;
+	int queued = data->vio_line_bufs_done - data->jpu_line_bufs_done;
+
+	if (jpeg->push_ready >= total)
+		return false;
+
+	return (queued == 0) ||
+	    ((queued == 1) && (data->jpu_line_bufs_pending > 0));
+}
+
 static int
 jpu_encode(shjpeg_context_t * context,
 		shjpeg_internal_t * data, shjpeg_jpu_t * jpeg)
 {
 	int done = 0;
 
-	D_INFO("libshjpeg: jpu: WRITE_RESTART LB=%d", data->jpeg_linebuf);
-	shjpeg_jpu_setreg32(data, JPU_JCCMD, JPU_JCCMD_WRITE_RESTART);
+	/* Nothing was written out while the caller filled a buffer */
+	if (jpeg->starved) {
+		jpeg->starved = false;
+	} else {
+		D_INFO("libshjpeg: jpu: WRITE_RESTART LB=%d",
+		       data->jpeg_linebuf);
+		shjpeg_jpu_setreg32(data, JPU_JCCMD,
+				    JPU_JCCMD_WRITE_RESTART);
+	}
 
 	while (!done) {
 		if ((data->jpu_line_bufs_done < data->vio_line_bufs_done) &&
@@ -317,7 +369,19 @@ jpu_encode(shjpeg_context_t * context,
 			start_jpu_line(context, data);
 		}
 
-		if (data->jpu_line_bufs_done == data->vio_line_bufs_done) {
+		if (jpeg->flags & SHJPEG_JPU_FLAG_PUSH) {
+			/* Take the line buffers the caller has filled */
+			while (data->vio_line_bufs_done < jpeg->push_ready)
+				shjpeg_convert(context, data, jpeg);
+
+			if (jpu_push_starved(data, jpeg)) {
+				D_INFO("libshjpeg: waiting for LB%d",
+				       jpeg->push_ready % 2);
+				jpeg->starved = true;
+				return 0;
+			}
+		} else if (data->jpu_line_bufs_done ==
+			   data->vio_line_bufs_done) {
 			shjpeg_convert(context, data, jpeg);
 		}
 
@@ -326,12 +390,45 @@ jpu_encode(shjpeg_context_t * context,
 			if (wait_and_process_jpu(context, data, &done) < 0)
 				return -1;
 		}
+
+		/* Give up early if the caller can't use the result anyway. */
+		if (jpeg->max_size && !data->jpeg_end &&
+		    shjpeg_jpu_coded_data_amount(data) > jpeg->max_size) {
+			D_INFO("libshjpeg: coded data over %u bytes",
+			       jpeg->max_size);
+			jpeg->oversize = true;
+			break;
+		}
 	}
 
 
 	return 0;
 }
 
+/* Report the rows of the destination written so far */
+static void
+jpu_decode_band(shjpeg_context_t * context,
+		shjpeg_internal_t * data, shjpeg_jpu_t * jpeg)
+{
+	int rows;
+
+	if (jpeg->flags & SHJPEG_JPU_FLAG_CROP)
+		rows = MIN(MAX((int) jpeg->soft_line - jpeg->crop.y, 0),
+			   jpeg->crop.h);
+	else if (jpeg->flags & SHJPEG_JPU_FLAG_SOFTCONVERT)
+		rows = jpeg->soft_line;
+#if defined(HAVE_SHVIO)
+	else if ((jpeg->flags & SHJPEG_JPU_FLAG_CONVERT) &&
+		 (jpeg->height == context->height))
+		rows = MIN(context->height, data->vio_line_bufs_done *
+			   SHJPEG_JPU_LINEBUFFER_HEIGHT);
+#endif /* defined(HAVE_SHVIO) */
+	else
+		return;		/* the caller reports the whole image */
+
+	shjpeg_decode_band(context, rows);
+}
+
 static int
 jpu_decode(shjpeg_context_t * context,
 		shjpeg_internal_t * data, shjpeg_jpu_t * jpeg)
@@ -349,6 +446,16 @@ jpu_decode(shjpeg_context_t * context,
 
 		if (data->jpu_line_bufs_done > data->vio_line_bufs_done) {
 			shjpeg_convert(context, data, jpeg);
+			jpu_decode_band(context, data, jpeg);
+		}
+
+		/* Nothing more to copy below the crop region. */
+		if ((jpeg->flags & SHJPEG_JPU_FLAG_CROP) && !data->jpeg_end &&
+		    jpeg->soft_line >= jpeg->crop.y + jpeg->crop.h) {
+			D_INFO("libshjpeg: crop region done at line %d",
+			       jpeg->soft_line);
+			jpeg->crop_done = true;
+			return 0;
 		}
 
 		if (!data->jpeg_end &&
@@ -361,6 +468,7 @@ jpu_decode(shjpeg_context_t * context,
 	if (!data->jpeg_error &&
 	    data->jpu_line_bufs_done > data->vio_line_bufs_done) {
 		shjpeg_convert(context, data, jpeg);
+		jpu_decode_band(context, data, jpeg);
 	}
 
 	return 0;
@@ -397,6 +505,9 @@ shjpeg_jpu_run(shjpeg_context_t * context,
 
 		jpeg->state = SHJPEG_JPU_RUN;
 		jpeg->error = 0;
+		jpeg->oversize = false;
+		jpeg->crop_done = false;
+		jpeg->starved = false;
 
 		shjpeg_jpu_setreg32(data, JPU_JCCMD, JPU_JCCMD_START);
 
@@ -434,7 +545,12 @@ shjpeg_jpu_run(shjpeg_context_t * context,
 	}
 
 
-	if (data->jpeg_error) {
+	if (jpeg->oversize || jpeg->crop_done) {
+		/* Stopped early; the caller ends the JPU. */
+		jpeg->state = SHJPEG_JPU_END;
+		jpeg->buffers = 0;
+		D_INFO("libshjpeg: '-> STOPPED");
+	} else if (data->jpeg_error) {
 		/* Return error. */
 		jpeg->state = SHJPEG_JPU_END;
 		jpeg->error = data->jpeg_error;
@@ -449,6 +565,8 @@ shjpeg_jpu_run(shjpeg_context_t * context,
 			/* Return end. */
 			jpeg->state = SHJPEG_JPU_END;
 			jpeg->buffers |= 1 << data->jpeg_buffer;
+		} else if (jpeg->starved) {
+			D_INFO("libshjpeg: '-> STARVED (%d)", jpeg->push_ready);
 		} else if (encode) {
 			D_INFO("libshjpeg: '-> LOADED (%d)", jpeg->buffers);
 		} else {
@@ -460,45 +578,125 @@ shjpeg_jpu_run(shjpeg_context_t * context,
 }
 
 /*
- * Init quantization table
+ * Quantization tables
+ */
+
+/* JCQTBL0/1 register image used when no quality has been set */
+static const u32 default_qtbl[SHJPEG_JPU_QTBL_WORDS] = {
+	/* JCQTBL0 */
+	0x100B0B0E, 0x0C0A100E, 0x0D0E1211, 0x10131828,
+	0x1A181616, 0x18312325, 0x1D283A33, 0x3D3C3933,
+	0x38374048, 0x5C4E4044, 0x57453738, 0x506D5157,
+	0x5F626768, 0x673E4D71, 0x79706478, 0x5C656763,
+
+	/* JCQTBL1 */
+	0x11121218, 0x15182F1A, 0x1A2F6342, 0x38426363,
+	0x63636363, 0x63636363, 0x63636363, 0x63636363,
+	0x63636363, 0x63636363, 0x63636363, 0x63636363,
+	0x63636363, 0x63636363, 0x63636363, 0x63636363,
+};
+
+/* IJG base tables (JPEG spec, Annex K) in natural order */
+static const u16 std_luminance_qtbl[64] = {
+	16,  11,  10,  16,  24,  40,  51,  61,
+	12,  12,  14,  19,  26,  58,  60,  55,
+	14,  13,  16,  24,  40,  57,  69,  56,
+	14,  17,  22,  29,  51,  87,  80,  62,
+	18,  22,  37,  56,  68, 109, 103,  77,
+	24,  35,  55,  64,  81, 104, 113,  92,
+	49,  64,  78,  87, 103, 121, 120, 101,
+	72,  92,  95,  98, 112, 100, 103,  99
+};
+
+static const u16 std_chrominance_qtbl[64] = {
+	17,  18,  24,  47,  99,  99,  99,  99,
+	18,  21,  26,  66,  99,  99,  99,  99,
+	24,  26,  56,  99,  99,  99,  99,  99,
+	47,  66,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99
+};
+
+/* The JPU takes the tables in zigzag order */
+static const u8 zigzag_order[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* same mapping as jpeg_quality_scaling() in libjpeg */
+int shjpeg_jpu_quality_scaling(int quality)
+{
+	if (quality <= 0)
+		quality = 1;
+	if (quality > 100)
+		quality = 100;
+
+	return (quality < 50) ? 5000 / quality : 200 - quality * 2;
+}
+
+/* pack one table (natural order) into 16 register words */
+static void
+pack_quantization_table(u32 * regs, const u16 * table, int scale)
+{
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		long q = table[zigzag_order[i]];
+
+		if (scale != 100)
+			q = (q * scale + 50L) / 100L;
+
+		/* baseline - 8 bits only */
+		if (q < 1)
+			q = 1;
+		if (q > 255)
+			q = 255;
+
+		if (!(i & 3))
+			regs[i >> 2] = 0;
+		regs[i >> 2] |= (u32) q << (24 - (i & 3) * 8);
+	}
+}
+
+/*
+ * Build JCQTBL0/1 register image from luminance/chrominance tables
+ * given in natural order and scaled by 'scale' percent.
  */
+void
+shjpeg_jpu_build_quantization_table(u32 * qtbl, const u16 * luma,
+				    const u16 * chroma, int scale)
+{
+	pack_quantization_table(qtbl, luma ? luma : std_luminance_qtbl,
+				scale);
+	pack_quantization_table(qtbl + 16,
+				chroma ? chroma : std_chrominance_qtbl,
+				scale);
+}
 
-void shjpeg_jpu_init_quantization_table(shjpeg_internal_t * data)
+/*
+ * Set quantization table. Default tables are used if qtbl is NULL.
+ */
+
+void shjpeg_jpu_set_quantization_table(shjpeg_internal_t * data,
+				       const u32 * qtbl)
 {
-	/* Init quantization tables. */
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(0), 0x100B0B0E);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(1), 0x0C0A100E);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(2), 0x0D0E1211);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(3), 0x10131828);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(4), 0x1A181616);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(5), 0x18312325);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(6), 0x1D283A33);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(7), 0x3D3C3933);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(8), 0x38374048);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(9), 0x5C4E4044);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(10), 0x57453738);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(11), 0x506D5157);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(12), 0x5F626768);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(13), 0x673E4D71);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(14), 0x79706478);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(15), 0x5C656763);
-
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(0), 0x11121218);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(1), 0x15182F1A);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(2), 0x1A2F6342);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(3), 0x38426363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(4), 0x63636363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(5), 0x63636363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(6), 0x63636363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(7), 0x63636363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(8), 0x63636363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(9), 0x63636363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(10), 0x63636363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(11), 0x63636363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(12), 0x63636363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(13), 0x63636363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(14), 0x63636363);
-	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(15), 0x63636363);
+	int i;
+
+	if (!qtbl)
+		qtbl = default_qtbl;
+
+	for (i = 0; i < 16; i++) {
+		shjpeg_jpu_setreg32(data, JPU_JCQTBL0(i), qtbl[i]);
+		shjpeg_jpu_setreg32(data, JPU_JCQTBL1(i), qtbl[i + 16]);
+	}
 }
 
 /*
@@ -31,6 +31,10 @@
 	(SHJPEG_JPU_LINEBUFFER_PITCH * SHJPEG_JPU_LINEBUFFER_HEIGHT)
 #define SHJPEG_JPU_SIZE  \
         (SHJPEG_JPU_LINEBUFFER_SIZE * 2 + SHJPEG_JPU_RELOAD_SIZE * 2)
+#define SHJPEG_JPU_QTBL_WORDS	(32)	/* JCQTBL0 + JCQTBL1 */
+#define SHJPEG_JPU_MAX_WIDTH	(SHJPEG_JPU_LINEBUFFER_PITCH - 16) /* whole MCUs */
+#define SHJPEG_JPU_DEFAULT_DRI	(512)	/* restart interval in MCUs */
+#define SHJPEG_JPU_MAX_DRI	(0xffff)
 
 typedef enum {
 	SHJPEG_JPU_START,
@@ -42,9 +46,24 @@ typedef enum {
 	SHJPEG_JPU_FLAG_RELOAD = 0x00000001,	/* enable reload mode */
 	SHJPEG_JPU_FLAG_CONVERT = 0x00000002,	/* enable conv. through VIO */
 	SHJPEG_JPU_FLAG_ENCODE = 0x00000004,	/* set encoding mode */
-	SHJPEG_JPU_FLAG_SOFTCONVERT= 0x00000008	/* set encoding mode */
+	SHJPEG_JPU_FLAG_SOFTCONVERT= 0x00000008,	/* set encoding mode */
+	SHJPEG_JPU_FLAG_GRAYSCALE = 0x00000010,	/* Y plane only (soft conv.) */
+	SHJPEG_JPU_FLAG_CROP = 0x00000020,	/* copy a region (soft conv.) */
+	SHJPEG_JPU_FLAG_PUSH = 0x00000040	/* line buffers filled by caller */
 } shjpeg_jpu_flags_t;
 
+/*
+ * decode: region of the decoded image to copy out of the line buffers
+ * encode: source image to copy into the line buffers (x/y unused)
+ */
+typedef struct {
+	shjpeg_pixelformat format;	/* destination/source pixel format */
+	u8 *py;				/* Y (or packed) plane */
+	u8 *pc;				/* CbCr plane */
+	int pitch;			/* pitch of the planes */
+	int x, y, w, h;			/* region of the image */
+} shjpeg_jpu_crop_t;
+
 typedef struct {
 	/* starting, running or ended (done/error) */
 	shjpeg_jpu_state_t state;
@@ -65,6 +84,21 @@ typedef struct {
 
 	u32 soft_offset;  //write position in output buffer
 	u32 soft_line;
+
+	/* encode: stop once coded data exceeds this, 0 for no limit */
+	u32 max_size;
+	/* valid in END state, true if stopped by max_size */
+	bool oversize;
+
+	/* decode: valid with SHJPEG_JPU_FLAG_CROP */
+	shjpeg_jpu_crop_t crop;
+	/* valid in END state, true if stopped below the crop region */
+	bool crop_done;
+
+	/* encode: line buffers filled so far, with SHJPEG_JPU_FLAG_PUSH */
+	u32 push_ready;
+	/* valid in RUN state, true if the next line buffer can be filled */
+	bool starved;
 } shjpeg_jpu_t;
 
 /* read/write from/to registers */
@@ -95,12 +129,25 @@ shjpeg_jpu_setreg32(shjpeg_internal_t * data, u32 address, u32 value)
 #endif
 }
 
+/* amount of coded data the JPU has produced so far */
+static inline u32
+shjpeg_jpu_coded_data_amount(shjpeg_internal_t * data)
+{
+	return (shjpeg_jpu_getreg32(data, JPU_JCDTCU) << 16) |
+	    (shjpeg_jpu_getreg32(data, JPU_JCDTCM) << 8) |
+	    shjpeg_jpu_getreg32(data, JPU_JCDTCD);
+}
+
 /* external function */
 void shjpeg_jpu_reset(shjpeg_internal_t * data);
 int shjpeg_jpu_run(shjpeg_context_t * context, shjpeg_internal_t * data,
 		   shjpeg_jpu_t * jpeg);
 
-void shjpeg_jpu_init_quantization_table(shjpeg_internal_t * data);
+int shjpeg_jpu_quality_scaling(int quality);
+void shjpeg_jpu_build_quantization_table(u32 * qtbl, const u16 * luma,
+					 const u16 * chroma, int scale);
+void shjpeg_jpu_set_quantization_table(shjpeg_internal_t * data,
+				       const u32 * qtbl);
 void shjpeg_jpu_init_huffman_table(shjpeg_internal_t * data);
 
 #endif				/* !__shjpeg_jpu_h__ */
@@ -0,0 +1,748 @@
+/*
+ * libshjpeg: A library for controlling SH-Mobile JPEG hardware codec
+ *
+ * Copyright (C) 2009 IGEL Co.,Ltd.
+ * Copyright (C) 2008,2009 Renesas Technology Corp.
+ *
+ * This library is dual licensed.
+ * You are free to use this library under either the MIT or
+ * the GNU LGPL version 2 license.
+ *
+ * For more information please refer to the licensing files
+ * in the root directory of this library package.
+ *
+ * GNU LGPL license: COPYING_LGPL
+ * MIT license: COPYING_MIT
+ */
+
+/*
+ * JPEG marker parsing
+ *
+ * Just enough of the JPEG syntax to find the segments libshjpeg has to
+ * look at or rewrite, without going through libjpeg.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "shjpeg_markers.h"
+#include "shjpeg_internal.h"
+#include "shjpeg_jpu.h"
+
+/*
+ * Parse the headers of a JPEG stream in memory. Returns 0 if a SOS
+ * segment was found, -1 if the stream is broken or truncated.
+ */
+int
+shjpeg_markers_parse(const u8 * buf, size_t len, shjpeg_markers_t * m)
+{
+	size_t pos = 2;
+
+	memset(m, 0, sizeof(*m));
+
+	if (len < 4 || buf[0] != 0xff || buf[1] != SHJPEG_M_SOI)
+		return -1;
+
+	while (pos + 4 <= len) {
+		u8 marker;
+		size_t seglen;
+
+		if (buf[pos] != 0xff)
+			return -1;
+
+		marker = buf[pos + 1];
+
+		/* fill bytes */
+		if (marker == 0xff) {
+			pos++;
+			continue;
+		}
+
+		seglen = SHJPEG_GET16(buf + pos + 2);
+		if (seglen < 2 || pos + 2 + seglen > len)
+			return -1;
+
+		switch (marker) {
+		case SHJPEG_M_SOF0:
+			if (seglen < 8)
+				return -1;
+			m->sof = pos;
+			m->height = SHJPEG_GET16(buf + pos + 5);
+			m->width = SHJPEG_GET16(buf + pos + 7);
+			break;
+
+		case SHJPEG_M_DRI:
+			if (seglen < 4)
+				return -1;
+			m->dri = pos;
+			m->restart_interval = SHJPEG_GET16(buf + pos + 4);
+			break;
+
+		case SHJPEG_M_SOS:
+			m->sos = pos;
+			m->data = pos + 2 + seglen;
+			return 0;
+
+		default:
+			break;
+		}
+
+		pos += 2 + seglen;
+	}
+
+	return -1;
+}
+
+/*
+ * Find the next marker in entropy coded data. Stuffed zero bytes and
+ * fill bytes are skipped. On success *pos points to the 0xff of the
+ * marker, and the marker is returned. -1 is returned if there is none.
+ */
+int
+shjpeg_markers_next(const u8 * buf, size_t len, size_t * pos)
+{
+	size_t i = *pos;
+
+	while (i + 1 < len) {
+		const u8 *p = memchr(buf + i, 0xff, len - i - 1);
+
+		if (!p)
+			break;
+
+		i = p - buf;
+
+		/* skip fill bytes to the last 0xff */
+		while (i + 1 < len && buf[i + 1] == 0xff)
+			i++;
+
+		if (i + 1 >= len)
+			break;
+
+		if (buf[i + 1] != 0x00) {
+			*pos = i;
+			return buf[i + 1];
+		}
+
+		/* stuffed zero */
+		i += 2;
+	}
+
+	return -1;
+}
+
+/*
+ * Header probe
+ *
+ * The markers are walked byte by byte, either over a buffer in memory
+ * or over a small chunk refilled from the stream, so nothing has to be
+ * allocated and large APPn segments are skipped without being kept.
+ */
+
+typedef struct {
+	const u8 *buf;		/* bytes available */
+	size_t len;
+	size_t pos;
+	size_t offset;		/* stream offset of buf[0] */
+
+	shjpeg_sops *sops;	/* refills buf, NULL for memory */
+	void *priv;
+	u8 *chunk;
+} probe_reader_t;
+
+static int probe_fill(probe_reader_t * r)
+{
+	size_t nbytes = SHJPEG_PROBE_CHUNK;
+
+	if (!r->sops || !r->sops->read)
+		return -1;
+
+	if (r->sops->read(r->priv, &nbytes, r->chunk) || !nbytes)
+		return -1;
+
+	r->offset += r->len;
+	r->buf = r->chunk;
+	r->len = nbytes;
+	r->pos = 0;
+
+	return 0;
+}
+
+static int probe_byte(probe_reader_t * r)
+{
+	if (r->pos >= r->len && probe_fill(r))
+		return -1;
+
+	return r->buf[r->pos++];
+}
+
+/* read a byte of a segment with *left bytes remaining */
+static int probe_seg_byte(probe_reader_t * r, int *left)
+{
+	if (*left <= 0)
+		return -1;
+
+	(*left)--;
+
+	return probe_byte(r);
+}
+
+static int probe_skip(probe_reader_t * r, size_t n)
+{
+	while (n) {
+		size_t avail;
+
+		if (r->pos >= r->len && probe_fill(r))
+			return -1;
+
+		avail = MIN(n, r->len - r->pos);
+		r->pos += avail;
+		n -= avail;
+	}
+
+	return 0;
+}
+
+static int probe_sof(probe_reader_t * r, int marker, int left,
+		     shjpeg_info_t * info)
+{
+	int i, c[6];
+
+	for (i = 0; i < 6; i++)
+		if ((c[i] = probe_seg_byte(r, &left)) < 0)
+			return -1;
+
+	info->process = marker - SHJPEG_M_SOF0;
+	info->progressive = (info->process & 3) == 2;
+	info->arithmetic = (info->process & 8) != 0;
+	info->precision = c[0];
+	info->height = (c[1] << 8) | c[2];
+	info->width = (c[3] << 8) | c[4];
+	info->num_components = c[5];
+
+	if (!info->width || info->num_components < 1 ||
+	    info->num_components > 4)
+		return -1;
+
+	for (i = 0; i < info->num_components; i++) {
+		int id = probe_seg_byte(r, &left);
+		int samp = probe_seg_byte(r, &left);
+		int tq = probe_seg_byte(r, &left);
+
+		if (tq < 0)
+			return -1;
+
+		info->comp[i].id = id;
+		info->comp[i].h_samp = samp >> 4;
+		info->comp[i].v_samp = samp & 15;
+		info->comp[i].qtbl = tq;
+	}
+
+	return left;
+}
+
+static int probe_dqt(probe_reader_t * r, int left, shjpeg_info_t * info)
+{
+	while (left > 0) {
+		int pq_tq = probe_seg_byte(r, &left);
+		int size = (pq_tq >> 4) ? 128 : 64;
+
+		if (pq_tq < 0 || left < size || probe_skip(r, size))
+			return -1;
+
+		info->qtbl_mask |= 1 << (pq_tq & 3);
+		left -= size;
+	}
+
+	return 0;
+}
+
+static int probe_dht(probe_reader_t * r, int left, shjpeg_info_t * info)
+{
+	while (left > 0) {
+		int tc_th = probe_seg_byte(r, &left);
+		int i, count = 0;
+
+		for (i = 0; i < 16; i++) {
+			int n = probe_seg_byte(r, &left);
+
+			if (n < 0)
+				return -1;
+			count += n;
+		}
+
+		if (tc_th < 0 || left < count || probe_skip(r, count))
+			return -1;
+
+		info->htbl_mask |= 1 << ((tc_th & 3) + ((tc_th >> 4) ? 4 : 0));
+		left -= count;
+	}
+
+	return 0;
+}
+
+/* read an EXIF integer of n bytes */
+static int
+probe_exif_int(probe_reader_t * r, int *left, int n, bool le, u32 * v)
+{
+	int i;
+
+	*v = 0;
+	for (i = 0; i < n; i++) {
+		int c = probe_seg_byte(r, left);
+
+		if (c < 0)
+			return -1;
+
+		if (le)
+			*v |= (u32) c << (i * 8);
+		else
+			*v = (*v << 8) | c;
+	}
+
+	return 0;
+}
+
+/* skip forward in a segment to an EXIF offset */
+static int
+probe_exif_seek(probe_reader_t * r, int *left, size_t tiff, u32 offset)
+{
+	size_t pos = r->offset + r->pos - tiff;
+
+	if (offset < pos || offset - pos > (u32) (*left))
+		return 1;
+
+	*left -= offset - pos;
+
+	return probe_skip(r, offset - pos);
+}
+
+/*
+ * Find the JPEG thumbnail in IFD1 of an APP1 EXIF segment. The segment
+ * is only read forward, which works as IFD1 follows IFD0 in practice.
+ * Returns the bytes left in the segment, or -1 if the stream broke.
+ */
+static int probe_exif(probe_reader_t * r, int left, shjpeg_info_t * info)
+{
+	static const u8 exif[6] = { 'E', 'x', 'i', 'f', 0, 0 };
+	size_t tiff;
+	u32 v, ifd, count, offset = 0, size = 0;
+	bool le;
+	int i, c;
+
+	for (i = 0; i < 6; i++) {
+		if ((c = probe_seg_byte(r, &left)) < 0)
+			return -1;
+		if (c != exif[i])
+			return left;
+	}
+
+	/* offsets are relative to the TIFF header */
+	tiff = r->offset + r->pos;
+	if (probe_exif_int(r, &left, 2, false, &v))
+		return -1;
+	if (v != 0x4949 && v != 0x4d4d)
+		return left;
+	le = (v == 0x4949);
+
+	if (probe_exif_int(r, &left, 2, le, &v) ||
+	    probe_exif_int(r, &left, 4, le, &ifd))
+		return -1;
+	if (v != 42)
+		return left;
+
+	/* IFD0, only to find IFD1 */
+	if ((c = probe_exif_seek(r, &left, tiff, ifd)))
+		return (c < 0) ? -1 : left;
+	if (probe_exif_int(r, &left, 2, le, &count))
+		return -1;
+	if ((c = probe_exif_seek(r, &left, tiff,
+				 ifd + 2 + count * 12)))
+		return (c < 0) ? -1 : left;
+	if (probe_exif_int(r, &left, 4, le, &ifd))
+		return -1;
+	if (!ifd)
+		return left;
+	if ((c = probe_exif_seek(r, &left, tiff, ifd)))
+		return (c < 0) ? -1 : left;
+
+	/* IFD1 */
+	if (probe_exif_int(r, &left, 2, le, &count))
+		return -1;
+	while (count--) {
+		u32 tag, type, n;
+
+		if (probe_exif_int(r, &left, 2, le, &tag) ||
+		    probe_exif_int(r, &left, 2, le, &type) ||
+		    probe_exif_int(r, &left, 4, le, &n) ||
+		    probe_exif_int(r, &left, 4, le, &v))
+			return -1;
+
+		/* JPEGInterchangeFormat(Length), LONG */
+		if (type == 4 && n == 1) {
+			if (tag == 0x0201)
+				offset = v;
+			else if (tag == 0x0202)
+				size = v;
+		}
+	}
+
+	/* the thumbnail has to be within the segment */
+	if (offset && size && offset >= r->offset + r->pos - tiff &&
+	    offset - (r->offset + r->pos - tiff) + size <= (u32) left) {
+		info->thumbnail_offset = tiff + offset;
+		info->thumbnail_size = size;
+	}
+
+	return left;
+}
+
+/* colour transform of an APP14 Adobe segment */
+static int probe_adobe(probe_reader_t * r, int left, shjpeg_info_t * info)
+{
+	static const u8 adobe[5] = { 'A', 'd', 'o', 'b', 'e' };
+	int i, c;
+
+	if (left < 12)
+		return left;
+
+	for (i = 0; i < 11; i++) {
+		if ((c = probe_seg_byte(r, &left)) < 0)
+			return -1;
+		if (i < 5 && c != adobe[i])
+			return left;
+	}
+
+	if ((c = probe_seg_byte(r, &left)) < 0)
+		return -1;
+	info->adobe_transform = c;
+
+	return left;
+}
+
+static int probe(probe_reader_t * r, shjpeg_info_t * info)
+{
+	bool sof = false;
+
+	memset(info, 0, sizeof(*info));
+	info->adobe_transform = -1;
+
+	if (probe_byte(r) != 0xff || probe_byte(r) != SHJPEG_M_SOI)
+		return -1;
+
+	while (1) {
+		int marker, hi, lo, left;
+
+		if (probe_byte(r) != 0xff)
+			return -1;
+
+		/* fill bytes */
+		do {
+			marker = probe_byte(r);
+		} while (marker == 0xff);
+
+		if (marker < 0 || marker == SHJPEG_M_EOI)
+			return -1;
+
+		/* markers without a segment */
+		if (marker == SHJPEG_M_TEM || SHJPEG_M_IS_RST(marker))
+			continue;
+
+		hi = probe_byte(r);
+		lo = probe_byte(r);
+		if (lo < 0)
+			return -1;
+
+		left = ((hi << 8) | lo) - 2;
+		if (left < 0)
+			return -1;
+
+		if (SHJPEG_M_IS_SOF(marker)) {
+			if (sof)
+				return -1;
+			sof = true;
+			left = probe_sof(r, marker, left, info);
+		} else {
+			switch (marker) {
+			case SHJPEG_M_DQT:
+				left = probe_dqt(r, left, info);
+				break;
+
+			case SHJPEG_M_DHT:
+				left = probe_dht(r, left, info);
+				break;
+
+			case SHJPEG_M_APP1:
+				if (!info->thumbnail_size)
+					left = probe_exif(r, left, info);
+				break;
+
+			case SHJPEG_M_APP14:
+				left = probe_adobe(r, left, info);
+				break;
+
+			case SHJPEG_M_DRI:
+				hi = probe_seg_byte(r, &left);
+				lo = probe_seg_byte(r, &left);
+				if (lo < 0)
+					return -1;
+				info->restart_interval = (hi << 8) | lo;
+				break;
+
+			case SHJPEG_M_SOS:
+				info->scan_components =
+				    probe_seg_byte(r, &left);
+				if (!sof || info->scan_components < 1)
+					return -1;
+				info->header_size =
+				    r->offset + r->pos + left;
+				return 0;
+
+			default:
+				break;
+			}
+		}
+
+		if (left < 0 || probe_skip(r, left))
+			return -1;
+	}
+}
+
+/*
+ * Parse the headers of a JPEG stream in memory.
+ */
+int shjpeg_probe(const void *buf, size_t len, shjpeg_info_t * info)
+{
+	probe_reader_t r;
+
+	if (!buf || !info)
+		return -1;
+
+	memset(&r, 0, sizeof(r));
+	r.buf = buf;
+	r.len = len;
+
+	return probe(&r, info);
+}
+
+/*
+ * Parse the headers of a JPEG stream read through sops. The stream is
+ * read from its current position, and left somewhere after the SOS
+ * marker.
+ */
+int
+shjpeg_markers_probe(shjpeg_sops * sops, void *priv, shjpeg_info_t * info)
+{
+	u8 chunk[SHJPEG_PROBE_CHUNK];
+	probe_reader_t r;
+
+	memset(&r, 0, sizeof(r));
+	r.sops = sops;
+	r.priv = priv;
+	r.chunk = chunk;
+
+	return probe(&r, info);
+}
+
+/*
+ * JPU compatibility
+ */
+
+shjpeg_hw_reason shjpeg_classify(const shjpeg_info_t * info)
+{
+	int i;
+
+	if (info->precision != 8)
+		return SHJPEG_HW_PRECISION;
+
+	if (info->progressive)
+		return SHJPEG_HW_PROGRESSIVE;
+
+	if (info->arithmetic)
+		return SHJPEG_HW_ARITHMETIC;
+
+	if (info->process != 0)
+		return SHJPEG_HW_PROCESS;
+
+	if (info->num_components != 3)
+		return SHJPEG_HW_COMPONENTS;
+
+	/* RGB, marked by Adobe or by the component identifiers */
+	if (info->adobe_transform == 0 ||
+	    (info->comp[0].id == 'R' && info->comp[1].id == 'G' &&
+	     info->comp[2].id == 'B'))
+		return SHJPEG_HW_COLORSPACE;
+
+	/* Y 2x2 (4:2:0) or 2x1 (4:2:2), chroma 1x1 */
+	if (info->comp[0].h_samp != 2 ||
+	    (info->comp[0].v_samp != 1 && info->comp[0].v_samp != 2))
+		return SHJPEG_HW_SAMPLING;
+	for (i = 1; i < 3; i++)
+		if (info->comp[i].h_samp != 1 || info->comp[i].v_samp != 1)
+			return SHJPEG_HW_SAMPLING;
+
+	if (info->scan_components != 3)
+		return SHJPEG_HW_SCAN;
+
+	/* two tables of each kind */
+	for (i = 0; i < 3; i++)
+		if (info->comp[i].qtbl > 1)
+			return SHJPEG_HW_TABLES;
+	if (info->htbl_mask & ~0x33)
+		return SHJPEG_HW_TABLES;
+
+	if (info->height <= 0 || info->width > SHJPEG_JPU_MAX_WIDTH)
+		return SHJPEG_HW_SIZE;
+
+	return SHJPEG_HW_OK;
+}
+
+const char *shjpeg_hw_reason_string(shjpeg_hw_reason reason)
+{
+	static const char *strings[SHJPEG_HW_NREASONS] = {
+		[SHJPEG_HW_OK] = "decodable by the JPU",
+		[SHJPEG_HW_BROKEN] = "broken headers",
+		[SHJPEG_HW_DISABLED] = "hardware decoding disabled",
+		[SHJPEG_HW_PRECISION] = "not 8 bit precision",
+		[SHJPEG_HW_PROGRESSIVE] = "progressive",
+		[SHJPEG_HW_ARITHMETIC] = "arithmetic coding",
+		[SHJPEG_HW_PROCESS] = "not baseline",
+		[SHJPEG_HW_COMPONENTS] = "not three components",
+		[SHJPEG_HW_COLORSPACE] = "not YCbCr",
+		[SHJPEG_HW_SAMPLING] = "unsupported chroma sampling",
+		[SHJPEG_HW_SCAN] = "components not interleaved",
+		[SHJPEG_HW_TABLES] = "too many tables",
+		[SHJPEG_HW_SIZE] = "unsupported size",
+	};
+
+	if ((unsigned) reason >= SHJPEG_HW_NREASONS)
+		return "unknown";
+
+	return strings[reason];
+}
+
+/*
+ * Motion JPEG demux
+ *
+ * An image runs from SOI to the EOI after its last scan. The header
+ * segments are skipped by their length, so an EXIF thumbnail with
+ * its own EOI doesn't end the image early, and entropy coded data is
+ * scanned for the next marker other than RSTn. Whatever lies between
+ * images, such as multipart boundaries and part headers, is skipped
+ * while looking for the next SOI.
+ */
+
+/* find SOI at or after pos, len if none */
+static size_t mjpeg_soi(const u8 * buf, size_t len, size_t pos)
+{
+	while (pos + 1 < len) {
+		const u8 *p = memchr(buf + pos, 0xff, len - pos - 1);
+
+		if (!p)
+			break;
+
+		pos = p - buf;
+		if (buf[pos + 1] == SHJPEG_M_SOI)
+			return pos;
+		pos++;
+	}
+
+	return len;
+}
+
+/* end of the image at soi, 0 if truncated, -1 if broken */
+static ssize_t mjpeg_end(const u8 * buf, size_t len, size_t soi)
+{
+	size_t pos = soi + 2;
+
+	for (;;) {
+		u8 marker;
+		size_t seglen;
+		int m;
+
+		if (pos + 2 > len)
+			return 0;
+
+		if (buf[pos] != 0xff)
+			return -1;
+
+		marker = buf[pos + 1];
+
+		/* fill bytes */
+		if (marker == 0xff) {
+			pos++;
+			continue;
+		}
+
+		if (marker == SHJPEG_M_EOI)
+			return pos + 2;
+
+		if (marker == SHJPEG_M_SOI)
+			return -1;
+
+		/* segments without a length */
+		if (SHJPEG_M_IS_RST(marker) || marker == SHJPEG_M_TEM) {
+			pos += 2;
+			continue;
+		}
+
+		if (pos + 4 > len)
+			return 0;
+
+		seglen = SHJPEG_GET16(buf + pos + 2);
+		if (seglen < 2)
+			return -1;
+		if (pos + 2 + seglen > len)
+			return 0;
+
+		pos += 2 + seglen;
+
+		if (marker != SHJPEG_M_SOS)
+			continue;
+
+		/* entropy coded data up to the next marker */
+		while ((m = shjpeg_markers_next(buf, len, &pos)) >= 0 &&
+		       SHJPEG_M_IS_RST(m))
+			pos += 2;
+
+		if (m < 0)
+			return 0;
+	}
+}
+
+int shjpeg_mjpeg_find(const void *data, size_t len, size_t * pos,
+		      size_t * size)
+{
+	const u8 *buf = data;
+	size_t soi;
+	ssize_t end;
+
+	if (!buf || !pos || !size)
+		return -1;
+
+	for (soi = *pos; (soi = mjpeg_soi(buf, len, soi)) < len; soi += 2) {
+		end = mjpeg_end(buf, len, soi);
+
+		if (end > 0) {
+			*pos = soi;
+			*size = end - soi;
+			return 1;
+		}
+
+		/* keep the partial image for more data */
+		if (!end) {
+			*pos = soi;
+			return 0;
+		}
+
+		/* broken, look for the next image */
+	}
+
+	/* a trailing 0xff may be the start of a SOI */
+	*pos = (len && buf[len - 1] == 0xff) ? len - 1 : len;
+
+	return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * libshjpeg: A library for controlling SH-Mobile JPEG hardware codec
+ *
+ * Copyright (C) 2009 IGEL Co.,Ltd.
+ * Copyright (C) 2008,2009 Renesas Technology Corp.
+ *
+ * This library is dual licensed.
+ * You are free to use this library under either the MIT or
+ * the GNU LGPL version 2 license.
+ *
+ * For more information please refer to the licensing files
+ * in the root directory of this library package.
+ *
+ * GNU LGPL license: COPYING_LGPL
+ * MIT license: COPYING_MIT
+ */
+
+#ifndef __shjpeg_markers_h__
+#define __shjpeg_markers_h__
+
+#include <shjpeg/shjpeg.h>
+#include "shjpeg_utils.h"
+
+/* JPEG markers (second byte) */
+#define SHJPEG_M_SOF0	0xc0
+#define SHJPEG_M_SOF15	0xcf
+#define SHJPEG_M_DHT	0xc4
+#define SHJPEG_M_JPG	0xc8
+#define SHJPEG_M_DAC	0xcc
+#define SHJPEG_M_RST0	0xd0
+#define SHJPEG_M_RST7	0xd7
+#define SHJPEG_M_SOI	0xd8
+#define SHJPEG_M_EOI	0xd9
+#define SHJPEG_M_SOS	0xda
+#define SHJPEG_M_DQT	0xdb
+#define SHJPEG_M_DRI	0xdd
+#define SHJPEG_M_TEM	0x01
+#define SHJPEG_M_APP1	0xe1
+#define SHJPEG_M_APP14	0xee
+
+#define SHJPEG_M_IS_RST(m) \
+	((m) >= SHJPEG_M_RST0 && (m) <= SHJPEG_M_RST7)
+#define SHJPEG_M_IS_SOF(m) \
+	((m) >= SHJPEG_M_SOF0 && (m) <= SHJPEG_M_SOF15 && \
+	 (m) != SHJPEG_M_DHT && (m) != SHJPEG_M_JPG && (m) != SHJPEG_M_DAC)
+
+/* bytes read from the stream at a time by shjpeg_markers_probe() */
+#define SHJPEG_PROBE_CHUNK	4096
+
+/* big endian 16 bit access */
+#define SHJPEG_GET16(p)	(((p)[0] << 8) | (p)[1])
+#define SHJPEG_PUT16(p, v) \
+	do { (p)[0] = ((v) >> 8) & 0xff; (p)[1] = (v) & 0xff; } while (0)
+
+/* header segments of a JPEG stream, as offsets into the stream */
+typedef struct {
+	size_t sof;		/* SOF0 marker, 0 if none */
+	size_t dri;		/* DRI marker, 0 if none */
+	size_t sos;		/* SOS marker */
+	size_t data;		/* first byte of the entropy coded data */
+
+	int width;
+	int height;
+	int restart_interval;	/* in MCUs, 0 if none */
+} shjpeg_markers_t;
+
+/* parse the headers from SOI up to the end of the first SOS */
+int shjpeg_markers_parse(const u8 * buf, size_t len, shjpeg_markers_t * m);
+
+/* find the next marker in entropy coded data, starting from *pos */
+int shjpeg_markers_next(const u8 * buf, size_t len, size_t * pos);
+
+/* shjpeg_probe() on a stream read through sops, from where it is now */
+int shjpeg_markers_probe(shjpeg_sops * sops, void *priv,
+			 shjpeg_info_t * info);
+
+#endif				/* !__shjpeg_markers_h__ */
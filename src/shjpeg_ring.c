@@ -0,0 +1,578 @@
+/*
+ * libshjpeg: A library for controlling SH-Mobile JPEG hardware codec
+ *
+ * Copyright (C) 2009 IGEL Co.,Ltd.
+ * Copyright (C) 2008,2009 Renesas Technology Corp.
+ *
+ * This library is dual licensed.
+ * You are free to use this library under either the MIT or
+ * the GNU LGPL version 2 license.
+ *
+ * For more information please refer to the licensing files
+ * in the root directory of this library package.
+ *
+ * GNU LGPL license: COPYING_LGPL
+ * MIT license: COPYING_MIT
+ */
+
+/*
+ * Shared memory ring of encoded frames
+ *
+ * The encoder writes each frame into a free slot of a POSIX shared
+ * memory object and publishes it as the latest one. Any number of
+ * processes map the object and read the latest frame in place.
+ *
+ * Each slot has a reference count, which is -1 while the writer owns
+ * the slot. Readers take a reference with compare-and-swap, so a slot
+ * being written can't be referenced, and a referenced slot can't be
+ * taken by the writer. Once released by the writer, a slot always
+ * holds a complete frame. A process shared condition variable wakes
+ * up readers waiting for a new frame.
+ *
+ * Readers reference frames under the robust mutex of the header and
+ * record a lease with their pid for each. When no slot or lease is
+ * free, the leases of processes that are gone are dropped and the
+ * reference counts are rebuilt from the remaining ones, so readers
+ * that die holding frames don't starve the writer.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <shjpeg/shjpeg.h>
+#include "shjpeg_utils.h"
+
+#define SHJPEG_RING_MAGIC	0x524a4853	/* "SHJR" */
+#define SHJPEG_RING_VERSION	2
+#define SHJPEG_RING_LEASES	64
+
+typedef struct {
+	volatile s32 refs;	// readers, -1 while written
+	u32 seq;		// sequence number of the frame
+	u32 size;		// bytes of the frame
+	u32 reserved;
+	u64 timestamp;		// CLOCK_MONOTONIC time of publication in us
+} ring_slot_t;
+
+typedef struct {
+	volatile s32 pid;	// reader holding the frame, 0 if free
+	volatile s32 slot;	// slot of the frame
+} ring_lease_t;
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 num_slots;
+	u32 slot_size;		// bytes of data per slot
+	u32 data_offset;	// offset of the data of the first slot
+
+	volatile s32 latest;	// slot of the latest frame, -1 if none
+	volatile u32 seq;	// sequence number of the latest frame
+	volatile u32 dropped;	// frames the writer had no slot for
+
+	/* wakes up readers on a new frame */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* frames referenced by readers, under the mutex */
+	ring_lease_t leases[SHJPEG_RING_LEASES];
+
+	ring_slot_t slots[0];
+} ring_header_t;
+
+struct shjpeg_ring_struct {
+	ring_header_t *header;
+	size_t map_size;
+	char *name;		// unlinked on close if created here
+
+	/* writer */
+	int slot;		// slot being written, -1 if none
+	size_t len;		// bytes written to it
+	bool overflow;		// the frame didn't fit
+	shjpeg_sops sops;
+};
+
+static u64 ring_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static u8 *ring_data(shjpeg_ring_t * ring, int slot)
+{
+	ring_header_t *h = ring->header;
+
+	return (u8 *) h + h->data_offset + (size_t) slot * h->slot_size;
+}
+
+/* drop the leases of readers that are gone, with the mutex held */
+static void ring_reclaim(ring_header_t * h)
+{
+	s32 refs;
+	int i, slot, n;
+
+	for (i = 0; i < SHJPEG_RING_LEASES; i++) {
+		if (h->leases[i].pid && (kill(h->leases[i].pid, 0) < 0) &&
+		    (errno == ESRCH))
+			h->leases[i].pid = 0;
+	}
+
+	/* Rebuild the reference counts, which a reader dying in the
+	   middle of shjpeg_ring_get() or shjpeg_ring_put() may have
+	   left wrong. The writer may take a free slot meanwhile. */
+	for (slot = 0; slot < (int) h->num_slots; slot++) {
+		for (i = n = 0; i < SHJPEG_RING_LEASES; i++) {
+			if (h->leases[i].pid && (h->leases[i].slot == slot))
+				n++;
+		}
+
+		refs = h->slots[slot].refs;
+		if (refs >= 0)
+			__sync_bool_compare_and_swap(&h->slots[slot].refs,
+						     refs, n);
+	}
+}
+
+/* lock the header, recovering it if the owner died */
+static int ring_lock(ring_header_t * h)
+{
+	int ret;
+
+	ret = pthread_mutex_lock(&h->mutex);
+	if (ret == EOWNERDEAD) {
+		pthread_mutex_consistent(&h->mutex);
+		ring_reclaim(h);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/*
+ * writer
+ */
+
+/* take a slot no reader holds, other than the latest frame */
+static int ring_take(ring_header_t * h)
+{
+	int i, slot;
+
+	for (i = 1; i <= (int) h->num_slots; i++) {
+		slot = (h->latest + i) % h->num_slots;
+		if (slot == h->latest)
+			continue;
+		if (__sync_bool_compare_and_swap(&h->slots[slot].refs, 0, -1))
+			return slot;
+	}
+
+	return -1;
+}
+
+static int ring_acquire(shjpeg_ring_t * ring)
+{
+	ring_header_t *h = ring->header;
+	int slot;
+
+	slot = ring_take(h);
+	if ((slot < 0) && !ring_lock(h)) {
+		/* readers that died may still hold slots */
+		ring_reclaim(h);
+		pthread_mutex_unlock(&h->mutex);
+		slot = ring_take(h);
+	}
+
+	return slot;
+}
+
+static int ring_init(void *priv)
+{
+	shjpeg_ring_t *ring = priv;
+
+	/* called again to rewind a frame being encoded */
+	if (ring->slot < 0)
+		ring->slot = ring_acquire(ring);
+
+	ring->len = 0;
+	ring->overflow = false;
+
+	if (ring->slot < 0) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int ring_write(void *priv, size_t * nbytes, void *dataptr)
+{
+	shjpeg_ring_t *ring = priv;
+	ring_header_t *h = ring->header;
+
+	if ((ring->slot < 0) || (ring->len + *nbytes > h->slot_size)) {
+		ring->overflow = true;
+		return -1;
+	}
+
+	memcpy(ring_data(ring, ring->slot) + ring->len, dataptr, *nbytes);
+	ring->len += *nbytes;
+
+	return 0;
+}
+
+static void ring_release(shjpeg_ring_t * ring)
+{
+	__sync_synchronize();
+	ring->header->slots[ring->slot].refs = 0;
+	ring->slot = -1;
+}
+
+static int ring_map(shjpeg_ring_t * ring, int fd, size_t size)
+{
+	void *map;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	ring->header = map;
+	ring->map_size = size;
+	ring->slot = -1;
+	ring->sops.init = ring_init;
+	ring->sops.write = ring_write;
+
+	return 0;
+}
+
+shjpeg_ring_t *shjpeg_ring_create(const char *name,
+				  int num_slots, size_t slot_size)
+{
+	shjpeg_ring_t *ring;
+	ring_header_t *h;
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	size_t header_size, size;
+	int fd, i;
+
+	if (!name || (num_slots < 2) || !slot_size ||
+	    (slot_size > 0xffffffff)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	header_size = sizeof(ring_header_t) + num_slots * sizeof(ring_slot_t);
+	header_size = (header_size + getpagesize() - 1) &
+	    ~(getpagesize() - 1);
+	size = header_size + num_slots * slot_size;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->name = strdup(name);
+	if (!ring->name)
+		goto err_free;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto err_free;
+
+	if ((ftruncate(fd, size) < 0) || (ring_map(ring, fd, size) < 0)) {
+		close(fd);
+		shm_unlink(name);
+		goto err_free;
+	}
+	close(fd);
+
+	h = ring->header;
+	h->num_slots = num_slots;
+	h->slot_size = slot_size;
+	h->data_offset = header_size;
+	h->latest = -1;
+	h->seq = 0;
+	h->dropped = 0;
+	memset(h->leases, 0, sizeof(h->leases));
+	for (i = 0; i < num_slots; i++)
+		memset(&h->slots[i], 0, sizeof(h->slots[i]));
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&h->mutex, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&h->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	/* readers check the magic last */
+	h->version = SHJPEG_RING_VERSION;
+	__sync_synchronize();
+	h->magic = SHJPEG_RING_MAGIC;
+
+	return ring;
+
+      err_free:
+	free(ring->name);
+	free(ring);
+	return NULL;
+}
+
+int shjpeg_ring_attach(shjpeg_ring_t * ring, shjpeg_context_t * context)
+{
+	if (!ring || !context || !ring->name) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	context->sops = &ring->sops;
+	context->priv_data = ring;
+
+	return 0;
+}
+
+int shjpeg_ring_commit(shjpeg_ring_t * ring, int ok)
+{
+	ring_header_t *h;
+	ring_slot_t *s;
+
+	if (!ring || !ring->name) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	h = ring->header;
+
+	if (ring->slot < 0) {
+		h->dropped++;
+		errno = EBUSY;
+		return -1;
+	}
+
+	s = &h->slots[ring->slot];
+
+	if (!ok || ring->overflow) {
+		/* the frame the slot held is partly overwritten */
+		s->seq = 0;
+		s->size = 0;
+		ring_release(ring);
+		if (ring->overflow) {
+			h->dropped++;
+			errno = EFBIG;
+		}
+		return -1;
+	}
+
+	/* 0 marks an empty slot */
+	s->seq = h->seq + 1 ? h->seq + 1 : 1;
+	s->size = ring->len;
+	s->timestamp = ring_now();
+
+	ring_lock(h);
+	h->latest = ring->slot;
+	ring_release(ring);
+	h->seq = s->seq;
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+}
+
+/*
+ * readers
+ */
+
+shjpeg_ring_t *shjpeg_ring_open(const char *name)
+{
+	shjpeg_ring_t *ring;
+	ring_header_t *h;
+	struct stat st;
+	int fd;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		goto err_free;
+
+	if ((fstat(fd, &st) < 0) || (st.st_size < sizeof(ring_header_t)) ||
+	    (ring_map(ring, fd, st.st_size) < 0)) {
+		close(fd);
+		goto err_free;
+	}
+	close(fd);
+
+	h = ring->header;
+	if ((h->magic != SHJPEG_RING_MAGIC) ||
+	    (h->version != SHJPEG_RING_VERSION) ||
+	    (h->data_offset + (size_t) h->num_slots * h->slot_size >
+	     ring->map_size)) {
+		munmap(ring->header, ring->map_size);
+		errno = EINVAL;
+		goto err_free;
+	}
+
+	return ring;
+
+      err_free:
+	free(ring);
+	return NULL;
+}
+
+/* find a free lease, with the mutex held */
+static int ring_lease(ring_header_t * h)
+{
+	int i;
+
+	for (i = 0; i < SHJPEG_RING_LEASES; i++) {
+		if (!h->leases[i].pid)
+			return i;
+	}
+
+	return -1;
+}
+
+int
+shjpeg_ring_get(shjpeg_ring_t * ring, unsigned long last_seq,
+		int timeout_ms, shjpeg_ring_frame_t * frame)
+{
+	ring_header_t *h;
+	struct timespec ts;
+	int slot, lease, ret;
+
+	if (!ring || !frame) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	h = ring->header;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (timeout_ms > 0) {
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	ret = ring_lock(h);
+
+	/* wait for a frame newer than last_seq */
+	while (((h->latest < 0) || (h->seq == (u32) last_seq)) && !ret) {
+		if (timeout_ms < 0)
+			ret = pthread_cond_wait(&h->cond, &h->mutex);
+		else
+			ret = pthread_cond_timedwait(&h->cond, &h->mutex,
+						     &ts);
+		if (ret == EOWNERDEAD) {
+			pthread_mutex_consistent(&h->mutex);
+			ring_reclaim(h);
+			ret = 0;
+		}
+	}
+
+	if (!ret) {
+		lease = ring_lease(h);
+		if (lease < 0) {
+			ring_reclaim(h);
+			lease = ring_lease(h);
+		}
+		if (lease < 0)
+			ret = EAGAIN;
+	}
+
+	if (ret) {
+		pthread_mutex_unlock(&h->mutex);
+		errno = ret;
+		return -1;
+	}
+
+	/* The writer never takes the latest frame, and releases its slot
+	   before it unlocks, so the slot holds a complete frame. The
+	   lease is valid once the pid is set. */
+	slot = h->latest;
+	h->leases[lease].slot = slot;
+	__sync_synchronize();
+	h->leases[lease].pid = getpid();
+	__sync_fetch_and_add(&h->slots[slot].refs, 1);
+
+	frame->seq = h->slots[slot].seq;
+	frame->data = ring_data(ring, slot);
+	frame->size = h->slots[slot].size;
+	frame->timestamp = h->slots[slot].timestamp;
+	frame->slot = slot;
+
+	pthread_mutex_unlock(&h->mutex);
+
+	return 0;
+}
+
+void shjpeg_ring_put(shjpeg_ring_t * ring, shjpeg_ring_frame_t * frame)
+{
+	ring_header_t *h;
+	ring_slot_t *slot;
+	pid_t pid;
+	int i;
+
+	if (!ring || !frame || (frame->slot < 0))
+		return;
+
+	h = ring->header;
+	slot = &h->slots[frame->slot];
+	pid = getpid();
+
+	if (!ring_lock(h)) {
+		for (i = 0; i < SHJPEG_RING_LEASES; i++) {
+			if ((h->leases[i].pid == pid) &&
+			    (h->leases[i].slot == frame->slot)) {
+				__sync_fetch_and_sub(&slot->refs, 1);
+				h->leases[i].pid = 0;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&h->mutex);
+	}
+
+	frame->slot = -1;
+	frame->data = NULL;
+}
+
+unsigned long shjpeg_ring_dropped(shjpeg_ring_t * ring)
+{
+	return ring ? ring->header->dropped : 0;
+}
+
+void shjpeg_ring_close(shjpeg_ring_t * ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->header, ring->map_size);
+
+	if (ring->name) {
+		shm_unlink(ring->name);
+		free(ring->name);
+	}
+
+	free(ring);
+}
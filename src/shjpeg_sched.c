@@ -0,0 +1,334 @@
+/*
+ * libshjpeg: A library for controlling SH-Mobile JPEG hardware codec
+ *
+ * Copyright (C) 2009 IGEL Co.,Ltd.
+ * Copyright (C) 2008,2009 Renesas Technology Corp.
+ *
+ * This library is dual licensed.
+ * You are free to use this library under either the MIT or
+ * the GNU LGPL version 2 license.
+ *
+ * For more information please refer to the licensing files
+ * in the root directory of this library package.
+ *
+ * GNU LGPL license: COPYING_LGPL
+ * MIT license: COPYING_MIT
+ */
+
+/*
+ * Frame scheduler
+ *
+ * Streams submit frames, and one encoder takes them in an order that
+ * shares the JPU fairly. Each stream keeps the newest few frames only,
+ * and can be held to a frame rate.
+ *
+ * Weighted fair scheduling keeps a virtual time per stream, advanced
+ * by the JPU time of each frame divided by the weight of the stream.
+ * The waiting stream with the smallest virtual time goes next. A
+ * stream that was idle starts from the virtual time of the last
+ * frame scheduled, so it can't claim the time it didn't use.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <shjpeg/shjpeg.h>
+#include "shjpeg_utils.h"
+
+/* virtual time per microsecond of JPU time at weight 1 */
+#define SCHED_VTIME_SCALE	256
+
+typedef struct {
+	int weight;
+	u64 period_us;		// frame period, 0 if not limited
+	u64 next_due;		// earliest time of the next frame
+
+	void **frames;		// ring of waiting frames
+	int depth;
+	int head;
+	int count;
+
+	u64 vtime;		// weighted fair virtual time
+	u64 started;		// time of shjpeg_sched_next()
+
+	shjpeg_sched_stats_t stats;
+} sched_stream_t;
+
+struct shjpeg_sched_struct {
+	shjpeg_sched_policy policy;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool closed;
+
+	sched_stream_t *streams;
+	int num_streams;
+	int last;		// stream scheduled last
+	u64 vclock;		// virtual time of the frame scheduled last
+};
+
+static u64 sched_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+shjpeg_sched_t *shjpeg_sched_new(shjpeg_sched_policy policy)
+{
+	shjpeg_sched_t *sched;
+
+	if ((policy != SHJPEG_SCHED_ROUND_ROBIN) &&
+	    (policy != SHJPEG_SCHED_WEIGHTED_FAIR)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	sched = calloc(1, sizeof(*sched));
+	if (!sched)
+		return NULL;
+
+	sched->policy = policy;
+	sched->last = -1;
+	pthread_mutex_init(&sched->mutex, NULL);
+	pthread_cond_init(&sched->cond, NULL);
+
+	return sched;
+}
+
+void shjpeg_sched_free(shjpeg_sched_t * sched)
+{
+	int i;
+
+	if (!sched)
+		return;
+
+	for (i = 0; i < sched->num_streams; i++)
+		free(sched->streams[i].frames);
+	free(sched->streams);
+
+	pthread_cond_destroy(&sched->cond);
+	pthread_mutex_destroy(&sched->mutex);
+	free(sched);
+}
+
+int
+shjpeg_sched_add_stream(shjpeg_sched_t * sched,
+			int weight, int fps, int depth)
+{
+	sched_stream_t *streams, *s;
+	void **frames;
+	int id;
+
+	if (!sched || (weight < 1) || (fps < 0) || (depth < 1)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	frames = calloc(depth, sizeof(*frames));
+	if (!frames)
+		return -1;
+
+	pthread_mutex_lock(&sched->mutex);
+
+	streams = realloc(sched->streams,
+			  (sched->num_streams + 1) * sizeof(*streams));
+	if (!streams) {
+		pthread_mutex_unlock(&sched->mutex);
+		free(frames);
+		return -1;
+	}
+	sched->streams = streams;
+
+	id = sched->num_streams++;
+	s = &streams[id];
+	memset(s, 0, sizeof(*s));
+	s->weight = weight;
+	s->period_us = fps ? 1000000 / fps : 0;
+	s->frames = frames;
+	s->depth = depth;
+	s->vtime = sched->vclock;
+
+	pthread_mutex_unlock(&sched->mutex);
+
+	return id;
+}
+
+void *shjpeg_sched_submit(shjpeg_sched_t * sched, int stream, void *frame)
+{
+	sched_stream_t *s;
+	void *dropped = NULL;
+	u64 now;
+
+	if (!sched || !frame)
+		return frame;
+
+	pthread_mutex_lock(&sched->mutex);
+
+	if ((stream < 0) || (stream >= sched->num_streams) ||
+	    sched->closed) {
+		pthread_mutex_unlock(&sched->mutex);
+		return frame;
+	}
+
+	s = &sched->streams[stream];
+	s->stats.submitted++;
+
+	/* keep to the frame rate, allowing for a quarter period of
+	   jitter so that every other frame of a source at twice the
+	   rate is taken */
+	if (s->period_us) {
+		now = sched_now();
+		if (now + s->period_us / 4 < s->next_due) {
+			s->stats.dropped_rate++;
+			pthread_mutex_unlock(&sched->mutex);
+			return frame;
+		}
+
+		/* restart the cadence if more than a period behind */
+		if (s->next_due + s->period_us < now)
+			s->next_due = now;
+		s->next_due += s->period_us;
+	}
+
+	/* the newest frames win */
+	if (s->count == s->depth) {
+		dropped = s->frames[s->head];
+		s->head = (s->head + 1) % s->depth;
+		s->count--;
+		s->stats.dropped_late++;
+	}
+
+	/* back from idle, don't catch up */
+	if (!s->count && (s->vtime < sched->vclock))
+		s->vtime = sched->vclock;
+
+	s->frames[(s->head + s->count) % s->depth] = frame;
+	s->count++;
+
+	pthread_cond_signal(&sched->cond);
+	pthread_mutex_unlock(&sched->mutex);
+
+	return dropped;
+}
+
+/* stream to schedule next, -1 if no frame is waiting */
+static int sched_pick(shjpeg_sched_t * sched)
+{
+	int i, id, best = -1;
+
+	for (i = 1; i <= sched->num_streams; i++) {
+		/* start after the stream scheduled last */
+		id = (sched->last + i) % sched->num_streams;
+		if (!sched->streams[id].count)
+			continue;
+
+		if (sched->policy == SHJPEG_SCHED_ROUND_ROBIN)
+			return id;
+
+		if ((best < 0) ||
+		    (sched->streams[id].vtime < sched->streams[best].vtime))
+			best = id;
+	}
+
+	return best;
+}
+
+void *shjpeg_sched_next(shjpeg_sched_t * sched, int *stream)
+{
+	sched_stream_t *s;
+	void *frame;
+	int id;
+
+	if (!sched)
+		return NULL;
+
+	pthread_mutex_lock(&sched->mutex);
+
+	while (((id = sched_pick(sched)) < 0) && !sched->closed)
+		pthread_cond_wait(&sched->cond, &sched->mutex);
+
+	if (id < 0) {
+		pthread_mutex_unlock(&sched->mutex);
+		return NULL;
+	}
+
+	s = &sched->streams[id];
+	frame = s->frames[s->head];
+	s->head = (s->head + 1) % s->depth;
+	s->count--;
+
+	s->stats.scheduled++;
+	s->started = sched_now();
+	sched->last = id;
+	sched->vclock = s->vtime;
+
+	pthread_mutex_unlock(&sched->mutex);
+
+	if (stream)
+		*stream = id;
+
+	return frame;
+}
+
+void shjpeg_sched_done(shjpeg_sched_t * sched, int stream)
+{
+	sched_stream_t *s;
+	u64 busy;
+
+	if (!sched)
+		return;
+
+	pthread_mutex_lock(&sched->mutex);
+
+	if ((stream >= 0) && (stream < sched->num_streams)) {
+		s = &sched->streams[stream];
+		busy = sched_now() - s->started;
+
+		s->stats.busy_us += busy;
+		s->vtime += busy * SCHED_VTIME_SCALE / s->weight;
+	}
+
+	pthread_mutex_unlock(&sched->mutex);
+}
+
+void shjpeg_sched_close(shjpeg_sched_t * sched)
+{
+	if (!sched)
+		return;
+
+	pthread_mutex_lock(&sched->mutex);
+	sched->closed = true;
+	pthread_cond_broadcast(&sched->cond);
+	pthread_mutex_unlock(&sched->mutex);
+}
+
+int
+shjpeg_sched_get_stats(shjpeg_sched_t * sched,
+		       int stream, shjpeg_sched_stats_t * stats)
+{
+	int ret = -1;
+
+	if (!sched || !stats)
+		return -1;
+
+	pthread_mutex_lock(&sched->mutex);
+
+	if ((stream >= 0) && (stream < sched->num_streams)) {
+		*stats = sched->streams[stream].stats;
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&sched->mutex);
+
+	return ret;
+}
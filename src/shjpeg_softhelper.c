@@ -503,3 +503,178 @@ soft_toYCbCr_bybyte(shjpeg_internal_t * data,
 #endif
 	return 0;
 }
+
+/****************
+ *soft_fromY
+ *copies grayscale (Y only) data to the Y plane of a line buffer.
+ *The C plane must have been filled by soft_fill_chroma() beforehand.
+ *
+ **************/
+int
+soft_fromY(shjpeg_internal_t * data,
+	   shjpeg_context_t * context,
+	   u8 * outydata, u8 * inbuf, int lines)
+{
+	int y;
+
+	for (y = 0; y < lines; y++) {
+		memcpy(outydata, inbuf, context->width);
+		outydata += SHJPEG_JPU_LINEBUFFER_PITCH;
+		inbuf += context->pitch;
+	}
+
+	return 0;
+}
+
+/****************
+ *soft_toY
+ *copies the Y plane of a line buffer to grayscale (Y only) data.
+ *The C plane is not touched at all.
+ *
+ **************/
+int
+soft_toY(shjpeg_internal_t * data,
+	 shjpeg_context_t * context,
+	 u8 * inydata, u8 * outbuf, int lines)
+{
+	int y;
+
+	for (y = 0; y < lines; y++) {
+		memcpy(outbuf, inydata, context->width);
+		inydata += SHJPEG_JPU_LINEBUFFER_PITCH;
+		outbuf += context->pitch;
+	}
+
+	return 0;
+}
+
+/****************
+ *soft_fill_chroma
+ *fills the C plane of both line buffers with neutral chroma, so that
+ *grayscale data can be encoded as NV16.
+ *
+ **************/
+void
+soft_fill_chroma(shjpeg_internal_t * data, int width, int lines)
+{
+	u8 *c1 = data->jpeg_lb1_virt + SHJPEG_JPU_LINEBUFFER_SIZE_Y;
+	u8 *c2 = data->jpeg_lb2_virt + SHJPEG_JPU_LINEBUFFER_SIZE_Y;
+	int y;
+
+	if (lines > SHJPEG_JPU_LINEBUFFER_HEIGHT)
+		lines = SHJPEG_JPU_LINEBUFFER_HEIGHT;
+
+	for (y = 0; y < lines; y++) {
+		memset(c1, 0x80, width);
+		memset(c2, 0x80, width);
+		c1 += SHJPEG_JPU_LINEBUFFER_PITCH;
+		c2 += SHJPEG_JPU_LINEBUFFER_PITCH;
+	}
+}
+
+/****************
+ *soft_crop_band
+ *copies the part of a decoded line buffer that falls in the crop
+ *region to the destination. 'line' is the image line at the top of
+ *the line buffer. Bands outside of the region are not touched.
+ *
+ **************/
+void
+soft_crop_band(shjpeg_context_t * context,
+	       const shjpeg_jpu_crop_t * crop,
+	       u8 * inydata, u8 * incdata, int line, int lines)
+{
+	int top = MAX(line, crop->y);
+	int bottom = MIN(line + lines, crop->y + crop->h);
+	int cx = crop->x & ~1;		/* first chroma pair */
+	int cw = (crop->w + 1) & ~1;	/* chroma bytes per line */
+	int l, i;
+
+	for (l = top; l < bottom; l++) {
+		int row = l - crop->y;	/* row in the destination */
+		u8 *src_y = inydata +
+		    (l - line) * SHJPEG_JPU_LINEBUFFER_PITCH + crop->x;
+		u8 *src_c = incdata + (context->mode420 ? (l - line) / 2 :
+				       (l - line)) *
+		    SHJPEG_JPU_LINEBUFFER_PITCH + cx;
+		u8 *out;
+
+		switch (crop->format) {
+		case SHJPEG_PF_GRAYSCALE:
+			memcpy(crop->py + row * crop->pitch, src_y, crop->w);
+			break;
+
+		case SHJPEG_PF_NV16:
+			memcpy(crop->py + row * crop->pitch, src_y, crop->w);
+			memcpy(crop->pc + row * crop->pitch, src_c, cw);
+			break;
+
+		case SHJPEG_PF_NV12:
+			memcpy(crop->py + row * crop->pitch, src_y, crop->w);
+			if (!(row & 1))
+				memcpy(crop->pc + row / 2 * crop->pitch,
+				       src_c, cw);
+			break;
+
+		case SHJPEG_PF_YCbCr:
+			out = crop->py + row * crop->pitch;
+			for (i = 0; i < crop->w; i++) {
+				u8 *c = src_c + ((crop->x + i) & ~1) - cx;
+
+				*(out++) = src_y[i];	//Y
+				*(out++) = c[0];	//U
+				*(out++) = c[1];	//V
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+/****************
+ *soft_crop_fill
+ *copies 'lines' lines of the source image from 'line' on into a line
+ *buffer (NV16) to be encoded. NV12 chroma lines are doubled.
+ *
+ **************/
+void
+soft_crop_fill(shjpeg_internal_t * data,
+	       shjpeg_context_t * context,
+	       const shjpeg_jpu_crop_t * crop,
+	       u8 * outydata, u8 * outcdata, int line, int lines)
+{
+	int cw = (crop->w + 1) & ~1;	/* chroma bytes per line */
+	int l;
+
+	if (crop->format == SHJPEG_PF_YCbCr) {
+		/* context->width/pitch describe the source */
+		soft_fromYCbCr(data, context, outydata, outcdata,
+			       crop->py + line * crop->pitch, lines);
+		return;
+	}
+
+	for (l = line; l < line + lines; l++) {
+		u8 *src_y = crop->py + l * crop->pitch;
+
+		memcpy(outydata, src_y, crop->w);
+
+		switch (crop->format) {
+		case SHJPEG_PF_NV16:
+			memcpy(outcdata, crop->pc + l * crop->pitch, cw);
+			break;
+
+		case SHJPEG_PF_NV12:
+			memcpy(outcdata, crop->pc + l / 2 * crop->pitch, cw);
+			break;
+
+		default:
+			/* grayscale: chroma filled by soft_fill_chroma() */
+			break;
+		}
+
+		outydata += SHJPEG_JPU_LINEBUFFER_PITCH;
+		outcdata += SHJPEG_JPU_LINEBUFFER_PITCH;
+	}
+}
@@ -17,6 +17,7 @@
  */
 
 #include "shjpeg_internal.h"
+#include "shjpeg_jpu.h"
 
 #define BY_WORD
 #define USE_CACHED
@@ -63,6 +64,34 @@ soft_fromYCbCr_byword(shjpeg_internal_t * data,
 	       unsigned char *dst_cdata,
 	       unsigned char *in_buffer, int lines);
 int
+soft_fromY(shjpeg_internal_t * data,
+	   shjpeg_context_t * context,
+	   unsigned char *dst_ydata,
+	   unsigned char *in_buffer, int lines);
+
+int
+soft_toY(shjpeg_internal_t * data,
+	 shjpeg_context_t * context,
+	 unsigned char *src_ydata,
+	 unsigned char *out_buffer, int lines);
+
+void
+soft_fill_chroma(shjpeg_internal_t * data, int width, int lines);
+
+void
+soft_crop_band(shjpeg_context_t * context,
+	       const shjpeg_jpu_crop_t * crop,
+	       unsigned char *src_ydata,
+	       unsigned char *src_cdata, int line, int lines);
+
+void
+soft_crop_fill(shjpeg_internal_t * data,
+	       shjpeg_context_t * context,
+	       const shjpeg_jpu_crop_t * crop,
+	       unsigned char *dst_ydata,
+	       unsigned char *dst_cdata, int line, int lines);
+
+int
 soft_toYCbCr_bybyte(shjpeg_internal_t * data,
 	     shjpeg_context_t * context,
 	     unsigned char *src_ydata,
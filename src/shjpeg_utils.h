@@ -86,6 +86,10 @@ typedef int64_t s64;
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 #endif
 
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
 /*
  * register access
  */
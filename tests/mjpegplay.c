@@ -0,0 +1,601 @@
+/*
+ * Copyright 2009 IGEL Co.,Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Play back a Motion JPEG stream, multipart or concatenated JPEG, from
+ * a file or a pipe, and report how well the decoder keeps up.
+ *
+ * Read, decode and display run in threads of their own. The reader
+ * reads the stream into a pool of buffers and splits it into images
+ * in place, reading ahead of the decoder. The decoder decodes into a
+ * few frames of the frame buffer memory, which the display thread
+ * takes at the given frame rate and writes out if asked to.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/time.h>
+
+#include <shjpeg/shjpeg.h>
+
+#define INBUF_SIZE	(512 * 1024)
+#define INBUF_MAX	(16 * 1024 * 1024)
+#define READ_CHUNK	(64 * 1024)
+
+/* queue that never fills, as it can hold all items there are */
+typedef struct {
+    void **items;
+    int size;
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* statistics */
+    unsigned long waits;	/* pops that had to wait */
+} queue_t;
+
+void queue_init(queue_t *q, int size)
+{
+    memset(q, 0, sizeof(*q));
+    q->items = calloc(size, sizeof(void*));
+    q->size = size;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+void queue_push(queue_t *q, void *item)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->items[(q->head + q->count) % q->size] = item;
+    q->count++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/* dequeue the oldest item, waiting for one; NULL once closed */
+void *queue_pop(queue_t *q)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->mutex);
+
+    if (!q->count && !q->closed)
+	q->waits++;
+    while (!q->count && !q->closed)
+	pthread_cond_wait(&q->cond, &q->mutex);
+
+    if (q->count) {
+	item = q->items[q->head];
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+    }
+
+    pthread_mutex_unlock(&q->mutex);
+
+    return item;
+}
+
+void queue_close(queue_t *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/* part of the stream holding an image */
+typedef struct {
+    unsigned char *buf;
+    size_t size;
+    size_t len;			/* bytes read */
+    size_t image;		/* offset of the image */
+    size_t image_size;
+    size_t pos;			/* read position of the decoder */
+} inbuf_t;
+
+/* decoded frame */
+typedef struct {
+    void *virt;
+    int width;
+    int height;
+    int sw;			/* decoded by libjpeg */
+} frame_t;
+
+static struct {
+    int fd;
+    int loop;
+    int num_count;
+    int quiet;
+    int rate;
+    int out_fd;
+    shjpeg_pixelformat format;
+
+    queue_t free_in;		/* buffers to read into */
+    queue_t images;		/* buffers holding an image */
+    queue_t free_frames;	/* frames to decode into */
+    queue_t frames;		/* decoded frames to display */
+    size_t frame_size;
+
+    /* statistics */
+    unsigned long read_frames;
+    unsigned long skipped;	/* bytes of broken or oversized images */
+    unsigned long decoded;
+    unsigned long sw_decoded;
+    unsigned long errors;
+    unsigned long long decode_us;
+    unsigned long displayed;
+    unsigned long late;		/* displayed after their time */
+    double interval_sum;
+    double interval_sq;
+    double interval_max;
+} play;
+
+unsigned long long now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* read more of the stream, starting over at the end if looping */
+ssize_t read_more(inbuf_t *in)
+{
+    size_t n = in->size - in->len;
+    ssize_t ret;
+
+    if (n > READ_CHUNK)
+	n = READ_CHUNK;
+
+    ret = read(play.fd, in->buf + in->len, n);
+    if (!ret && play.loop && lseek(play.fd, 0, SEEK_SET) == 0)
+	ret = read(play.fd, in->buf + in->len, n);
+
+    if (ret > 0)
+	in->len += ret;
+
+    return ret;
+}
+
+/* make room for a larger image; 0 if the image is too large */
+int grow(inbuf_t *in)
+{
+    unsigned char *buf;
+
+    if (in->size >= INBUF_MAX)
+	return 0;
+
+    buf = realloc(in->buf, in->size * 2);
+    if (!buf)
+	return 0;
+
+    in->buf = buf;
+    in->size *= 2;
+
+    return 1;
+}
+
+void *read_thread(void *arg)
+{
+    inbuf_t *in = queue_pop(&play.free_in), *next;
+    size_t pos = 0;
+
+    while (!play.num_count || play.read_frames < play.num_count) {
+	if (shjpeg_mjpeg_find(in->buf, in->len, &pos, &in->image_size) < 1) {
+	    /* keep what may be the start of an image */
+	    if (pos) {
+		memmove(in->buf, in->buf + pos, in->len - pos);
+		in->len -= pos;
+		pos = 0;
+	    }
+
+	    if (in->len == in->size && !grow(in)) {
+		play.skipped += in->len;
+		in->len = 0;
+	    }
+
+	    if (read_more(in) <= 0)
+		break;
+	    continue;
+	}
+
+	/* The image stays where it was read, and the rest goes on in
+	   the next buffer. */
+	in->image = pos;
+	pos += in->image_size;
+
+	next = queue_pop(&play.free_in);
+	next->len = in->len - pos;
+	while (next->len > next->size && grow(next))
+	    ;
+	if (next->len > next->size) {
+	    play.skipped += next->len;
+	    next->len = 0;
+	}
+	memcpy(next->buf, in->buf + pos, next->len);
+
+	in->len = pos;
+	queue_push(&play.images, in);
+	play.read_frames++;
+
+	in = next;
+	pos = 0;
+    }
+
+    queue_push(&play.free_in, in);
+    queue_close(&play.images);
+
+    return NULL;
+}
+
+int sops_init(void *private)
+{
+    inbuf_t *in = private;
+
+    in->pos = 0;
+
+    return 0;
+}
+
+int sops_read(void *private, size_t *nbytes, void *dataptr)
+{
+    inbuf_t *in = private;
+
+    if (*nbytes > in->image_size - in->pos)
+	*nbytes = in->image_size - in->pos;
+
+    memcpy(dataptr, in->buf + in->image + in->pos, *nbytes);
+    in->pos += *nbytes;
+
+    return 0;
+}
+
+shjpeg_sops my_sops = {
+    .init     = sops_init,
+    .read     = sops_read,
+};
+
+void *decode_thread(void *arg)
+{
+    shjpeg_context_t *ctx = arg;
+    inbuf_t *in;
+    frame_t *frame;
+    unsigned long long start;
+    int pitch;
+
+    while ((in = queue_pop(&play.images))) {
+	frame = queue_pop(&play.free_frames);
+	start = now_us();
+
+	in->pos = 0;
+	ctx->sops = &my_sops;
+	ctx->priv_data = in;
+
+	if (shjpeg_decode_init(ctx) < 0) {
+	    play.errors++;
+	    queue_push(&play.free_frames, frame);
+	    queue_push(&play.free_in, in);
+	    continue;
+	}
+
+	pitch = (ctx->width + 15) & ~15;
+	frame->width = ctx->width;
+	frame->height = ctx->height;
+
+	if (SHJPEG_PF_PLANE_MULTIPLY(play.format, ctx->height) * pitch >
+	    play.frame_size ||
+	    shjpeg_decode_run(ctx, play.format, frame->virt,
+			      ctx->width, ctx->height, pitch) < 0) {
+	    play.errors++;
+	    shjpeg_decode_shutdown(ctx);
+	    queue_push(&play.free_frames, frame);
+	    queue_push(&play.free_in, in);
+	    continue;
+	}
+
+	frame->sw = ctx->libjpeg_used;
+	shjpeg_decode_shutdown(ctx);
+	queue_push(&play.free_in, in);
+
+	play.decode_us += now_us() - start;
+	play.decoded++;
+	if (frame->sw)
+	    play.sw_decoded++;
+
+	queue_push(&play.frames, frame);
+    }
+
+    queue_close(&play.frames);
+
+    return NULL;
+}
+
+void *display_thread(void *arg)
+{
+    frame_t *frame;
+    unsigned long long due = 0, now, last = 0;
+    unsigned long long period = play.rate ? 1000000 / play.rate : 0;
+    double interval;
+
+    while ((frame = queue_pop(&play.frames))) {
+	now = now_us();
+
+	/* hold the frame until its time */
+	if (period) {
+	    if (!due)
+		due = now;
+	    if (now < due) {
+		usleep(due - now);
+		now = now_us();
+	    } else if (now > due + period / 2) {
+		play.late++;
+	    }
+	    due += period;
+	}
+
+	if (last) {
+	    interval = (now - last) / 1000.0;
+	    play.interval_sum += interval;
+	    play.interval_sq += interval * interval;
+	    if (interval > play.interval_max)
+		play.interval_max = interval;
+	}
+	last = now;
+
+	if (play.out_fd >= 0 &&
+	    write(play.out_fd, frame->virt,
+		  SHJPEG_PF_PLANE_MULTIPLY(play.format, frame->height) *
+		  ((frame->width + 15) & ~15)) < 0) {
+	    perror("write");
+	    close(play.out_fd);
+	    play.out_fd = -1;
+	}
+
+	play.displayed++;
+	if (!play.quiet)
+	    fprintf(stderr, frame->sw ? "s" : "+");
+
+	queue_push(&play.free_frames, frame);
+    }
+
+    return NULL;
+}
+
+void show_stats(unsigned long long elapsed)
+{
+    unsigned long n = play.displayed > 1 ? play.displayed - 1 : 0;
+    double mean = n ? play.interval_sum / n : 0.0;
+    double var = n ? play.interval_sq / n - mean * mean : 0.0;
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Frames      = %lu read, %lu decoded (%lu by libjpeg), "
+	    "%lu displayed\n", play.read_frames, play.decoded,
+	    play.sw_decoded, play.displayed);
+    fprintf(stderr, "Decode      = %.2f fps busy, %.2f fps overall\n",
+	    play.decode_us ? play.decoded * 1000000.0 / play.decode_us : 0.0,
+	    elapsed ? play.decoded * 1000000.0 / elapsed : 0.0);
+    fprintf(stderr, "Interval    = %.2f ms avg, %.2f ms jitter (stddev), "
+	    "%.2f ms max\n", mean, var > 0 ? sqrt(var) : 0.0,
+	    play.interval_max);
+    fprintf(stderr, "Stalls      = decoder waited for input %lu times, "
+	    "display for frames %lu times\n",
+	    play.images.waits, play.frames.waits);
+    if (play.rate)
+	fprintf(stderr, "Late        = %lu frames\n", play.late);
+    if (play.errors)
+	fprintf(stderr, "Errors      = %lu\n", play.errors);
+    if (play.skipped)
+	fprintf(stderr, "Skipped     = %lu bytes\n", play.skipped);
+}
+
+void print_usage(const char *prog)
+{
+    fprintf(stderr,
+	    "Usage: %s [OPTION] [<file>]\n"
+	    "- Decode a Motion JPEG stream (multipart or concatenated JPEG)\n"
+	    "  from <file>, or from stdin if omitted or '-'.\n"
+	    "\n"
+	    "Options:\n"
+	    "  -h, --help                         this message.\n"
+	    "  -v, --verbose                      libshjpeg verbose output.\n"
+	    "  -q, --quiet                        quiet mode.\n"
+	    "  -r <fps>, --rate=<fps>             display at <fps>.\n"
+	    "                                     (Default: 0(=as decoded))\n"
+	    "  -b <n>, --buffers=<n>              # of images read ahead. (Default: 4)\n"
+	    "  -d <n>, --depth=<n>                # of decoded frames. (Default: 3)\n"
+	    "  -p <format>, --format=<format>     decode to nv12 or nv16 (default).\n"
+	    "  -o <file>, --output=<file>         write the decoded frames to <file>.\n"
+	    "  -c <count>, --count=<count>        number of frames to decode.\n"
+	    "  -l, --loop                         play the file over and over.\n",
+	    prog);
+}
+
+int main(int argc, char *argv[])
+{
+    shjpeg_context_t *ctx;
+    pthread_t reader, decoder, display;
+    unsigned long long start;
+    char *output = NULL;
+    void *fb;
+    size_t fb_size;
+    int verbose = 0, nbufs = 4, depth = 3;
+    int i;
+
+    play.format = SHJPEG_PF_NV16;
+    play.out_fd = -1;
+
+    while (1) {
+	int c, option_index = 0;
+	static struct option long_options[] = {
+	    {"help", 0, 0, 'h'},
+	    {"verbose", 0, 0, 'v'},
+	    {"quiet", 0, 0, 'q'},
+	    {"rate", 1, 0, 'r'},
+	    {"buffers", 1, 0, 'b'},
+	    {"depth", 1, 0, 'd'},
+	    {"format", 1, 0, 'p'},
+	    {"output", 1, 0, 'o'},
+	    {"count", 1, 0, 'c'},
+	    {"loop", 0, 0, 'l'},
+	    {0, 0, 0, 0}
+	};
+
+	if ((c = getopt_long(argc, argv, "hvqr:b:d:p:o:c:l",
+			     long_options, &option_index)) == -1)
+	    break;
+
+	switch (c) {
+	case 'v':
+	    verbose = 1;
+	    break;
+
+	case 'q':
+	    play.quiet = 1;
+	    break;
+
+	case 'r':
+	    play.rate = atoi(optarg);
+	    break;
+
+	case 'b':
+	    nbufs = atoi(optarg);
+	    break;
+
+	case 'd':
+	    depth = atoi(optarg);
+	    break;
+
+	case 'p':
+	    if (!strcmp(optarg, "nv12"))
+		play.format = SHJPEG_PF_NV12;
+	    else if (!strcmp(optarg, "nv16"))
+		play.format = SHJPEG_PF_NV16;
+	    else {
+		fprintf(stderr, "unknown format %s.\n", optarg);
+		return 1;
+	    }
+	    break;
+
+	case 'o':
+	    output = optarg;
+	    break;
+
+	case 'c':
+	    play.num_count = atoi(optarg);
+	    break;
+
+	case 'l':
+	    play.loop = 1;
+	    break;
+
+	case 'h':
+	    print_usage(argv[0]);
+	    return 0;
+
+	default:
+	    print_usage(argv[0]);
+	    return 1;
+	}
+    }
+
+    /* one buffer is being read into while the others hold images */
+    if (nbufs < 2 || depth < 1) {
+	fprintf(stderr, "need 2 buffers and 1 frame at least.\n");
+	return 1;
+    }
+
+    if (optind < argc && strcmp(argv[optind], "-")) {
+	if ((play.fd = open(argv[optind], O_RDONLY)) < 0) {
+	    perror(argv[optind]);
+	    return 1;
+	}
+    } else {
+	play.fd = 0;
+	play.loop = 0;
+    }
+
+    if (output &&
+	(play.out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	perror(output);
+	return 1;
+    }
+
+    if ((ctx = shjpeg_init(verbose)) == NULL) {
+	fprintf(stderr, "shjpeg_init() failed\n");
+	return 1;
+    }
+
+    /* decoded frames share the frame buffer memory */
+    if (shjpeg_get_frame_buffer(ctx, &fb, &fb_size) < 0) {
+	fprintf(stderr, "can't get the frame buffer.\n");
+	return 1;
+    }
+    play.frame_size = (fb_size / depth) & ~4095;
+
+    queue_init(&play.free_frames, depth);
+    queue_init(&play.frames, depth);
+    for (i = 0; i < depth; i++) {
+	frame_t *frame = calloc(1, sizeof(*frame));
+
+	frame->virt = (char *)fb + i * play.frame_size;
+	queue_push(&play.free_frames, frame);
+    }
+
+    queue_init(&play.free_in, nbufs);
+    queue_init(&play.images, nbufs);
+    for (i = 0; i < nbufs; i++) {
+	inbuf_t *in = calloc(1, sizeof(*in));
+
+	in->size = INBUF_SIZE;
+	in->buf = malloc(in->size);
+	if (!in->buf) {
+	    perror("malloc");
+	    return 1;
+	}
+	queue_push(&play.free_in, in);
+    }
+
+    start = now_us();
+
+    pthread_create(&reader, NULL, read_thread, NULL);
+    pthread_create(&decoder, NULL, decode_thread, ctx);
+    pthread_create(&display, NULL, display_thread, NULL);
+
+    pthread_join(reader, NULL);
+    pthread_join(decoder, NULL);
+    pthread_join(display, NULL);
+
+    if (!play.quiet)
+	show_stats(now_us() - start);
+
+    shjpeg_shutdown(ctx);
+    if (play.out_fd >= 0)
+	close(play.out_fd);
+
+    return play.errors ? 1 : 0;
+}
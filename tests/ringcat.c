@@ -0,0 +1,159 @@
+/*
+ * Copyright 2009 IGEL Co.,Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Read the frames v2mjpeg publishes to a shared memory ring, and write
+ * them out as MJPEG or as JPEG files.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <shjpeg/shjpeg.h>
+
+#define MJPEG_BOUNDARY "++++++++"
+
+void usage(const char *prog)
+{
+    fprintf(stderr,
+	    "Usage: %s [options] <name>\n"
+	    "Options:\n"
+	    "  -o [<prefix>], --output[=<prefix>] dump to the file.\n"
+	    "  -c <count>, --count=<count>        number of frames to read.\n"
+	    "  -t <msec>, --timeout=<msec>        give up after <msec> without a frame\n"
+	    "                                     (default 5000).\n"
+	    "  -q, --quiet                        no progress output.\n"
+	    "  -h, --help                         show this help.\n",
+	    prog);
+}
+
+int main(int argc, char *argv[])
+{
+    shjpeg_ring_t *ring;
+    shjpeg_ring_frame_t frame;
+    unsigned long last_seq = 0, frames = 0, skipped = 0;
+    int num_count = 0, timeout = 5000, quiet = 0;
+    char *prefix = NULL;
+    int ret = 0;
+
+    while (1) {
+	int c, option_index = 0;
+	static struct option long_options[] = {
+	    {"output", 2, 0, 'o'},
+	    {"count", 1, 0, 'c'},
+	    {"timeout", 1, 0, 't'},
+	    {"quiet", 0, 0, 'q'},
+	    {"help", 0, 0, 'h'},
+	    {0, 0, 0, 0}
+	};
+
+	c = getopt_long(argc, argv, "o::c:t:qh",
+			long_options, &option_index);
+	if (c == -1)
+	    break;
+
+	switch (c) {
+	case 'o':
+	    prefix = optarg ? optarg : "ring-";
+	    break;
+
+	case 'c':
+	    num_count = atoi(optarg);
+	    break;
+
+	case 't':
+	    timeout = atoi(optarg);
+	    break;
+
+	case 'q':
+	    quiet = 1;
+	    break;
+
+	case 'h':
+	default:
+	    usage(argv[0]);
+	    return (c == 'h') ? 0 : 1;
+	}
+    }
+
+    if (optind >= argc) {
+	usage(argv[0]);
+	return 1;
+    }
+
+    if (!(ring = shjpeg_ring_open(argv[optind]))) {
+	perror(argv[optind]);
+	return 1;
+    }
+
+    if (!prefix) {
+	printf("HTTP/1.0 200 OK\r\n");
+	printf("Content-type: multipart/x-mixed-replace;boundary=%s\r\n",
+	       MJPEG_BOUNDARY);
+    }
+
+    while (!num_count || (frames < (unsigned long) num_count)) {
+	if (shjpeg_ring_get(ring, last_seq, timeout, &frame) < 0) {
+	    if (errno != ETIMEDOUT)
+		perror("shjpeg_ring_get");
+	    ret = 1;
+	    break;
+	}
+
+	/* count the frames we were too slow for */
+	if (last_seq && (frame.seq > last_seq + 1))
+	    skipped += frame.seq - last_seq - 1;
+	last_seq = frame.seq;
+
+	if (prefix) {
+	    FILE *fp;
+	    char fn[64];
+
+	    snprintf(fn, sizeof(fn), "%s%03lu.jpg", prefix, frames);
+	    if ((fp = fopen(fn, "w")) == NULL) {
+		fprintf(stderr, "Can't create file: %s\n", fn);
+		shjpeg_ring_put(ring, &frame);
+		ret = 1;
+		break;
+	    }
+	    fwrite(frame.data, frame.size, 1, fp);
+	    fclose(fp);
+	} else {
+	    printf("\r\n\r\n--%s\r\n", MJPEG_BOUNDARY);
+	    printf("Content-Type: image/jpeg\r\n");
+	    printf("Content-length: %zd\r\n\r\n", frame.size);
+	    fwrite(frame.data, frame.size, 1, stdout);
+	}
+
+	/* the writer can have the slot back now */
+	shjpeg_ring_put(ring, &frame);
+	frames++;
+
+	if (!quiet)
+	    fprintf(stderr, "+");
+    }
+
+    if (!quiet)
+	fprintf(stderr, "\n%lu frames, %lu skipped, %lu dropped by the writer\n",
+		frames, skipped, shjpeg_ring_dropped(ring));
+
+    shjpeg_ring_close(ring);
+
+    return ret;
+}
@@ -25,6 +25,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 
 #include <shjpeg/shjpeg.h>
 
@@ -232,6 +233,84 @@ shjpeg_sops my_sops = {
     .finalize = sops_finalize,
 };
 
+/* report the bands of the image as they are decoded */
+
+static struct timeval band_start;
+
+void band_done(shjpeg_context_t *context, int first_row, int num_rows,
+	       void *priv)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    printf("Rows %4d-%4d at %ldus\n", first_row, first_row + num_rows - 1,
+	   (now.tv_sec - band_start.tv_sec) * 1000000L +
+	   (now.tv_usec - band_start.tv_usec));
+}
+
+/* re-encode the image by pushing strips of the given height */
+
+int encode_strips(shjpeg_context_t *context, shjpeg_pixelformat format,
+		  unsigned char *virt, int pitch, int rows)
+{
+    int width = context->width, height = context->height;
+    unsigned char *strip, *chroma = virt + pitch * height;
+    int y, n, ret = 0;
+
+    if (shjpeg_encode_begin(context, format, width, height, pitch) < 0)
+	return -1;
+
+    /* Y rows, followed by the CbCr rows of the strip */
+    if ((strip = malloc(pitch * rows * 2)) == NULL) {
+	shjpeg_encode_end(context);
+	return -1;
+    }
+
+    for (y = 0; y < height && !ret; y += n) {
+	n = (rows < height - y) ? rows : height - y;
+
+	memcpy(strip, virt + pitch * y, pitch * n);
+	if (format == SHJPEG_PF_NV12)
+	    memcpy(strip + pitch * n, chroma + pitch * (y / 2),
+		   pitch * ((n + 1) / 2));
+	else if (format == SHJPEG_PF_NV16)
+	    memcpy(strip + pitch * n, chroma + pitch * y, pitch * n);
+
+	ret = shjpeg_encode_push_rows(context, strip, n);
+    }
+
+    free(strip);
+
+    if (shjpeg_encode_end(context) < 0)
+	ret = -1;
+
+    return ret;
+}
+
+/* re-encode a region of the image at full scale as a simulcast output */
+
+int encode_crop(shjpeg_context_t *context, shjpeg_pixelformat format,
+		unsigned char *virt, int pitch, shjpeg_rect_t *crop)
+{
+    shjpeg_surface_t surface;
+    shjpeg_encode_output_t output;
+
+    surface.format = format;
+    surface.py = virt;
+    surface.pc = virt + pitch * context->height;
+    surface.pitch = pitch;
+    surface.width = context->width;
+    surface.height = context->height;
+
+    memset(&output, 0, sizeof(output));
+    output.crop = *crop;
+    output.scale = 1;
+    output.sops = context->sops;
+    output.priv_data = context->priv_data;
+
+    return shjpeg_encode_simulcast(context, &surface, &output, 1);
+}
+
 const char *argv0;
 
 void 
@@ -250,7 +329,11 @@ print_usage() {
 	    "  -D[<bmp>], --bmp[=<bmp>]  dump decoded image in BMP (default: test.bmp).\n"
 	    "  -b <bpp>, --bpp=<bpp>     Bits-per-pixel for BMP image (default: 24)\n"
 	    "  -p <phys>, --phys=<phys>  specify physical memory to use.\n"
-	    "  -n, --no-libjpeg          disable fallback to libjpeg.\n");
+	    "  -n, --no-libjpeg          disable fallback to libjpeg.\n"
+	    "  -B, --bands               show when bands of the image are decoded.\n"
+	    "  -s <rows>, --strips=<rows> re-encode pushing strips of <rows> rows.\n"
+	    "  -c <x>,<y>,<w>x<h>, --crop=<x>,<y>,<w>x<h>\n"
+	    "                            re-encode a region as a simulcast output.\n");
 }
 
 int
@@ -272,6 +355,9 @@ main(int argc, char *argv[])
     int			   bpp = -1;
     int			   disable_libjpeg = 0;
     int			   quiet = 0;
+    int			   bands = 0;
+    int			   strips = 0;
+    shjpeg_rect_t	   crop = { 0, 0, 0, 0 };
     int			   error = 0;
 
     argv0 = argv[0];
@@ -288,10 +374,13 @@ main(int argc, char *argv[])
 	    {"bpp", 1, 0, 'b'},
 	    {"phys", 1, 0, 'p'},
 	    {"no-libjpeg", 0, 0, 'n'},
+	    {"bands", 0, 0, 'B'},
+	    {"strips", 1, 0, 's'},
+	    {"crop", 1, 0, 'c'},
 	    {0, 0, 0, 0}
 	};
 	
-	if ((c = getopt_long(argc, argv, "hvd::D::b:nqp:",
+	if ((c = getopt_long(argc, argv, "hvd::D::b:nqp:Bs:c:",
 			     long_options, &option_index)) == -1)
 	    break;
 
@@ -332,6 +421,23 @@ main(int argc, char *argv[])
 	    phys = (unsigned long) strtoll(optarg, NULL, 0);
 	    break;
 
+	case 'B':
+	    bands = 1;
+	    break;
+
+	case 's':
+	    /* NV12 strips must have even rows */
+	    strips = (strtol(optarg, NULL, 0) + 1) & ~1;
+	    break;
+
+	case 'c':
+	    if (sscanf(optarg, "%d,%d,%dx%d",
+		       &crop.x, &crop.y, &crop.w, &crop.h) != 4) {
+		fprintf(stderr, "invalid region '%s'.\n", optarg);
+		return 1;
+	    }
+	    break;
+
 	default:
 	    fprintf(stderr, "unknown option 0%x.\n", c);
 	    print_usage();
@@ -417,6 +523,11 @@ main(int argc, char *argv[])
     jpeg_virt = shjpeg_malloc(context, format, context->width,
 			      context->height, pitch, &jpeg_size);
 
+    if (bands) {
+	shjpeg_decode_set_band_callback(context, band_done, NULL);
+	gettimeofday(&band_start, NULL);
+    }
+
     /* start decoding */
     if (shjpeg_decode_run(context, format, jpeg_virt,
 			  context->width, context->height, pitch) < 0) {
@@ -457,8 +568,19 @@ main(int argc, char *argv[])
     }
 
     /* start encoding */
-    if (shjpeg_encode(context, format, jpeg_virt,
-		      context->width, context->height, pitch) < 0) {
+    if (crop.w > 0) {
+	if (encode_crop(context, format, jpeg_virt, pitch, &crop) < 0) {
+	    fprintf(stderr, "%s: shjpeg_encode_simulcast() failed.\n",
+		    argv[0]);
+	    return 1;
+	}
+    } else if (strips > 0) {
+	if (encode_strips(context, format, jpeg_virt, pitch, strips) < 0) {
+	    fprintf(stderr, "%s: pushing strips failed.\n", argv[0]);
+	    return 1;
+	}
+    } else if (shjpeg_encode(context, format, jpeg_virt,
+			     context->width, context->height, pitch) < 0) {
 	fprintf(stderr, "%s: shjpeg_encode() failed.\n", argv[0]);
 	return 1;
     }
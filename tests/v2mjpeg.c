@@ -26,12 +26,14 @@
 #include <unistd.h>
 #include <malloc.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 
 #include <asm/types.h>
 #include <linux/videodev2.h>
@@ -64,20 +66,22 @@ typedef struct {
     void *data;
     size_t offset;
     size_t size;
+    int camera;			/* camera the frame was captured by */
+    unsigned long long captured;	/* time the frame was captured */
 } sops_data_t;
 
 int sops_init(void *private)
 {
     sops_data_t *data = (sops_data_t*)private;
 
-    if (data->data)
-    	free(data->data);
-
-    data->data = malloc(DATASIZE);
-    if (!data->data)
-    	return -1;
+    /* the buffer is reused for the next frame */
+    if (!data->data) {
+	data->data = malloc(DATASIZE);
+	if (!data->data)
+	    return -1;
+	data->size = DATASIZE;
+    }
 
-    data->size = DATASIZE;
     data->offset = 0L;
 
     return 0;
@@ -113,12 +117,584 @@ static char *argv0;
 static struct timeval start_tv;
 static int frame_count = 0;
 
+/*
+ * Pipeline
+ *
+ * Capture, encode and output run in threads of their own, connected
+ * by bounded queues. If a queue is full, its oldest entry is dropped,
+ * so the latest frame wins and a slow consumer doesn't stall the
+ * camera. Encode of a frame overlaps output of the previous one and
+ * capture of the next one.
+ *
+ * Each camera has a capture thread. The cameras share the JPU through
+ * a frame scheduler of libshjpeg, which takes the place of the queue
+ * between capture and encode.
+ *
+ * Instead of a camera, raw frames can be read from a file or a pipe
+ * into a pool of buffers in the frame buffer memory, for repeatable
+ * benchmarks. These frames are never dropped; the reader waits for
+ * a free buffer instead.
+ *
+ * With a shared memory ring, frames are encoded straight into the ring
+ * for other processes to read, and the output stage is idle.
+ */
+
+typedef struct {
+    void **items;
+    int size;
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* statistics */
+    unsigned long pushed;
+    unsigned long dropped;
+    unsigned long depth_sum;	/* depth after each push */
+    int depth_max;
+} queue_t;
+
+void queue_init(queue_t *q, int size)
+{
+    memset(q, 0, sizeof(*q));
+    q->items = calloc(size, sizeof(void*));
+    q->size = size;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+/* queue an item; if full, the oldest one is dropped and returned */
+void *queue_push(queue_t *q, void *item)
+{
+    void *dropped = NULL;
+
+    pthread_mutex_lock(&q->mutex);
+
+    if (q->count == q->size) {
+	dropped = q->items[q->head];
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+	q->dropped++;
+    }
+
+    q->items[(q->head + q->count) % q->size] = item;
+    q->count++;
+
+    q->pushed++;
+    q->depth_sum += q->count;
+    if (q->count > q->depth_max)
+	q->depth_max = q->count;
+
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+
+    return dropped;
+}
+
+/* dequeue the oldest item, waiting for one; NULL once closed */
+void *queue_pop(queue_t *q)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->mutex);
+
+    while (!q->count && !q->closed)
+	pthread_cond_wait(&q->cond, &q->mutex);
+
+    if (q->count) {
+	item = q->items[q->head];
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+    }
+
+    pthread_mutex_unlock(&q->mutex);
+
+    return item;
+}
+
+void queue_close(queue_t *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/* captured frame */
+typedef struct {
+    void			*start;
+    size_t	 		 length;
+    struct v4l2_buffer	 buffer;
+    int				 camera;
+    unsigned long long		 captured;
+} capbuf_t;
+
+/* time spent working (not waiting for input) in a stage */
+typedef struct {
+    const char *name;
+    unsigned long frames;
+    unsigned long long busy_us;
+} stage_t;
+
+enum { STAGE_ENCODE, STAGE_OUTPUT, STAGE_NUM };
+
+typedef struct {
+    char *videodev;
+    int vd;
+    shjpeg_context_t *ctx;
+    capbuf_t *buffers;
+    int nbufs;
+
+    /* layout of the frames */
+    shjpeg_pixelformat format;
+    int width;
+    int height;
+    int pitch;
+
+    /* raw frame source */
+    int raw;			/* read from videodev, a file or pipe */
+    int loop;			/* start over at the end of the file */
+    int rate;			/* frames per second, 0 for no limit */
+    size_t frame_size;
+    queue_t pool;		/* free frame buffers */
+
+    shjpeg_ring_t *ring;	/* encode into shared memory */
+
+    int stream;			/* stream of the frame scheduler */
+    int weight;
+    int fps;
+
+    pthread_t thread;
+    stage_t capture;
+    int frames;			/* frames output */
+} camera_t;
+
+#define MAX_CAMERAS	8
+#define LATENCY_SAMPLES	4096
+#define RING_SLOTS	8
+
+static struct {
+    camera_t cameras[MAX_CAMERAS];
+    int num_cameras;
+    int session;		/* use the encode stream session */
+
+    shjpeg_sched_t *sched;	/* captured frames to encode */
+    queue_t output_q;		/* encoded frames to output */
+    queue_t free_q;		/* output buffers to encode into */
+
+    stage_t stages[STAGE_NUM];
+    unsigned long errors;	/* frames failed to encode */
+    unsigned long reused;	/* unchanged frames not encoded */
+
+    /* capture to output latency of the last frames in microseconds */
+    unsigned long long latency[LATENCY_SAMPLES];
+    unsigned long latency_count;
+    struct rusage start_usage;
+
+    int output;
+    char *prefix;
+    int quiet;
+    int interval;
+    int num_count;
+    volatile int stop;
+} pipe_state = {
+    .stages = {
+	{ .name = "encode" },
+	{ .name = "output" },
+    },
+};
+
+unsigned long long now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void stage_done(stage_t *stage, unsigned long long start)
+{
+    stage->frames++;
+    stage->busy_us += now_us() - start;
+}
+
+/* give a frame back to the driver */
+int requeue(capbuf_t *frame)
+{
+    camera_t *cam = &pipe_state.cameras[frame->camera];
+
+    if (cam->raw) {
+	queue_push(&cam->pool, frame);
+	return 0;
+    }
+
+    if (ioctl(cam->vd, VIDIOC_QBUF, &frame->buffer) < 0) {
+	perror("ioctl - VIDIOC_QBUF");
+	return -1;
+    }
+
+    return 0;
+}
+
+void *capture_thread(void *arg)
+{
+    camera_t *cam = arg;
+
+    while(!pipe_state.stop) {
+	struct v4l2_buffer buffer;
+	unsigned long long start;
+	capbuf_t *frame;
+
+	/* capture */
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buffer.memory= V4L2_MEMORY_USERPTR;
+	if (ioctl(cam->vd, VIDIOC_DQBUF, &buffer) < 0) {
+	    perror("ioctl - VIDIOC_DQBUF");
+	    break;
+	}
+	start = now_us();
+
+	frame = &cam->buffers[buffer.index];
+	memcpy(&frame->buffer, &buffer, sizeof(buffer));
+	frame->captured = start;
+
+	/* frames dropped by the scheduler go back to the driver */
+	frame = shjpeg_sched_submit(pipe_state.sched, cam->stream, frame);
+	if (frame && requeue(frame) < 0)
+	    break;
+
+	stage_done(&cam->capture, start);
+    }
+
+    return NULL;
+}
+
+/* read a raw frame; 1 if read, 0 at the end of the input */
+int read_frame(camera_t *cam, void *buf)
+{
+    size_t done = 0;
+    ssize_t len;
+    int rewound = 0;
+
+    while (done < cam->frame_size) {
+	len = read(cam->vd, buf + done, cam->frame_size - done);
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("read");
+	    return -1;
+	}
+
+	if (!len) {
+	    /* a partial frame at the end is not encoded */
+	    if (done || !cam->loop || rewound ||
+		lseek(cam->vd, 0, SEEK_SET) < 0)
+		return 0;
+	    rewound = 1;
+	    continue;
+	}
+
+	done += len;
+    }
+
+    return 1;
+}
+
+void *read_thread(void *arg)
+{
+    camera_t *cam = arg;
+    unsigned long long start, due = now_us();
+    capbuf_t *frame;
+
+    while(!pipe_state.stop) {
+	/* keep to the frame rate */
+	if (cam->rate) {
+	    start = now_us();
+	    if (start < due)
+		usleep(due - start);
+	    due += 1000000 / cam->rate;
+	}
+
+	/* wait for a free buffer instead of dropping frames */
+	frame = queue_pop(&cam->pool);
+	start = now_us();
+
+	if (read_frame(cam, frame->start) <= 0) {
+	    queue_push(&cam->pool, frame);
+	    break;
+	}
+	frame->captured = start;
+
+	frame = shjpeg_sched_submit(pipe_state.sched, cam->stream, frame);
+	if (frame)
+	    requeue(frame);
+
+	stage_done(&cam->capture, start);
+    }
+
+    return NULL;
+}
+
+/* account a frame output; non-zero once enough frames are out */
+int frame_done(camera_t *cam, unsigned long long captured)
+{
+    pipe_state.latency[pipe_state.latency_count++ % LATENCY_SAMPLES] =
+	now_us() - captured;
+
+    if (!pipe_state.quiet)
+	fprintf(stderr, "+");
+    fflush(stderr);
+
+    cam->frames++;
+    frame_count++;
+    if ((pipe_state.num_count > 0) &&
+	(pipe_state.num_count <= frame_count)) {
+	pipe_state.stop = 1;
+	return 1;
+    }
+
+    return 0;
+}
+
+/* encode a frame into the shared memory ring of the camera */
+void encode_ring(camera_t *cam, capbuf_t *frame, int stream)
+{
+    int ret;
+
+    if (pipe_state.session)
+	ret = shjpeg_encode_stream_frame(cam->ctx, frame->start);
+    else
+	ret = shjpeg_encode(cam->ctx, cam->format, frame->start,
+			    cam->width, cam->height, cam->pitch);
+
+    shjpeg_sched_done(pipe_state.sched, stream);
+    requeue(frame);
+
+    if (ret < 0)
+	pipe_state.errors++;
+    else if (ret == SHJPEG_FRAME_REUSED)
+	pipe_state.reused++;
+
+    /* frames no reader left a slot for are dropped */
+    if (!shjpeg_ring_commit(cam->ring, ret >= 0) && !pipe_state.stop)
+	frame_done(cam, frame->captured);
+}
+
+void *encode_thread(void *arg)
+{
+    capbuf_t *frame;
+    camera_t *cam;
+    sops_data_t *out;
+    unsigned long long start;
+    int stream, ret;
+
+    while ((frame = shjpeg_sched_next(pipe_state.sched, &stream))) {
+	start = now_us();
+	cam = &pipe_state.cameras[frame->camera];
+
+	if (cam->ring) {
+	    encode_ring(cam, frame, stream);
+	    stage_done(&pipe_state.stages[STAGE_ENCODE], start);
+	    continue;
+	}
+
+	/* there is always a free buffer, see main() */
+	out = queue_pop(&pipe_state.free_q);
+	out->camera = frame->camera;
+	out->captured = frame->captured;
+	cam->ctx->priv_data = out;
+
+	if (pipe_state.session)
+	    ret = shjpeg_encode_stream_frame(cam->ctx, frame->start);
+	else
+	    ret = shjpeg_encode(cam->ctx, cam->format, frame->start,
+				cam->width, cam->height, cam->pitch);
+
+	shjpeg_sched_done(pipe_state.sched, stream);
+	requeue(frame);
+
+	if (ret == SHJPEG_FRAME_REUSED)
+	    pipe_state.reused++;
+
+	if (ret < 0) {
+	    pipe_state.errors++;
+	    queue_push(&pipe_state.free_q, out);
+	} else {
+	    out = queue_push(&pipe_state.output_q, out);
+	    if (out)
+		queue_push(&pipe_state.free_q, out);
+	}
+
+	stage_done(&pipe_state.stages[STAGE_ENCODE], start);
+    }
+
+    queue_close(&pipe_state.output_q);
+
+    return NULL;
+}
+
+void *output_thread(void *arg)
+{
+    sops_data_t *data;
+    camera_t *cam;
+    unsigned long long start, captured;
+
+    while ((data = queue_pop(&pipe_state.output_q))) {
+	start = now_us();
+	cam = &pipe_state.cameras[data->camera];
+	captured = data->captured;
+
+	// output buffered data
+	if (pipe_state.output) {
+	    FILE *fp;
+	    char fn[64];
+
+	    if (pipe_state.num_cameras > 1)
+		snprintf(fn, sizeof(fn), "%s%d-%03d.jpg", pipe_state.prefix,
+			 data->camera, cam->frames);
+	    else
+		snprintf(fn, sizeof(fn), "%s%03d.jpg", pipe_state.prefix,
+			 cam->frames);
+
+	    if ((fp = fopen(fn, "w")) == NULL) {
+	    	fprintf(stderr, "Can't create file: %s\n", fn);
+		pipe_state.stop = 1;
+		queue_push(&pipe_state.free_q, data);
+		break;
+	    }
+	    fwrite(data->data, data->offset, 1, fp);
+	    fclose(fp);
+	} else {
+	    printf("\r\n\r\n--%s\r\n", MJPEG_BOUNDARY);
+	    printf("Content-Type: image/jpeg\r\n");
+	    if (pipe_state.num_cameras > 1)
+		printf("X-Camera: %d\r\n", data->camera);
+	    printf("Content-length: %zd\r\n\r\n", data->offset);
+	    fwrite(data->data, data->offset, 1, stdout);
+//	    printf("\r\n");
+	}
+
+	queue_push(&pipe_state.free_q, data);
+
+	stage_done(&pipe_state.stages[STAGE_OUTPUT], start);
+
+	if (frame_done(cam, captured))
+	    break;
+
+	if (pipe_state.interval)
+	    usleep(pipe_state.interval * 1000);
+    }
+
+    return NULL;
+}
+
+void show_queue(const char *name, queue_t *q)
+{
+    fprintf(stderr, "%-11s = depth avg %.2f max %d/%d, %lu dropped\n",
+	    name, q->pushed ? (double)q->depth_sum / q->pushed : 0.0,
+	    q->depth_max, q->size, q->dropped);
+}
+
+void show_stage(stage_t *stage, unsigned long diff)
+{
+    fprintf(stderr, "%-11s = %lu frames, busy %.1f%%\n",
+	    stage->name, stage->frames,
+	    diff ? (double)stage->busy_us / (diff * 10) : 0.0);
+}
+
+int compare_latency(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+void show_latency(void)
+{
+    static const int percentiles[] = { 50, 90, 99 };
+    unsigned long long sorted[LATENCY_SAMPLES];
+    int i, n;
+
+    n = (pipe_state.latency_count < LATENCY_SAMPLES) ?
+	pipe_state.latency_count : LATENCY_SAMPLES;
+    if (!n)
+	return;
+
+    memcpy(sorted, pipe_state.latency, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), compare_latency);
+
+    fprintf(stderr, "Latency     =");
+    for (i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i++)
+	fprintf(stderr, " p%d %.1fms", percentiles[i],
+		sorted[(n - 1) * percentiles[i] / 100] / 1000.0);
+    fprintf(stderr, " max %.1fms (last %d frames)\n",
+	    sorted[n - 1] / 1000.0, n);
+}
+
+void show_cpu(void)
+{
+    struct rusage usage;
+    struct rusage *start = &pipe_state.start_usage;
+    double cpu;
+
+    getrusage(RUSAGE_SELF, &usage);
+    cpu = (usage.ru_utime.tv_sec - start->ru_utime.tv_sec) * 1000.0 +
+	(usage.ru_utime.tv_usec - start->ru_utime.tv_usec) / 1000.0 +
+	(usage.ru_stime.tv_sec - start->ru_stime.tv_sec) * 1000.0 +
+	(usage.ru_stime.tv_usec - start->ru_stime.tv_usec) / 1000.0;
+
+    fprintf(stderr, "CPU time    = %.1fms (%.2fms per frame)\n",
+	    cpu, cpu / frame_count);
+}
+
+void show_stages(unsigned long diff)
+{
+    shjpeg_sched_stats_t stats;
+    int i;
+
+    for (i = 0; i < pipe_state.num_cameras; i++) {
+	camera_t *cam = &pipe_state.cameras[i];
+
+	if (!shjpeg_sched_get_stats(pipe_state.sched, cam->stream, &stats))
+	    fprintf(stderr, "%-11s = %d frames (%.2ffps), JPU %.1f%%, "
+		    "dropped %lu for rate, %lu late\n",
+		    cam->videodev, cam->frames,
+		    diff ? (double)(cam->frames * 1000) / diff : 0.0,
+		    diff ? (double)stats.busy_us / (diff * 10) : 0.0,
+		    stats.dropped_rate, stats.dropped_late);
+	show_stage(&cam->capture, diff);
+    }
+
+    for (i = 0; i < STAGE_NUM; i++)
+	show_stage(&pipe_state.stages[i], diff);
+
+    show_queue("output queue", &pipe_state.output_q);
+
+    if (pipe_state.errors)
+	fprintf(stderr, "Errors      = %lu\n", pipe_state.errors);
+    if (pipe_state.reused)
+	fprintf(stderr, "Reused      = %lu frames unchanged\n",
+		pipe_state.reused);
+
+    show_latency();
+    show_cpu();
+}
+
+
 void print_usage() {
     fprintf(stderr, 
-	    "Usage: %s [OPTION] [<v4l2 device>]\n", argv0);
+	    "Usage: %s [OPTION] [<v4l2 device>...]\n"
+	    "       %s [OPTION] -I <raw file> [-p <format>]\n", argv0, argv0);
     fprintf(stderr, 
 	    "- Encode frames captured via V4L2 device.\n"
 	    "- Default is to catpure from /dev/video0 and output to stdout.\n"
+	    "- Several devices share the JPU, see -P, -w and -F.\n"
+	    "- Raw frames of the capture size can be read from a file or a\n"
+	    "  pipe (-I -) instead, to benchmark with recorded footage.\n"
 	    "- To transmit over HTTP, use with sighttpd.\n"
 	    "\n"
 	    "Options:\n"
@@ -128,7 +704,33 @@ void print_usage() {
 	    "  -f, --show-fps                     show fps.\n"
 	    "  -s <w>x<h>, --size=<w>x<h>         capture size.\n"
 	    "  -o [<prefix>], --output[=<prefix>] dump to the file.\n"
-	    "  -S, --single			  single buffered (default: double).\n"
+	    "  -m <name>, --shm=<name>            publish to a shared memory ring <name>\n"
+	    "                                     (<name><n> for several devices).\n"
+	    "  -S, --single			  single buffered.\n"
+	    "  -b <n>, --buffers=<n>              # of capture buffers. (Default: 4)\n"
+	    "  -d <n>, --depth=<n>                # of encoded frames queued for output.\n"
+	    "                                     (Default: 4)\n"
+	    "  -Q <quality>, --quality=<quality>  encode quality (1-100).\n"
+	    "  -T <bytes>, --target-size=<bytes>  rate control to <bytes> per frame.\n"
+	    "  -L <bytes>, --limit=<bytes>        hard limit of bytes per frame.\n"
+	    "  -R <rows>, --restart=<rows>        restart marker every <rows> MCU rows.\n"
+	    "                                     (0 disables restart markers)\n"
+	    "  -k <l>[,<n>], --skip=<l>[,<n>]     resend the previous image for frames\n"
+	    "                                     changed by <l> luma levels or less,\n"
+	    "                                     up to <n> in a row. (Default: 25)\n"
+	    "  -P <rr|wfq>, --policy=<rr|wfq>     share the JPU round robin (default)\n"
+	    "                                     or weighted fair.\n"
+	    "  -w <w>[,<w>...], --weight=<w>,...  JPU share of each device. (Default: 1)\n"
+	    "  -F <fps>[,<fps>...], --fps=<fps>,..\n"
+	    "                                     frame rate of each device.\n"
+	    "                                     (Default: 0(=as captured))\n"
+	    "  -I <file>, --input=<file>          read raw frames from <file> ('-' for stdin).\n"
+	    "  -p <format>, --format=<format>     format of the raw frames: nv12, nv16\n"
+	    "                                     (default), ycbcr, gray, rgb16, rgb24\n"
+	    "                                     or rgb32.\n"
+	    "  -r <fps>, --rate=<fps>             read raw frames at <fps>.\n"
+	    "                                     (Default: 0(=as fast as possible))\n"
+	    "  -l, --loop                         read the raw file over and over.\n"
 	    "  -c <count>, --count=<count>        # of JPEGs to capture.\n"
 	    "                                     (Default: 0(=infinite))\n"
 	    "  -i <n>, --interval=<n>             xmit at <n> msec interval. (Default: 0msec)\n");
@@ -150,6 +752,7 @@ void show_fps(int dummy)
 	fprintf(stderr, "Duration    = %ldms\n", diff);
 	fprintf(stderr, "Average     = %lffps\n", 
 		(double)(frame_count * 1000) / diff);
+	show_stages(diff);
     } else {
     	fprintf(stderr, "No frames encoded\n");
     }
@@ -157,24 +760,212 @@ void show_fps(int dummy)
     exit(0);
 }
 
-int main(int argc, char *argv[])
+/* parse a comma separated list of numbers into the cameras */
+int parse_list(const char *arg, int *values, int num)
+{
+    char *end;
+    int i;
+
+    for (i = 0; i < num; i++) {
+	values[i] = strtol(arg, &end, 0);
+	if (end == arg || values[i] < 0)
+	    return -1;
+	if (*end != ',')
+	    break;
+	arg = end + 1;
+    }
+
+    /* the last value applies to the remaining cameras */
+    for (i++; i < num; i++)
+	values[i] = values[i - 1];
+
+    return 0;
+}
+
+/* open a camera and register its buffers in the frame buffer memory */
+int open_camera(camera_t *cam, unsigned int width, unsigned int height,
+		int reqbuf_count, void **mem, size_t *mem_left, int quiet)
 {
-    int i, bufsiz;
-    int vd;
-    char *videodev = "/dev/video0";
-    void *jpeg_virt;
-    size_t jpeg_size;
     struct v4l2_requestbuffers reqbuf;
-    struct {
-	void			*start;
-	size_t	 		 length;
-	struct v4l2_buffer	 buffer;
-    } *buffers;
     enum v4l2_buf_type type;
-    struct v4l2_format fmt;
+    struct v4l2_format fmt_buf, *fmt = &fmt_buf;
     unsigned int page_size = getpagesize();
-    shjpeg_context_t *ctx;
-    sops_data_t data = { .data = NULL, .size = 0L };
+    int i, bufsiz;
+
+    if ((cam->vd = open(cam->videodev, O_RDWR)) < 0) {
+	fprintf(stderr, "Can't open '%s'\n", cam->videodev);
+	return -1;
+    }
+
+    if (!quiet && getinfo(cam->vd))
+	return -1;
+
+    /* prepare capturing */
+    memset(fmt, 0, sizeof(*fmt));
+    fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+//	ioctl(vd, VIDIOC_S_FMT, &fmt);
+    ioctl(cam->vd, VIDIOC_G_FMT, fmt);
+    fmt->fmt.pix.pixelformat = v4l2_fourcc('N', 'V', '1', '6');
+    fmt->fmt.pix.width = width;
+    fmt->fmt.pix.height = height;
+    fmt->fmt.pix.field = V4L2_FIELD_NONE;
+    if (ioctl(cam->vd, VIDIOC_S_FMT, fmt) < 0) {
+    	fprintf(stderr, "VIDIOC_S_FMT failed - %08x, %dx%d\n",
+		fmt->fmt.pix.pixelformat, 
+		fmt->fmt.pix.width,
+		fmt->fmt.pix.height);
+	return -1;
+    }
+    ioctl(cam->vd, VIDIOC_G_FMT, fmt);
+    if (!quiet) {
+	fprintf(stderr, "width=%d (requested %d)\n", 
+		fmt->fmt.pix.width, width);
+	fprintf(stderr, "height=%d (requested %d)\n",
+		fmt->fmt.pix.height, height);
+	fprintf(stderr, "pxformat=%4s\n", (char*)&fmt->fmt.pix.pixelformat);
+	fprintf(stderr, "field=%d\n", fmt->fmt.pix.field);
+	fprintf(stderr, "bytesperline=%d\n", fmt->fmt.pix.bytesperline);
+	fprintf(stderr, "VIDIOC_S_FMT done\n");
+    }
+
+    memset(&reqbuf, 0, sizeof(reqbuf));
+    reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    reqbuf.memory = V4L2_MEMORY_USERPTR;
+    reqbuf.count = reqbuf_count;
+
+    if (ioctl(cam->vd, VIDIOC_REQBUFS, &reqbuf) < 0) {
+	fprintf(stderr, "ioctl REQBUFS failed\n");
+	return -1;
+    }
+    if (!quiet)
+    	fprintf(stderr, "VIDIOC_REQBUFS done\n");
+
+    if (reqbuf.count < reqbuf_count) {
+	fprintf(stderr, "could only get %d buffers (%d requested)\n",
+		reqbuf.count, reqbuf_count);
+	return -1;
+    }
+
+    /* prepare buffer information */
+    cam->nbufs = reqbuf.count;
+    cam->buffers = calloc(reqbuf.count, sizeof(*cam->buffers));
+    bufsiz = fmt->fmt.pix.height * fmt->fmt.pix.bytesperline;
+    bufsiz = (bufsiz + page_size - 1) & ~(page_size - 1);
+
+    if (*mem_left < reqbuf.count * bufsiz) {
+	fprintf(stderr, "not enough frame buffer memory for '%s'\n",
+		cam->videodev);
+	return -1;
+    }
+
+    for(i = 0; i < reqbuf.count; i++) {
+	struct v4l2_buffer buffer;
+
+	if (!quiet)
+	    fprintf(stderr, "registering buffer %d\n", i);
+
+	/* create buffer information to queue */
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buffer.memory = V4L2_MEMORY_USERPTR;
+	buffer.index = i;
+	buffer.length = bufsiz;
+	buffer.m.userptr =  (uint32_t)*mem + i * bufsiz;
+
+	/* queue buffer */
+	if (ioctl(cam->vd, VIDIOC_QBUF, &buffer) < 0) {
+	    perror("ioctl - VIDIOC_QBUF");
+	    fprintf(stderr, "buffer: length=%d, ptr=%08lx\n",
+		    buffer.length, buffer.m.userptr);
+	    return -1;
+	}
+
+	/* copy buffer information */
+	cam->buffers[i].length = buffer.length;
+	cam->buffers[i].start  = *mem + i * bufsiz;
+	cam->buffers[i].camera = cam - pipe_state.cameras;
+
+	memcpy((void*)&cam->buffers[i].buffer, (void*)&buffer, sizeof(buffer));
+
+	/* debug */
+	if (!quiet)
+	    fprintf(stderr,
+		    "buffer %d: addr=%08lx/%p, size=%08x\n",
+		    i, buffer.m.userptr, cam->buffers[i].start, buffer.length);
+    }
+
+    *mem += reqbuf.count * bufsiz;
+    *mem_left -= reqbuf.count * bufsiz;
+
+    cam->format = SHJPEG_PF_NV16;
+    cam->width = fmt->fmt.pix.width;
+    cam->height = fmt->fmt.pix.height;
+    cam->pitch = fmt->fmt.pix.width;
+
+    /* start capturing */
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl(cam->vd, VIDIOC_STREAMON, &type) < 0) {
+	perror("ioctl - VIDIOC_STREAMON");
+	return -1;
+    }
+
+    return 0;
+}
+
+/* open a raw frame source and set up its pool of buffers */
+int open_raw(camera_t *cam, int nbufs, void **mem, size_t *mem_left)
+{
+    unsigned int page_size = getpagesize();
+    size_t bufsiz;
+    int i;
+
+    if (!strcmp(cam->videodev, "-"))
+	cam->vd = 0;
+    else if ((cam->vd = open(cam->videodev, O_RDONLY)) < 0) {
+	fprintf(stderr, "Can't open '%s'\n", cam->videodev);
+	return -1;
+    }
+
+    cam->pitch = SHJPEG_PF_PITCH_MULTIPLY(cam->format) * cam->width;
+    cam->frame_size = SHJPEG_PF_PLANE_MULTIPLY(cam->format, cam->height) *
+	cam->pitch;
+
+    /* the size of the frames to encode */
+    cam->ctx->width = cam->width;
+    cam->ctx->height = cam->height;
+    cam->ctx->pitch = cam->pitch;
+    bufsiz = (cam->frame_size + page_size - 1) & ~(page_size - 1);
+
+    if (*mem_left < nbufs * bufsiz) {
+	fprintf(stderr, "not enough frame buffer memory for %d frames\n",
+		nbufs);
+	return -1;
+    }
+
+    cam->nbufs = nbufs;
+    cam->buffers = calloc(nbufs, sizeof(*cam->buffers));
+    queue_init(&cam->pool, nbufs);
+
+    for (i = 0; i < nbufs; i++) {
+	cam->buffers[i].start = *mem + i * bufsiz;
+	cam->buffers[i].length = bufsiz;
+	cam->buffers[i].camera = cam - pipe_state.cameras;
+	queue_push(&cam->pool, &cam->buffers[i]);
+    }
+
+    *mem += nbufs * bufsiz;
+    *mem_left -= nbufs * bufsiz;
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int i;
+    void *jpeg_virt;
+    size_t jpeg_size;
+    sops_data_t *outbufs;
+    pthread_t encoder, writer;
     int verbose = 0;
     int interval = 0;
     int quiet = 0;
@@ -184,7 +975,22 @@ int main(int argc, char *argv[])
     int num_count = 0;
     unsigned int width = 640;
     unsigned int height = 480;
-    int reqbuf_count = 2;
+    int reqbuf_count = 4;
+    int depth = 4;
+    int quality = 0;
+    size_t target_size = 0;
+    size_t size_limit = 0;
+    int restart_rows = -1;
+    int skip_level = -1, skip_frames = 25;
+    shjpeg_sched_policy policy = SHJPEG_SCHED_ROUND_ROBIN;
+    char *weights = NULL;
+    char *rates = NULL;
+    int values[MAX_CAMERAS];
+    char *input = NULL;
+    shjpeg_pixelformat raw_format = SHJPEG_PF_NV16;
+    int raw_rate = 0;
+    int loop = 0;
+    char *shm = NULL;
 
     argv0 = argv[0];
 
@@ -201,10 +1007,25 @@ int main(int argc, char *argv[])
 	    {"size", 1, 0, 's'},
 	    {"interval", 1, 0, 'i'},
 	    {"single", 0, 0, 'S'},
+	    {"buffers", 1, 0, 'b'},
+	    {"depth", 1, 0, 'd'},
+	    {"quality", 1, 0, 'Q'},
+	    {"target-size", 1, 0, 'T'},
+	    {"limit", 1, 0, 'L'},
+	    {"restart", 1, 0, 'R'},
+	    {"skip", 1, 0, 'k'},
+	    {"policy", 1, 0, 'P'},
+	    {"weight", 1, 0, 'w'},
+	    {"fps", 1, 0, 'F'},
+	    {"input", 1, 0, 'I'},
+	    {"format", 1, 0, 'p'},
+	    {"rate", 1, 0, 'r'},
+	    {"loop", 0, 0, 'l'},
+	    {"shm", 1, 0, 'm'},
 	    {0, 0, 0, 0}
 	};
 
-	if ((c = getopt_long(argc, argv, "hvqfo::c:i:s:S",
+	if ((c = getopt_long(argc, argv, "hvqfo::c:i:s:Sb:d:Q:T:L:R:k:P:w:F:I:p:r:lm:",
 			     long_options, &option_index)) == -1)
 	    break;
 
@@ -257,6 +1078,98 @@ int main(int argc, char *argv[])
 	    reqbuf_count = 1;
 	    break;
 
+	case 'b':
+	    reqbuf_count = strtol(optarg, NULL, 0);
+	    if (reqbuf_count < 1) {
+		fprintf(stderr, "need at least one capture buffer.\n");
+		return 1;
+	    }
+	    break;
+
+	case 'd':
+	    depth = strtol(optarg, NULL, 0);
+	    if (depth < 1) {
+		fprintf(stderr, "output queue depth must be positive.\n");
+		return 1;
+	    }
+	    break;
+
+	case 'Q':
+	    quality = strtol(optarg, NULL, 0);
+	    break;
+
+	case 'T':
+	    target_size = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'L':
+	    size_limit = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 'R':
+	    restart_rows = strtol(optarg, NULL, 0);
+	    break;
+
+	case 'k':
+	    sscanf(optarg, "%d,%d", &skip_level, &skip_frames);
+	    break;
+
+	case 'P':
+	    if (!strcmp(optarg, "rr"))
+		policy = SHJPEG_SCHED_ROUND_ROBIN;
+	    else if (!strcmp(optarg, "wfq"))
+		policy = SHJPEG_SCHED_WEIGHTED_FAIR;
+	    else {
+		fprintf(stderr, "unknown policy '%s'.\n", optarg);
+		return 1;
+	    }
+	    break;
+
+	case 'w':
+	    weights = optarg;
+	    break;
+
+	case 'F':
+	    rates = optarg;
+	    break;
+
+	case 'I':
+	    input = optarg;
+	    break;
+
+	case 'p':
+	    if (!strcmp(optarg, "nv12"))
+		raw_format = SHJPEG_PF_NV12;
+	    else if (!strcmp(optarg, "nv16"))
+		raw_format = SHJPEG_PF_NV16;
+	    else if (!strcmp(optarg, "ycbcr"))
+		raw_format = SHJPEG_PF_YCbCr;
+	    else if (!strcmp(optarg, "gray"))
+		raw_format = SHJPEG_PF_GRAYSCALE;
+	    else if (!strcmp(optarg, "rgb16"))
+		raw_format = SHJPEG_PF_RGB16;
+	    else if (!strcmp(optarg, "rgb24"))
+		raw_format = SHJPEG_PF_RGB24;
+	    else if (!strcmp(optarg, "rgb32"))
+		raw_format = SHJPEG_PF_RGB32;
+	    else {
+		fprintf(stderr, "unknown format '%s'.\n", optarg);
+		return 1;
+	    }
+	    break;
+
+	case 'r':
+	    raw_rate = strtol(optarg, NULL, 0);
+	    break;
+
+	case 'l':
+	    loop = 1;
+	    break;
+
+	case 'm':
+	    shm = optarg;
+	    break;
+
 	default:
 	    fprintf(stderr, "unknown option 0%x.\n", c);
 	    print_usage();
@@ -264,190 +1177,222 @@ int main(int argc, char *argv[])
 	}
     }
 
-    videodev = argv[optind] ? argv[optind] : videodev;
-
-    /* set signal handler */
-    if (fps)
-	signal(SIGINT, show_fps);
-
-    /* ready */
-    if (!(ctx = shjpeg_init(verbose)))
-	return 1;
-
-    if (shjpeg_get_frame_buffer(ctx, &jpeg_virt, &jpeg_size ))
-	return 1;
+    /* raw frames instead of devices */
+    if (input) {
+	camera_t *cam = &pipe_state.cameras[pipe_state.num_cameras++];
 
-    if (!quiet)
-	fprintf(stderr, "jpeg mem buffer at %p, size = 0x%08x\n", jpeg_virt, jpeg_size);
+	if (optind < argc) {
+	    fprintf(stderr, "can't read raw frames and capture at once.\n");
+	    return 1;
+	}
 
-    if ((vd = open(videodev, O_RDWR)) < 0) {
-	fprintf(stderr, "Can't open '%s'\n", videodev);
-	return 1;
+	cam->videodev = input;
+	cam->raw = 1;
+	cam->loop = loop;
+	cam->rate = raw_rate;
+	cam->format = raw_format;
+	cam->width = width;
+	cam->height = height;
     }
 
-    if (!quiet && getinfo(vd))
-	return 1;
-
-    /* prepare capturing */
-    memset(&fmt, 0, sizeof(fmt));
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-//	ioctl(vd, VIDIOC_S_FMT, &fmt);
-    ioctl(vd, VIDIOC_G_FMT, &fmt);
-    fmt.fmt.pix.pixelformat = v4l2_fourcc('N', 'V', '1', '6');
-    fmt.fmt.pix.width = width;
-    fmt.fmt.pix.height = height;
-    fmt.fmt.pix.field = V4L2_FIELD_NONE;
-    if (ioctl(vd, VIDIOC_S_FMT, &fmt) < 0) {
-    	fprintf(stderr, "VIDIOC_S_FMT failed - %08x, %dx%d\n",
-		fmt.fmt.pix.pixelformat, 
-		fmt.fmt.pix.width,
-		fmt.fmt.pix.height);
-	return 1;
-    }
-    ioctl(vd, VIDIOC_G_FMT, &fmt);
-    if (!quiet) {
-	fprintf(stderr, "width=%d (requested %d)\n", 
-		fmt.fmt.pix.width, width);
-	fprintf(stderr, "height=%d (requested %d)\n",
-		fmt.fmt.pix.height, height);
-	fprintf(stderr, "pxformat=%4s\n", (char*)&fmt.fmt.pix.pixelformat);
-	fprintf(stderr, "field=%d\n", fmt.fmt.pix.field);
-	fprintf(stderr, "bytesperline=%d\n", fmt.fmt.pix.bytesperline);
-	fprintf(stderr, "VIDIOC_S_FMT done\n");
+    /* devices to capture from */
+    for (i = optind; i < argc; i++) {
+	if (pipe_state.num_cameras == MAX_CAMERAS) {
+	    fprintf(stderr, "too many devices (max %d).\n", MAX_CAMERAS);
+	    return 1;
+	}
+	pipe_state.cameras[pipe_state.num_cameras++].videodev = argv[i];
     }
+    if (!pipe_state.num_cameras)
+	pipe_state.cameras[pipe_state.num_cameras++].videodev = "/dev/video0";
 
-    memset(&reqbuf, 0, sizeof(reqbuf));
-    reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    reqbuf.memory = V4L2_MEMORY_USERPTR;
-    reqbuf.count = reqbuf_count;
+    for (i = 0; i < pipe_state.num_cameras; i++) {
+	pipe_state.cameras[i].weight = 1;
+	pipe_state.cameras[i].fps = 0;
+    }
 
-    if (ioctl(vd, VIDIOC_REQBUFS, &reqbuf) < 0) {
-	fprintf(stderr, "ioctl REQBUFS failed\n");
-	return 1;
+    if (weights) {
+	if (parse_list(weights, values, pipe_state.num_cameras)) {
+	    fprintf(stderr, "invalid weights '%s'.\n", weights);
+	    return 1;
+	}
+	for (i = 0; i < pipe_state.num_cameras; i++)
+	    pipe_state.cameras[i].weight = values[i];
     }
-    if (!quiet)
-    	fprintf(stderr, "VIDIOC_REQBUFS done\n");
 
-    if (reqbuf.count < reqbuf_count) {
-	fprintf(stderr, "could only get %d buffers (%d requested)\n",
-		reqbuf.count, reqbuf_count);
-	return 1;
+    if (rates) {
+	if (parse_list(rates, values, pipe_state.num_cameras)) {
+	    fprintf(stderr, "invalid frame rates '%s'.\n", rates);
+	    return 1;
+	}
+	for (i = 0; i < pipe_state.num_cameras; i++)
+	    pipe_state.cameras[i].fps = values[i];
     }
 
-    /* prepare buffer information */
-    buffers = calloc(reqbuf.count, sizeof(*buffers));
-    bufsiz = fmt.fmt.pix.height * fmt.fmt.pix.bytesperline;
-    bufsiz = (bufsiz + page_size - 1) & ~(page_size - 1);
+    /* set signal handler */
+    if (fps)
+	signal(SIGINT, show_fps);
 
-    for(i = 0; i < reqbuf.count; i++) {
-	struct v4l2_buffer buffer;
+    if (!(pipe_state.sched = shjpeg_sched_new(policy)))
+	return 1;
 
-	if (!quiet)
-	    fprintf(stderr, "registering buffer %d\n", i);
+    /* ready, a context for each camera */
+    for (i = 0; i < pipe_state.num_cameras; i++) {
+	shjpeg_context_t *ctx;
 
-	/* create buffer information to queue */
-	memset(&buffer, 0, sizeof(buffer));
-	buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buffer.memory = V4L2_MEMORY_USERPTR;
-	buffer.index = i;
-	buffer.length = bufsiz;
-	buffer.m.userptr =  (uint32_t)jpeg_virt + i * bufsiz;
+	if (!(ctx = shjpeg_init(verbose)))
+	    return 1;
+	pipe_state.cameras[i].ctx = ctx;
 
-	/* queue buffer */
-	if (ioctl(vd, VIDIOC_QBUF, &buffer) < 0) {
-	    perror("ioctl - VIDIOC_QBUF");
-	    fprintf(stderr, "buffer: length=%d, ptr=%08lx\n",
-		    buffer.length, buffer.m.userptr);
+	if (quality && shjpeg_encode_set_quality(ctx, quality)) {
+	    fprintf(stderr, "invalid quality %d.\n", quality);
 	    return 1;
 	}
 
-	/* copy buffer information */
-	buffers[i].length = buffer.length;
-	buffers[i].start  = jpeg_virt + i * bufsiz;
+	if (target_size &&
+	    shjpeg_encode_set_target_size(ctx, target_size, size_limit)) {
+	    fprintf(stderr, "invalid target size.\n");
+	    return 1;
+	}
 
-	memcpy((void*)&buffers[i].buffer, (void*)&buffer, sizeof(buffer));
+	if (restart_rows >= 0 &&
+	    shjpeg_encode_set_restart_rows(ctx, restart_rows)) {
+	    fprintf(stderr, "invalid restart interval %d.\n", restart_rows);
+	    return 1;
+	}
 
-	/* debug */
-	if (!quiet)
-	    fprintf(stderr,
-		    "buffer %d: addr=%08lx/%p, size=%08x\n",
-		    i, buffer.m.userptr, buffers[i].start, buffer.length);
+	/* set sops callbacks */
+	ctx->sops = &my_sops;
     }
 
-    /* start capturing */
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(vd, VIDIOC_STREAMON, &type) < 0) {
-	perror("ioctl - VIDIOC_STREAMON");
+    if (shjpeg_get_frame_buffer(pipe_state.cameras[0].ctx,
+				&jpeg_virt, &jpeg_size ))
 	return 1;
-    }
-
-    /* set sops callbacks */
-    ctx->sops = &my_sops;
-    ctx->priv_data = &data;
 
-    /* now ready to capture */
     if (!quiet)
-	fprintf(stderr, "Starting Encoding...\n");
+	fprintf(stderr, "jpeg mem buffer at %p, size = 0x%08x\n", jpeg_virt, jpeg_size);
 
-    frame_count = 0;
-    gettimeofday(&start_tv, NULL);
-    while(1) {
-	struct v4l2_buffer buffer;
+    for (i = 0; i < pipe_state.num_cameras; i++) {
+	camera_t *cam = &pipe_state.cameras[i];
 
-	/* capture */
-	memset(&buffer, 0, sizeof(buffer));
-	buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buffer.memory= V4L2_MEMORY_USERPTR;
-	if (ioctl(vd, VIDIOC_DQBUF, &buffer) < 0) {
-	    perror("ioctl - VIDIOC_DQBUF");
+	if (cam->raw) {
+	    if (open_raw(cam, reqbuf_count, &jpeg_virt, &jpeg_size))
+		return 1;
+	} else if (open_camera(cam, width, height, reqbuf_count,
+			       &jpeg_virt, &jpeg_size, quiet))
 	    return 1;
-	}
 
-	shjpeg_encode(ctx, SHJPEG_PF_NV16, buffers[buffer.index].start,
-		      fmt.fmt.pix.width, fmt.fmt.pix.height, 
-		      fmt.fmt.pix.width);
-		
-	/* queue again */
-	if (ioctl(vd, VIDIOC_QBUF, &buffer) < 0) {
-	    perror("ioctl - VIDIOC_QBUF");
+	/* The encoder holds one capture buffer and the driver needs
+	   one, the rest can wait for the encoder. All the buffers of
+	   a raw source can wait, so none of its frames is dropped. */
+	cam->stream = shjpeg_sched_add_stream(pipe_state.sched, cam->weight,
+					      cam->fps,
+					      cam->raw ? cam->nbufs :
+					      (cam->nbufs > 2) ?
+					      cam->nbufs - 2 : 1);
+	if (cam->stream < 0) {
+	    fprintf(stderr, "can't schedule '%s'.\n", cam->videodev);
 	    return 1;
 	}
+	cam->capture.name = "capture";
+    }
 
-	// output buffered data
-	if (output) {
-	    FILE *fp;
-	    char fn[64];
+    /* Rings of frames no larger than the raw frames, as the encode
+       stops once a frame would not fit. */
+    for (i = 0; shm && i < pipe_state.num_cameras; i++) {
+	camera_t *cam = &pipe_state.cameras[i];
+	size_t slot_size = size_limit;
+	char name[64];
 
-	    snprintf(fn, sizeof(fn), "%s%03d.jpg", prefix, frame_count);
+	if (!slot_size)
+	    slot_size = SHJPEG_PF_PLANE_MULTIPLY(cam->format, cam->height) *
+		SHJPEG_PF_PITCH_MULTIPLY(cam->format) * cam->width;
 
-	    if ((fp = fopen(fn, "w")) == NULL) {
-	    	fprintf(stderr, "Can't create file: %s\n", fn);
-		return 1;
-	    }
-	    fwrite(data.data, data.offset, 1, fp);
-	    fclose(fp);
-	} else {
-	    printf("\r\n\r\n--%s\r\n", MJPEG_BOUNDARY);
-	    printf("Content-Type: image/jpeg\r\n");
-	    printf("Content-length: %d\r\n\r\n", data.offset);
-	    fwrite(data.data, data.offset, 1, stdout);
-//	    printf("\r\n");
+	if (pipe_state.num_cameras > 1)
+	    snprintf(name, sizeof(name), "%s%d", shm, i);
+	else
+	    snprintf(name, sizeof(name), "%s", shm);
+
+	if (!(cam->ring = shjpeg_ring_create(name, RING_SLOTS, slot_size))) {
+	    perror("shjpeg_ring_create");
+	    return 1;
 	}
+	shjpeg_ring_attach(cam->ring, cam->ctx);
+	shjpeg_encode_set_max_size(cam->ctx, slot_size);
+    }
 
-	if (!quiet)
-	    fprintf(stderr, "+");
-	fflush(stderr);
+    /* Keep the JPU programmed between frames unless rate controlled.
+       With several cameras, the contexts take turns on the JPU, so
+       it can't be held by any of them. */
+    pipe_state.session = !target_size;
+    for (i = 0; pipe_state.session && i < pipe_state.num_cameras; i++) {
+	camera_t *cam = &pipe_state.cameras[i];
+
+	if (pipe_state.num_cameras == 1)
+	    shjpeg_encode_stream_set_hold(cam->ctx, 1);
+	if (shjpeg_encode_stream_begin(cam->ctx, cam->format,
+				       cam->width, cam->height,
+				       cam->pitch, 0)) {
+	    fprintf(stderr, "can't start the encode stream.\n");
+	    return 1;
+	}
+	if (skip_level >= 0 &&
+	    shjpeg_encode_stream_set_skip(cam->ctx, skip_level, skip_frames)) {
+	    fprintf(stderr, "invalid skip level %d.\n", skip_level);
+	    return 1;
+	}
+    }
 
-	frame_count++;
-	if ((num_count > 0) && (num_count <= frame_count))
-	    break;
+    /* An output buffer is in use by each of the encoder and the
+       writer. */
+    pipe_state.output = output;
+    pipe_state.prefix = prefix;
+    pipe_state.quiet = quiet;
+    pipe_state.interval = interval;
+    pipe_state.num_count = num_count;
+
+    queue_init(&pipe_state.output_q, depth);
+    queue_init(&pipe_state.free_q, depth + 2);
+
+    outbufs = calloc(depth + 2, sizeof(*outbufs));
+    for (i = 0; i < depth + 2; i++)
+	queue_push(&pipe_state.free_q, &outbufs[i]);
 
-	if (interval)
-	    usleep(interval * 1000);
+    /* now ready to capture */
+    if (!quiet)
+	fprintf(stderr, "Starting Encoding...\n");
+
+    frame_count = 0;
+    gettimeofday(&start_tv, NULL);
+    getrusage(RUSAGE_SELF, &pipe_state.start_usage);
+
+    pthread_create(&encoder, NULL, encode_thread, NULL);
+    pthread_create(&writer, NULL, output_thread, NULL);
+    for (i = 0; i < pipe_state.num_cameras; i++)
+	pthread_create(&pipe_state.cameras[i].thread, NULL,
+		       pipe_state.cameras[i].raw ? read_thread : capture_thread,
+		       &pipe_state.cameras[i]);
+
+    for (i = 0; i < pipe_state.num_cameras; i++)
+	pthread_join(pipe_state.cameras[i].thread, NULL);
+
+    shjpeg_sched_close(pipe_state.sched);
+    pthread_join(encoder, NULL);
+    pthread_join(writer, NULL);
+
+    for (i = 0; i < pipe_state.num_cameras; i++) {
+	shjpeg_encode_stream_end(pipe_state.cameras[i].ctx);
+	if (pipe_state.cameras[i].ring && !quiet)
+	    fprintf(stderr, "%s: %lu frames dropped by the ring\n",
+		    pipe_state.cameras[i].videodev,
+		    shjpeg_ring_dropped(pipe_state.cameras[i].ring));
     }
 
     if (fps)
     	show_fps(0);
 
+    for (i = 0; i < pipe_state.num_cameras; i++)
+	shjpeg_ring_close(pipe_state.cameras[i].ring);
+
     return 0;
 }